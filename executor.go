@@ -559,10 +559,6 @@ func (exe *Executor) RealSenseTrainPack(ctx context.Context, packID, graspID str
 	prefix := path.Join(packDir, packID) + "-"
 
 	numFrames := 5
-	if err := exe.rss.TakeSnapshot(ctx, prefix, numFrames); err != nil {
-		return fmt.Errorf("failed to take a RealSense snapshot (%d frames): %v", numFrames, err)
-	}
-	// Now, it's time to write parameters.json with the pose and possibly other values.
 	p := &RealSenseTrainPackParams{
 		PackID:    packID,
 		GraspID:   graspID,
@@ -574,6 +570,21 @@ func (exe *Executor) RealSenseTrainPack(ctx context.Context, packID, graspID str
 		Yaw:       yaw,
 		NumFrames: numFrames,
 	}
+	if ps, ok := exe.rss.(PackSnapshotter); ok && ps.PackEnabled() {
+		// The parameters go into the pack file, so they must fit on the request line.
+		data, err := json.Marshal(p)
+		if err != nil {
+			return fmt.Errorf("failed to serialize RealSense Train Pack params to JSON: %v", err)
+		}
+		if err := ps.TakePack(ctx, prefix, numFrames, data); err != nil {
+			return fmt.Errorf("failed to take a RealSense pack (%d frames): %v", numFrames, err)
+		}
+		return nil
+	}
+	if err := exe.rss.TakeSnapshot(ctx, prefix, numFrames); err != nil {
+		return fmt.Errorf("failed to take a RealSense snapshot (%d frames): %v", numFrames, err)
+	}
+	// Now, it's time to write parameters.json with the pose and possibly other values.
 	data, err := json.MarshalIndent(p, "", "  ")
 	if err != nil {
 		return fmt.Errorf("failed to serialize RealSense Train Pack params to JSON: %v", err)
@@ -588,6 +599,22 @@ func (exe *Executor) Snapshot(ctx context.Context) error {
 	if exe.rss == nil {
 		return errors.New("no means to take a snapshot are configured (RealSense, RGB camera, radar, etc)")
 	}
+	if fs, ok := exe.rss.(FrameSnapshotter); ok && fs.FramesEnabled() {
+		images, err := fs.TakeFrames(ctx, "realsense-")
+		if err == ErrUnchanged {
+			exe.up.logf("Skipping the snapshot, as nothing has changed since the last one")
+			return nil
+		}
+		if err != nil {
+			return fmt.Errorf("failed to take a RealSense snapshot: %v", err)
+		}
+		cameras := make(map[string]string)
+		for name, data := range images {
+			cameras[name] = dataurl.EncodeBytes(data)
+		}
+		exe.up.NotifySnapshot(cameras)
+		return nil
+	}
 	dirName, err := ioutil.TempDir("", "robosla-shell-snapshot-")
 	if err != nil {
 		return fmt.Errorf("failed to create a temp directory")
@@ -596,7 +623,16 @@ func (exe *Executor) Snapshot(ctx context.Context) error {
 	defer os.RemoveAll(dirName)
 
 	prefix := path.Join(dirName, "realsense-")
-	if err := exe.rss.TakeSnapshot(ctx, prefix, 1 /*numFrames*/); err != nil {
+	if ls, ok := exe.rss.(LiveSnapshotter); ok {
+		err = ls.TakeLiveSnapshot(ctx, prefix)
+	} else {
+		err = exe.rss.TakeSnapshot(ctx, prefix, 1 /*numFrames*/)
+	}
+	if err == ErrUnchanged {
+		exe.up.logf("Skipping the snapshot, as nothing has changed since the last one")
+		return nil
+	}
+	if err != nil {
 		return fmt.Errorf("failed to take a RealSense snapshot: %v", err)
 	}
 
@@ -614,11 +650,33 @@ func (exe *Executor) Snapshot(ctx context.Context) error {
 		}
 		cameras[fname[:len(fname)-len(path.Ext(fname))]] = dataurl.EncodeBytes(data)
 	}
+	// The browser can't show the 16-bit depth, so the depth previews, if any, go in its place.
+	for name, data := range cameras {
+		if strings.HasSuffix(name, "depth-preview") {
+			cameras[strings.TrimSuffix(name, "-preview")] = data
+			delete(cameras, name)
+		}
+	}
 	exe.up.NotifySnapshot(cameras)
 
 	return nil
 }
 
+// Preview forwards the live preview of the cameras to the uplink until ctx is done.
+func (exe *Executor) Preview(ctx context.Context) error {
+	ps, ok := exe.rss.(PreviewSnapshotter)
+	if !ok || !ps.PreviewEnabled() {
+		return errors.New("no preview capable camera is configured")
+	}
+	return ps.Preview(ctx, "realsense-", func(images map[string][]byte) {
+		cameras := make(map[string]string)
+		for name, data := range images {
+			cameras[name] = dataurl.EncodeBytes(data)
+		}
+		exe.up.NotifySnapshot(cameras)
+	})
+}
+
 func (exe *Executor) NotifyMovingState(state string) {
 	exe.stateMu.Lock()
 	was := exe.state
@@ -62,7 +62,27 @@ func main() {
 
 	var rss Snapshotter
 	if *realSense {
-		rss = &RealSenseSnapshotter{up: up}
+		rs := &RealSenseSnapshotter{up: up, pipelined: *realSensePipelined, batch: *realSenseBatch, pack: *realSensePack,
+			statsEvery: *realSenseStatsEvery, cameras: *realSenseCameras, burst: *realSenseBurst,
+			colorProfile: *realSenseColorProfile, depthProfile: *realSenseDepthProfile,
+			depthFilters: *realSenseDepthFilters, decimation: *realSenseDecimation, shm: *realSenseShm,
+			previewSocket: *realSensePreviewSocket, roi: *realSenseROI, scale: *realSenseScale,
+			pointCloud: *realSensePointCloud, writeThread: *realSenseWriteThread, durability: *realSenseDurability,
+			tagged: *realSenseTagged || *realSensePriorities, daemonSocket: *realSenseDaemonSocket,
+			ifChanged: *realSenseIfChanged, priorities: *realSensePriorities,
+			depthPreview: *realSenseDepthPreview, depthPreviewRange: *realSenseDepthPreviewRange,
+			metrics: *realSenseMetrics, metricsFile: *realSenseMetricsFile,
+			uploadSocket: *realSenseUploadSocket, uploadCompression: *realSenseUploadCompression}
+		if *realSensePrewarm {
+			go rs.Prewarm()
+		}
+		if *realSenseUploadSocket != "" {
+			if *realSenseUploadURL == "" || !*realSensePack {
+				failf("--realsense_upload_socket requires --realsense_upload_url and --realsense_pack")
+			}
+			go rs.RunUpload(*realSenseUploadURL)
+		}
+		rss = rs
 	}
 	if deviceName == "31dee22c9761f639" /* Wanhao-06 */ {
 		rss = &RaspistillSnapshotter{up: up}
@@ -0,0 +1,96 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net"
+)
+
+// Preview stream of realsense-snapshot. See tools/realsense/preview-stream.h.
+const (
+	previewHeaderSize = 64
+	previewKindColor  = 0
+	previewKindDepth  = 1
+	// Way more than a downscaled preview JPEG ever takes.
+	previewMaxImageSize = 8 << 20
+)
+
+func (rss *RealSenseSnapshotter) PreviewEnabled() bool {
+	return rss.previewSocket != ""
+}
+
+// Preview streams the live preview of realsense-snapshot until ctx is done.
+// fn gets the color and the colorized depth of a frame, keyed the same way as by TakeFrames.
+// Snapshots are served as usual while the preview is running.
+func (rss *RealSenseSnapshotter) Preview(ctx context.Context, prefix string, fn func(images map[string][]byte)) error {
+	rss.mu.Lock()
+	err := rss.start()
+	rss.mu.Unlock()
+	if err != nil {
+		return err
+	}
+	var d net.Dialer
+	conn, err := d.DialContext(ctx, "unix", rss.previewSocket)
+	if err != nil {
+		return fmt.Errorf("failed to connect to the realsense-snapshot preview: %v", err)
+	}
+	defer conn.Close()
+	go func() {
+		<-ctx.Done()
+		conn.Close()
+	}()
+
+	// The color image of every camera waits here for the depth one of the same frame.
+	type pending struct {
+		frameNumber uint64
+		color       []byte
+	}
+	colors := make(map[string]pending)
+	header := make([]byte, previewHeaderSize)
+	for {
+		if _, err := io.ReadFull(conn, header); err != nil {
+			if ctx.Err() != nil {
+				return nil
+			}
+			return fmt.Errorf("failed to read the realsense-snapshot preview: %v", err)
+		}
+		if !bytes.Equal(header[:4], []byte("RSPV")) {
+			return fmt.Errorf("unexpected realsense-snapshot preview frame header: %q", header[:4])
+		}
+		kind := header[4]
+		size := binary.LittleEndian.Uint32(header[8:])
+		frameNumber := binary.LittleEndian.Uint64(header[16:])
+		camera := header[32:64]
+		if n := bytes.IndexByte(camera, 0); n >= 0 {
+			camera = camera[:n]
+		}
+		if size > previewMaxImageSize {
+			return fmt.Errorf("realsense-snapshot preview frame is too large: %d bytes", size)
+		}
+		data := make([]byte, size)
+		if _, err := io.ReadFull(conn, data); err != nil {
+			if ctx.Err() != nil {
+				return nil
+			}
+			return fmt.Errorf("failed to read the realsense-snapshot preview: %v", err)
+		}
+		tag := prefix
+		if len(camera) > 0 {
+			tag += string(camera) + "-"
+		}
+		switch kind {
+		case previewKindColor:
+			colors[tag] = pending{frameNumber: frameNumber, color: data}
+		case previewKindDepth:
+			p, ok := colors[tag]
+			if !ok || p.frameNumber != frameNumber {
+				continue
+			}
+			delete(colors, tag)
+			fn(map[string][]byte{tag + "color": p.color, tag + "depth": data})
+		}
+	}
+}
@@ -0,0 +1,205 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"math"
+	"os"
+	"runtime"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// Layout of the shared-memory frame ring. See tools/realsense/shm-ring.h.
+const (
+	shmRingVersion    = 3
+	shmRingHeaderSize = 64
+	shmSlotHeaderSize = 128
+	shmTagSize        = 32
+	// Offset of ShmRingHeader::published, the futex word, followed by pid.
+	shmPublishedOffset = 20
+	// Offset of ShmSlotHeader::request in a slot, followed by index and count.
+	shmRequestOffset = 64
+	// FUTEX_WAIT, not the private one: the word is shared with realsense-snapshot.
+	futexWait = 0
+	// How long waitRequest sleeps on the futex, before it checks, if it's still needed.
+	shmStopCheckPeriod = 100 * time.Millisecond
+)
+
+// shmFrame is an encoded frame read from the shared-memory ring.
+type shmFrame struct {
+	// File name part of the frame, e.g. "front-03-".
+	tag         string
+	frameNumber uint64
+	timestamp   float64
+	color       []byte
+	depth       []byte
+	// Token of the request, and the frame's index out of count frames of the request.
+	request uint32
+	index   uint32
+	count   uint32
+}
+
+// shmRing reads the frames realsense-snapshot publishes into /dev/shm/<name> for the shm requests.
+// It's unmapped, once nobody uses it anymore.
+type shmRing struct {
+	data     []byte
+	numSlots uint32
+	slotSize uint32
+	// Of the writer, realsense-snapshot.
+	pid int
+}
+
+// openShmRing maps /dev/shm/<name>, unless it's left over by a realsense-snapshot, which is gone.
+func openShmRing(name string) (*shmRing, error) {
+	f, err := os.Open("/dev/shm/" + strings.TrimPrefix(name, "/"))
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	fi, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if fi.Size() < shmRingHeaderSize {
+		return nil, fmt.Errorf("shared memory ring %s is too small: %d bytes", name, fi.Size())
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(fi.Size()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("failed to mmap shared memory ring %s: %v", name, err)
+	}
+	r := &shmRing{
+		data:     data,
+		numSlots: binary.LittleEndian.Uint32(data[12:]),
+		slotSize: binary.LittleEndian.Uint32(data[16:]),
+		pid:      int(binary.LittleEndian.Uint32(data[shmPublishedOffset+4:])),
+	}
+	if !bytes.Equal(data[:8], []byte("RSSHM\x00\x00\x00")) || binary.LittleEndian.Uint32(data[8:]) != shmRingVersion {
+		syscall.Munmap(data)
+		return nil, fmt.Errorf("%s is not a version %d shared memory frame ring", name, shmRingVersion)
+	}
+	if r.numSlots == 0 || r.slotSize < shmSlotHeaderSize ||
+		int64(shmRingHeaderSize)+int64(r.numSlots)*int64(r.slotSize) > fi.Size() {
+		syscall.Munmap(data)
+		return nil, fmt.Errorf("shared memory ring %s has an inconsistent header", name)
+	}
+	if !r.writerAlive() {
+		syscall.Munmap(data)
+		return nil, fmt.Errorf("shared memory ring %s is left over by realsense-snapshot %d, which is gone", name, r.pid)
+	}
+	runtime.SetFinalizer(r, (*shmRing).Close)
+	return r, nil
+}
+
+func (r *shmRing) Close() error {
+	runtime.SetFinalizer(r, nil)
+	return syscall.Munmap(r.data)
+}
+
+// writerAlive returns false, once the realsense-snapshot, which writes the ring, is gone.
+func (r *shmRing) writerAlive() bool {
+	// EPERM is a process of somebody else: realsense-snapshot runs as another user.
+	return r.pid > 0 && syscall.Kill(r.pid, 0) != syscall.ESRCH
+}
+
+func (r *shmRing) word(off int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&r.data[off]))
+}
+
+func (r *shmRing) slotOffset(id uint32) int {
+	return shmRingHeaderSize + int((id-1)%r.numSlots)*int(r.slotSize)
+}
+
+// published returns the id of the latest published frame, 0 if there's none yet.
+func (r *shmRing) published() uint32 {
+	return atomic.LoadUint32(r.word(shmPublishedOffset))
+}
+
+// requestOf returns the request token in the slot of the frame id. It's only a hint: the slot may be
+// overwritten, until read checks its seq.
+func (r *shmRing) requestOf(id uint32) uint32 {
+	return atomic.LoadUint32(r.word(r.slotOffset(id) + shmRequestOffset))
+}
+
+// waitPublished waits until a frame after the id seen is published, or the timeout runs out.
+func (r *shmRing) waitPublished(seen uint32, timeout time.Duration) {
+	ts := syscall.NsecToTimespec(int64(timeout))
+	// FUTEX_WAIT returns right away, if published is not seen anymore. Its errors, EAGAIN, EINTR
+	// and ETIMEDOUT, all mean the same to the caller: look again.
+	syscall.Syscall6(syscall.SYS_FUTEX, uintptr(unsafe.Pointer(r.word(shmPublishedOffset))), futexWait,
+		uintptr(seen), uintptr(unsafe.Pointer(&ts)), 0, 0)
+	// Not unmapped while the kernel waits on it.
+	runtime.KeepAlive(r)
+}
+
+// waitRequest reads the frames of the request with the token, as they are published after the id after.
+// It returns them, once they are all there, or nil, once stop is closed.
+func (r *shmRing) waitRequest(token, after uint32, stop <-chan struct{}) []*shmFrame {
+	var frames []*shmFrame
+	for next := after + 1; ; {
+		published := r.published()
+		for ; next <= published; next++ {
+			if r.requestOf(next) != token {
+				continue
+			}
+			fr, err := r.read(next)
+			if err != nil || fr.request != token {
+				// Overwritten already. The reply tells the request what went wrong.
+				continue
+			}
+			frames = append(frames, fr)
+			if uint32(len(frames)) == fr.count {
+				return frames
+			}
+		}
+		select {
+		case <-stop:
+			return nil
+		default:
+		}
+		r.waitPublished(published, shmStopCheckPeriod)
+	}
+}
+
+// read copies out the frame with the publication id. It fails, if the frame was already
+// overwritten, or if it's being overwritten right now.
+func (r *shmRing) read(id uint32) (*shmFrame, error) {
+	if id == 0 {
+		return nil, errors.New("invalid shared memory frame id 0")
+	}
+	off := r.slotOffset(id)
+	slot := r.data[off : off+int(r.slotSize)]
+	seq := atomic.LoadUint32(r.word(off))
+	if seq%2 != 0 || atomic.LoadUint32(r.word(off+4)) != id {
+		return nil, fmt.Errorf("shared memory frame %d is overwritten", id)
+	}
+	colorSize := binary.LittleEndian.Uint32(slot[24:])
+	depthSize := binary.LittleEndian.Uint32(slot[28:])
+	if uint64(shmSlotHeaderSize)+uint64(colorSize)+uint64(depthSize) > uint64(r.slotSize) {
+		return nil, fmt.Errorf("shared memory frame %d is overwritten", id)
+	}
+	tag := slot[32 : 32+shmTagSize]
+	if n := bytes.IndexByte(tag, 0); n >= 0 {
+		tag = tag[:n]
+	}
+	fr := &shmFrame{
+		tag:         string(tag),
+		frameNumber: binary.LittleEndian.Uint64(slot[8:]),
+		timestamp:   math.Float64frombits(binary.LittleEndian.Uint64(slot[16:])),
+		color:       append([]byte(nil), slot[shmSlotHeaderSize:shmSlotHeaderSize+colorSize]...),
+		depth:       append([]byte(nil), slot[shmSlotHeaderSize+colorSize:shmSlotHeaderSize+colorSize+depthSize]...),
+		request:     binary.LittleEndian.Uint32(slot[shmRequestOffset:]),
+		index:       binary.LittleEndian.Uint32(slot[shmRequestOffset+4:]),
+		count:       binary.LittleEndian.Uint32(slot[shmRequestOffset+8:]),
+	}
+	// The writer may have started to overwrite the slot while we were copying it.
+	if atomic.LoadUint32(r.word(off)) != seq {
+		return nil, fmt.Errorf("shared memory frame %d is overwritten", id)
+	}
+	return fr, nil
+}
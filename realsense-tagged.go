@@ -0,0 +1,201 @@
+package main
+
+import (
+	"bufio"
+	"context"
+	"errors"
+	"fmt"
+	"strings"
+	"sync"
+)
+
+// Lines of the untagged replies buffered by replyRouter. They are read one command at a time.
+const untaggedReplies = 16
+
+// replyRouter reads the realsense-snapshot stdout, when the requests are tagged. The reply lines
+// of the tagged requests, "FRAME #7 0 OK ...", "OK #7 ...", "ERR #7 ...", go to the request with
+// that id, without the id. Everything else is a reply to an untagged command, like !stats.
+// The router never waits for a reader: the requests are free to read their replies in any order.
+type replyRouter struct {
+	mu      sync.Mutex
+	nextID  uint64
+	pending map[string]*realSenseCall
+	// Buffers the replies of untagged commands, which are one at a time. A line nobody asked for is
+	// dropped, once it's full.
+	untagged chan string
+	// Set once stdout is closed.
+	err error
+}
+
+func newReplyRouter(scan *bufio.Scanner) *replyRouter {
+	r := &replyRouter{pending: make(map[string]*realSenseCall), untagged: make(chan string, untaggedReplies)}
+	go r.run(scan)
+	return r
+}
+
+func (r *replyRouter) run(scan *bufio.Scanner) {
+	for scan.Scan() {
+		line := strings.TrimSpace(scan.Text())
+		fields := strings.SplitN(line, " ", 3)
+		if len(fields) < 2 || !strings.HasPrefix(fields[1], "#") {
+			select {
+			case r.untagged <- line:
+			default:
+			}
+			continue
+		}
+		r.mu.Lock()
+		call := r.pending[fields[1][1:]]
+		r.mu.Unlock()
+		if call == nil {
+			// Cancelled already.
+			continue
+		}
+		reply := fields[0]
+		if len(fields) > 2 {
+			reply += " " + fields[2]
+		}
+		// lines has room for all replies of the request, so this only drops the extra lines of a broken one.
+		select {
+		case call.lines <- reply:
+		default:
+		}
+	}
+	err := errors.New("realsense-snapshot is probably dead, as reading from stdout reached EOF")
+	if scan.Err() != nil {
+		err = fmt.Errorf("failed to read from realsense-snapshot stdout: %v", scan.Err())
+	}
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	r.err = err
+	for _, call := range r.pending {
+		close(call.lines)
+	}
+	r.pending = nil
+	close(r.untagged)
+}
+
+// add registers a new call under a fresh id. It buffers up to replies lines, until they are read.
+func (r *replyRouter) add(call *realSenseCall, replies int) error {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	if r.err != nil {
+		return r.err
+	}
+	r.nextID++
+	call.id = fmt.Sprintf("%d", r.nextID)
+	call.lines = make(chan string, replies)
+	call.gone = make(chan struct{})
+	r.pending[call.id] = call
+	return nil
+}
+
+func (r *replyRouter) remove(call *realSenseCall) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	if r.pending != nil {
+		delete(r.pending, call.id)
+	}
+}
+
+// readUntagged reads a reply to an untagged command.
+func (r *replyRouter) readUntagged() (string, error) {
+	line, ok := <-r.untagged
+	if !ok {
+		return "", r.closedErr()
+	}
+	return line, nil
+}
+
+func (r *replyRouter) closedErr() error {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	return r.err
+}
+
+// realSenseCall is a request to realsense-snapshot, which is waiting for its reply lines.
+// Without tagged requests, it reads them right from stdout, and rss.mu must be held until the final reply.
+type realSenseCall struct {
+	rss *RealSenseSnapshotter
+	ctx context.Context
+	// Empty for an untagged request.
+	id    string
+	lines chan string
+	gone  chan struct{}
+	// Set once the final OK or ERR is read.
+	done bool
+}
+
+// request sends a request line to realsense-snapshot, which replies with at most replies lines, the final
+// OK or ERR included. With tagged requests, it's sent as "#<id> <line>", and the reply lines are read as soon
+// as they arrive, while the other requests are in flight.
+func (rss *RealSenseSnapshotter) request(ctx context.Context, replies int, format string,
+	args ...interface{}) (*realSenseCall, error) {
+	call := &realSenseCall{rss: rss, ctx: ctx}
+	if rss.router == nil {
+		return call, rss.writeLine(format, args...)
+	}
+	if err := rss.router.add(call, replies); err != nil {
+		return nil, err
+	}
+	if err := rss.writeLine("#"+call.id+" "+format, args...); err != nil {
+		call.close()
+		return nil, err
+	}
+	return call, nil
+}
+
+// next reads the next reply line of the request. If ctx is done first, the request is cancelled.
+func (call *realSenseCall) next() (string, error) {
+	if call.id == "" {
+		return call.rss.readLine()
+	}
+	select {
+	case line, ok := <-call.lines:
+		if !ok {
+			call.done = true
+			return "", call.rss.router.closedErr()
+		}
+		call.done = isOK(line) || isUnchanged(line) || strings.HasPrefix(line, "ERR")
+		return line, nil
+	case <-call.ctx.Done():
+		call.close()
+		return "", call.ctx.Err()
+	}
+}
+
+// nextOK reads an OK reply and returns whatever follows the OK.
+func (call *realSenseCall) nextOK() (string, error) {
+	defer call.close()
+	reply, err := call.next()
+	if err != nil {
+		return "", err
+	}
+	if isUnchanged(reply) {
+		return "", ErrUnchanged
+	}
+	if !isOK(reply) {
+		return "", fmt.Errorf("unexpected reply from realsense-snapshot: %v", reply)
+	}
+	return strings.TrimSpace(strings.TrimPrefix(reply, "OK")), nil
+}
+
+// close stops waiting for the replies. If the request is not done yet, realsense-snapshot
+// stops capturing its frames. It may be called several times.
+func (call *realSenseCall) close() {
+	if call.id == "" {
+		return
+	}
+	select {
+	case <-call.gone:
+		return
+	default:
+	}
+	call.rss.router.remove(call)
+	close(call.gone)
+	if !call.done {
+		if err := call.rss.writeLine("!cancel %s", call.id); err != nil {
+			call.rss.up.logf("Failed to cancel realsense-snapshot request #%s: %v", call.id, err)
+		}
+	}
+}
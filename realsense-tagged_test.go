@@ -0,0 +1,100 @@
+package main
+
+import (
+	"bufio"
+	"context"
+	"io"
+	"testing"
+	"time"
+)
+
+// startRouter returns a router reading the lines written to the returned pipe.
+func startRouter(t *testing.T) (*replyRouter, *io.PipeWriter) {
+	pr, pw := io.Pipe()
+	t.Cleanup(func() { pw.Close() })
+	return newReplyRouter(bufio.NewScanner(pr)), pw
+}
+
+func addCall(t *testing.T, r *replyRouter, replies int) *realSenseCall {
+	call := &realSenseCall{ctx: context.Background()}
+	if err := r.add(call, replies); err != nil {
+		t.Fatalf("add: %v", err)
+	}
+	return call
+}
+
+func writeReplies(t *testing.T, w io.Writer, lines ...string) {
+	for _, line := range lines {
+		if _, err := io.WriteString(w, line+"\n"); err != nil {
+			t.Fatalf("write %q: %v", line, err)
+		}
+	}
+}
+
+func nextWithin(t *testing.T, call *realSenseCall) string {
+	type result struct {
+		line string
+		err  error
+	}
+	ch := make(chan result, 1)
+	go func() {
+		line, err := call.next()
+		ch <- result{line, err}
+	}()
+	select {
+	case res := <-ch:
+		if res.err != nil {
+			t.Fatalf("call #%s: %v", call.id, res.err)
+		}
+		return res.line
+	case <-time.After(5 * time.Second):
+		t.Fatalf("call #%s: no reply", call.id)
+	}
+	return ""
+}
+
+func TestReplyRouterOutOfOrder(t *testing.T) {
+	r, w := startRouter(t)
+	calls := []*realSenseCall{addCall(t, r, 1), addCall(t, r, 1), addCall(t, r, 1)}
+	// The replies come in reverse, and nobody reads them, until they are all written.
+	writeReplies(t, w, "OK #3 c", "OK #2 b", "OK #1 a")
+	for i, want := range []string{"OK a", "OK b", "OK c"} {
+		if got := nextWithin(t, calls[i]); got != want {
+			t.Errorf("call #%s: want %q, got %q", calls[i].id, want, got)
+		}
+	}
+}
+
+func TestReplyRouterInterleavedFrames(t *testing.T) {
+	r, w := startRouter(t)
+	batch := addCall(t, r, 3)
+	single := addCall(t, r, 1)
+	writeReplies(t, w, "FRAME #1 0 OK", "OK #2 x", "FRAME #1 1 OK", "OK #1")
+	if got := nextWithin(t, single); got != "OK x" {
+		t.Errorf("single: want %q, got %q", "OK x", got)
+	}
+	for _, want := range []string{"FRAME 0 OK", "FRAME 1 OK", "OK"} {
+		if got := nextWithin(t, batch); got != want {
+			t.Errorf("batch: want %q, got %q", want, got)
+		}
+	}
+	if !batch.done {
+		t.Errorf("batch is not done after its final OK")
+	}
+}
+
+func TestReplyRouterUnreadUntagged(t *testing.T) {
+	r, w := startRouter(t)
+	call := addCall(t, r, 1)
+	// More untagged lines than are buffered, none of them read, must not hold up the tagged reply.
+	for i := 0; i < 2*untaggedReplies; i++ {
+		writeReplies(t, w, "stray line")
+	}
+	writeReplies(t, w, "OK #1 done")
+	if got := nextWithin(t, call); got != "OK done" {
+		t.Errorf("want %q, got %q", "OK done", got)
+	}
+	if line, err := r.readUntagged(); err != nil || line != "stray line" {
+		t.Errorf("readUntagged: want %q, got %q, %v", "stray line", line, err)
+	}
+}
@@ -0,0 +1,167 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"time"
+)
+
+// Upload stream of realsense-snapshot. See tools/realsense/upload-stream.h.
+const (
+	uploadChunkHeaderSize = 128
+	uploadFirstChunk      = 1
+	uploadLastChunk       = 2
+	// Way more than the 1 MiB chunks ever take, even if some of them don't compress.
+	uploadMaxChunkSize = 16 << 20
+	// How long to wait before connecting to realsense-snapshot again.
+	uploadRetryDelay = 5 * time.Second
+	// A server, which stalls, holds up the train packs, until realsense-snapshot gives up on us, but it must not
+	// keep the stream from being read again.
+	uploadTimeout = 5 * time.Minute
+)
+
+var uploadClient = &http.Client{Timeout: uploadTimeout}
+
+// packUpload is a pack on its way to the server: an HTTP request, whose body is written chunk by chunk.
+type packUpload struct {
+	name string
+	body *io.PipeWriter
+	done chan error
+	// Set, once writing the body failed. The rest of the pack is skipped.
+	err error
+}
+
+// RunUpload forwards the train packs, which realsense-snapshot streams as it writes them, to url. Never returns.
+// Every pack is POSTed as it comes, in a request of its own: the body is the chunks of the pack, exactly as
+// realsense-snapshot sends them, compressed or not. A slow server slows down reading the stream, and that holds up
+// the train packs in realsense-snapshot, rather than buffers them here. A pack, which doesn't make it to the server,
+// is still on disk.
+func (rss *RealSenseSnapshotter) RunUpload(url string) {
+	for {
+		if err := rss.upload(url); err != nil {
+			rss.up.logf("RealSense pack upload: %v", err)
+		}
+		time.Sleep(uploadRetryDelay)
+	}
+}
+
+// upload forwards the packs until realsense-snapshot closes the stream.
+func (rss *RealSenseSnapshotter) upload(url string) error {
+	rss.mu.Lock()
+	err := rss.start()
+	rss.mu.Unlock()
+	if err != nil {
+		return err
+	}
+	conn, err := net.Dial("unix", rss.uploadSocket)
+	if err != nil {
+		return fmt.Errorf("failed to connect to the realsense-snapshot upload stream: %v", err)
+	}
+	defer conn.Close()
+
+	var pack *packUpload
+	defer func() {
+		if pack != nil {
+			pack.abort(rss, errors.New("realsense-snapshot closed the upload stream"))
+		}
+	}()
+	header := make([]byte, uploadChunkHeaderSize)
+	var data []byte
+	for {
+		if _, err := io.ReadFull(conn, header); err != nil {
+			return fmt.Errorf("failed to read the realsense-snapshot upload stream: %v", err)
+		}
+		if !bytes.Equal(header[:4], []byte("RSUP")) {
+			return fmt.Errorf("unexpected realsense-snapshot upload chunk header: %q", header[:4])
+		}
+		flags := header[4]
+		size := binary.LittleEndian.Uint32(header[8:])
+		name := header[40:128]
+		if n := bytes.IndexByte(name, 0); n >= 0 {
+			name = name[:n]
+		}
+		if size > uploadMaxChunkSize {
+			return fmt.Errorf("realsense-snapshot upload chunk is too large: %d bytes", size)
+		}
+		// The chunk is written to the request body before the next one is read, so the buffer is reused.
+		if cap(data) < int(size) {
+			data = make([]byte, size)
+		}
+		data = data[:size]
+		if _, err := io.ReadFull(conn, data); err != nil {
+			return fmt.Errorf("failed to read the realsense-snapshot upload stream: %v", err)
+		}
+		if flags&uploadFirstChunk != 0 {
+			if pack != nil {
+				pack.abort(rss, errors.New("realsense-snapshot dropped the rest of it"))
+			}
+			pack = rss.startPackUpload(url, string(name))
+		}
+		if pack == nil {
+			// The rest of a pack, which was in flight, when we connected.
+			continue
+		}
+		pack.write(header, data)
+		if flags&uploadLastChunk != 0 {
+			pack.finish(rss)
+			pack = nil
+		}
+	}
+}
+
+func (rss *RealSenseSnapshotter) startPackUpload(url, name string) *packUpload {
+	body, w := io.Pipe()
+	pack := &packUpload{name: name, body: w, done: make(chan error, 1)}
+	go func() {
+		resp, err := uploadClient.Post(url, "application/x-realsense-upload", body)
+		if err == nil {
+			resp.Body.Close()
+			if resp.StatusCode/100 != 2 {
+				err = fmt.Errorf("the server replied %s", resp.Status)
+			}
+		}
+		// Unblocks the writes, if the request is over before the body is.
+		body.CloseWithError(err)
+		pack.done <- err
+	}()
+	return pack
+}
+
+func (pack *packUpload) write(header, data []byte) {
+	if pack.err != nil {
+		return
+	}
+	if _, err := pack.body.Write(header); err != nil {
+		pack.err = err
+		return
+	}
+	if _, err := pack.body.Write(data); err != nil {
+		pack.err = err
+	}
+}
+
+// finish waits for the server to take the pack.
+func (pack *packUpload) finish(rss *RealSenseSnapshotter) {
+	pack.body.Close()
+	err := <-pack.done
+	if err == nil {
+		err = pack.err
+	}
+	if err != nil {
+		rss.up.logf("Failed to upload RealSense pack %s: %v. It's only on disk.", pack.name, err)
+		return
+	}
+	rss.up.logf("RealSense pack %s uploaded", pack.name)
+}
+
+// abort cancels the request: the server gets a truncated body.
+func (pack *packUpload) abort(rss *RealSenseSnapshotter, err error) {
+	pack.body.CloseWithError(err)
+	<-pack.done
+	rss.up.logf("Failed to upload RealSense pack %s: %v. It's only on disk.", pack.name, err)
+}
@@ -2,13 +2,121 @@ package main
 
 import (
 	"bufio"
+	"bytes"
 	"context"
 	"errors"
+	"flag"
 	"fmt"
 	"io"
+	"net"
+	"os"
 	"os/exec"
 	"strings"
 	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+var (
+	realSensePipelined = flag.Bool("realsense_pipelined", false,
+		"If specified, realsense-snapshot will encode frames in the background, while capturing the next ones. Speeds up train packs.")
+	realSenseBatch = flag.Bool("realsense_batch", false,
+		"If specified, all frames of a snapshot are requested from realsense-snapshot with a single batch command.")
+	realSensePack = flag.Bool("realsense_pack", false,
+		"If specified, all frames and the parameters of a train pack are written into a single pack.rspack file. "+
+			"Requires a realsense-snapshot with the pack container support.")
+	realSensePrewarm = flag.Bool("realsense_prewarm", false,
+		"If specified, realsense-snapshot is started along with the agent, so that the camera is warmed up by the first snapshot.")
+	realSenseStatsEvery = flag.Int("realsense_stats_every", 0,
+		"If positive, the latency percentiles of realsense-snapshot stages are logged every that many snapshots. "+
+			"Requires a realsense-snapshot with the !stats command.")
+	realSenseMetrics = flag.Bool("realsense_metrics", false,
+		"If specified, the realsense-snapshot metrics are logged along with the latency percentiles: fps, frames "+
+			"missed by the camera and dropped by us, queue depths, bytes written, CPU time per stage, exposure and "+
+			"clock drift. Requires --realsense_stats_every and a realsense-snapshot with the !metrics command.")
+	realSenseMetricsFile = flag.String("realsense_metrics_file", "",
+		"If not empty, realsense-snapshot writes its metrics to this file in the Prometheus text format every second, "+
+			"e.g. for the textfile collector of node_exporter. Requires a realsense-snapshot with the metrics support.")
+	realSenseCameras = flag.String("realsense_cameras", "",
+		"Comma-separated list of the RealSense cameras to capture from, as name=serial, or \"all\". "+
+			"With cameras listed, the file names start with the camera name, e.g. <prefix>front-color.jpg. "+
+			"Empty means the first camera found, with the file names as before.")
+	realSenseBurst = flag.Bool("realsense_burst", false,
+		"If specified, batch and pack requests capture consecutive sensor frames, encoded after the burst. "+
+			"Requires a realsense-snapshot with the burst support.")
+	realSenseColorProfile = flag.String("realsense_color_profile", "",
+		"Color stream profile as WIDTHxHEIGHT@FPS, e.g. 1280x720@30. The depth images are aligned to color "+
+			"and have the same resolution. Empty means the realsense-snapshot default, 640x480@30.")
+	realSenseDepthProfile = flag.String("realsense_depth_profile", "",
+		"Depth stream profile as WIDTHxHEIGHT@FPS, e.g. 848x480@30. Empty means the realsense-snapshot default, 640x480@30.")
+	realSenseDepthFilters = flag.String("realsense_depth_filters", "",
+		"Comma-separated librealsense post-processing filters applied to the depth before saving it: "+
+			"spatial, temporal, hole_filling. Requires a realsense-snapshot with the depth filter support.")
+	realSenseDecimation = flag.Int("realsense_decimation", 1,
+		"If greater than 1, the saved depth images are downscaled by this factor in both directions. "+
+			"Requires a realsense-snapshot with the depth filter support.")
+	realSenseShm = flag.String("realsense_shm", "",
+		"If not empty, the name of a shared-memory ring in /dev/shm, through which realsense-snapshot hands "+
+			"the live snapshots over to the agent, instead of writing them to a temp dir. "+
+			"Requires a realsense-snapshot with the shared memory support.")
+	realSensePreviewSocket = flag.String("realsense_preview_socket", "",
+		"If not empty, realsense-snapshot serves a live, downscaled color + depth preview on this Unix socket, "+
+			"which the preview shell command forwards to the uplink. "+
+			"Requires a realsense-snapshot with the preview support.")
+	realSenseROI = flag.String("realsense_roi", "",
+		"If not empty, batch and pack requests only save this region of the frames, as X,Y,W,H in the color image "+
+			"pixels, e.g. the tray. Requires a realsense-snapshot with the ROI support.")
+	realSenseScale = flag.Int("realsense_scale", 1,
+		"If greater than 1, batch and pack requests save the images downscaled by this factor in both directions. "+
+			"Requires a realsense-snapshot with the ROI support.")
+	realSensePointCloud = flag.String("realsense_point_cloud", "",
+		"If xyz or xyzrgb, every frame also gets a <prefix>points.pc16 point cloud, deprojected at capture time. "+
+			"Requires a realsense-snapshot with the point cloud support.")
+	realSenseWriteThread = flag.Bool("realsense_write_thread", false,
+		"If specified, realsense-snapshot writes the files on a separate thread, in batches, so that a slow disk "+
+			"does not hold up the encoders. Requires a realsense-snapshot with the writer thread support.")
+	realSenseDurability = flag.String("realsense_durability", "",
+		"What realsense-snapshot syncs to disk before reporting a snapshot done: none, pack (the pack files) "+
+			"or frame (every file). Empty means the realsense-snapshot default, pack.")
+	realSenseTagged = flag.Bool("realsense_tagged", false,
+		"If specified, the requests to realsense-snapshot are tagged with ids, so that several snapshots are in flight "+
+			"at once, and a snapshot stops capturing when its context is cancelled. "+
+			"Requires a realsense-snapshot with the tagged requests support.")
+	realSenseIfChanged = flag.Bool("realsense_if_changed", false,
+		"If specified, a live snapshot is not sent to the uplink, if nothing has changed in the scene since the last one. "+
+			"realsense-snapshot compares sparse samples of the color and the depth, and skips encoding them too. "+
+			"Requires a realsense-snapshot with the change detection support.")
+	realSensePriorities = flag.Bool("realsense_priorities", false,
+		"If specified, the live snapshots are interactive requests, which overtake the train pack frames queued in "+
+			"realsense-snapshot, and are served from the latest frame, downscaled, while the encoders are busy. "+
+			"Implies --realsense_tagged. Requires a realsense-snapshot with the priorities support.")
+	realSenseDepthPreview = flag.Bool("realsense_depth_preview", false,
+		"If specified, the live snapshots carry a small colorized depth JPEG, which the browser can show, instead of "+
+			"the 16-bit depth PNG. Requires a realsense-snapshot with the depth preview support.")
+	realSenseDepthPreviewRange = flag.String("realsense_depth_preview_range", "",
+		"If not empty, the depth range of --realsense_depth_preview in meters, mapped to the ends of the color map, "+
+			"e.g. 0.3,1.5. realsense-snapshot defaults to 0.2,4.")
+	realSenseUploadSocket = flag.String("realsense_upload_socket", "",
+		"If not empty, realsense-snapshot streams every train pack from memory, as it writes it, to the agent on this "+
+			"Unix socket, and the agent forwards it to --realsense_upload_url, so that the packs need no second pass "+
+			"over the disk. Requires --realsense_pack and a realsense-snapshot with the upload support.")
+	realSenseUploadURL = flag.String("realsense_upload_url", "",
+		"URL the train packs of --realsense_upload_socket are POSTed to, one request per pack. The body is the chunk "+
+			"stream of tools/realsense/upload-stream.h: the pack file, in chunks, each compressed on its own.")
+	realSenseUploadCompression = flag.String("realsense_upload_compression", "",
+		"Compression of the --realsense_upload_socket chunks: none, lz4 or zstd. Empty means none.")
+	realSenseDaemonSocket = flag.String("realsense_daemon_socket", "",
+		"If not empty, the agent sends its requests to the realsense-snapshot daemon listening on this Unix socket, "+
+			"and starts the daemon with the other realsense flags, if nobody listens. The daemon outlives the agent, "+
+			"so restarts don't warm the camera up again, and other tools may use it at the same time. "+
+			"Its log goes to <socket>.log. Requires a realsense-snapshot with the daemon support.")
+)
+
+const (
+	realSenseSnapshotPath = "/opt/robodone/realsense-snapshot"
+	// How long a daemon, which has just been started, may take to bind its socket.
+	realSenseDaemonStartTimeout = 10 * time.Second
 )
 
 type RealSenseSnapshotter struct {
@@ -17,6 +125,72 @@ type RealSenseSnapshotter struct {
 	cmd        *exec.Cmd
 	stdin      io.WriteCloser
 	stdoutScan *bufio.Scanner
+	// Serializes the writes to stdin, which don't hold mu with tagged requests.
+	writeMu sync.Mutex
+	// Serializes the untagged commands with tagged requests, while their replies are awaited.
+	commandMu sync.Mutex
+
+	// If true, realsense-snapshot runs in the pipelined mode: every frame is acknowledged
+	// as soon as it's captured, and the files are written in the background.
+	pipelined bool
+	// If true, all frames are requested with a single "<prefix> frames=N" command.
+	batch bool
+	// If true, train packs are written as a single pack file. See PackSnapshotter.
+	pack bool
+	// If positive, the stage latency stats are logged every statsEvery snapshots.
+	statsEvery int
+	snapshots  int
+	// If true, the !metrics are logged along with the stats.
+	metrics bool
+	// Passed to realsense-snapshot as --metrics_file, if not empty.
+	metricsFile string
+	// Passed to realsense-snapshot as --cameras, if not empty.
+	cameras string
+	// If true, batch and pack requests are bursts of consecutive frames.
+	burst bool
+	// Passed to realsense-snapshot as --color_profile and --depth_profile, if not empty.
+	colorProfile string
+	depthProfile string
+	// Passed to realsense-snapshot as --depth_filters and --decimation, if set.
+	depthFilters string
+	decimation   int
+	// Passed to realsense-snapshot as --shm, if not empty. See FrameSnapshotter.
+	shm string
+	// The ring the last OK reply to a shm request pointed to. Guarded by shmMu, which,
+	// unlike mu, is never held while waiting for realsense-snapshot.
+	shmMu   sync.Mutex
+	shmRing *shmRing
+	// Last token of the shm=<token> requests, see nextShmToken.
+	shmToken     uint32
+	shmTokenOnce sync.Once
+	// Passed to realsense-snapshot as --preview_socket, if not empty. See PreviewSnapshotter.
+	previewSocket string
+	// If set, passed with the batch and pack requests as roi= and scale=.
+	roi   string
+	scale int
+	// Passed to realsense-snapshot as --point_cloud, if not empty.
+	pointCloud string
+	// Passed to realsense-snapshot as --write_thread and --durability.
+	writeThread bool
+	durability  string
+	// If true, the requests are tagged, and rss.mu is only held to start realsense-snapshot.
+	// The replies are read by the router. See realsense-tagged.go.
+	tagged bool
+	router *replyRouter
+	// If not empty, the requests go to the realsense-snapshot daemon on this socket, instead of a child process.
+	daemonSocket string
+	// If true, the live snapshots are requested with if_changed=1. See LiveSnapshotter.
+	ifChanged bool
+	// If true, the live snapshots are requested with priority=1, and overtake the train packs.
+	// Implies tagged.
+	priorities bool
+	// If true, the live snapshots are requested with depth_preview=1, and their depth is the colorized preview.
+	depthPreview bool
+	// Passed to realsense-snapshot as --depth_preview_range, if not empty.
+	depthPreviewRange string
+	// Passed to realsense-snapshot as --upload_socket and --upload_compression, if not empty. See RunUpload.
+	uploadSocket      string
+	uploadCompression string
 }
 
 type RealSenseTrainPackParams struct {
@@ -32,57 +206,565 @@ type RealSenseTrainPackParams struct {
 }
 
 func (rss *RealSenseSnapshotter) TakeSnapshot(ctx context.Context, prefix string, numFrames int) error {
-	rss.mu.Lock()
-	defer rss.mu.Unlock()
+	unlock, err := rss.lockAndStart()
+	if err != nil {
+		return err
+	}
+	defer unlock()
 
-	if rss.cmd == nil {
-		cmd := exec.Command("/opt/robodone/realsense-snapshot")
-		stdin, err := cmd.StdinPipe()
-		if err != nil {
-			return fmt.Errorf("failed to create stdin pipe: %v", err)
+	return rss.takeSnapshot(ctx, prefix, numFrames, "")
+}
+
+// TakeLiveSnapshot writes the files under the same names as TakeSnapshot of a single frame.
+func (rss *RealSenseSnapshotter) TakeLiveSnapshot(ctx context.Context, prefix string) error {
+	unlock, err := rss.lockAndStart()
+	if err != nil {
+		return err
+	}
+	defer unlock()
+
+	return rss.takeSnapshot(ctx, prefix, 1, rss.liveOptions())
+}
+
+// liveOptions returns the options of the live snapshot requests.
+func (rss *RealSenseSnapshotter) liveOptions() string {
+	var opts string
+	if rss.ifChanged {
+		opts += " if_changed=1"
+	}
+	if rss.priorities {
+		opts += " priority=1"
+	}
+	if rss.depthPreview {
+		opts += " depth_preview=1"
+	}
+	return opts
+}
+
+// takeSnapshot appends opts to the single frame requests. With opts, there are no batch requests.
+func (rss *RealSenseSnapshotter) takeSnapshot(ctx context.Context, prefix string, numFrames int, opts string) error {
+	if rss.batch && opts == "" {
+		return rss.takeBatch(ctx, prefix, numFrames)
+	}
+	// With tagged requests, all frames are requested at once, and the replies are read afterwards.
+	var calls []*realSenseCall
+	defer func() {
+		for _, call := range calls {
+			call.close()
 		}
-		stdout, err := cmd.StdoutPipe()
+	}()
+	for i := 0; i < numFrames; i++ {
+		call, err := rss.request(ctx, 1, "%s%02d-%s", prefix, i, opts)
 		if err != nil {
-			return fmt.Errorf("failed to create stdout pipe: %v", err)
+			return err
 		}
-		stderr, err := cmd.StderrPipe()
-		if err != nil {
-			return fmt.Errorf("failed to create stderr pipe: %v", err)
+		if !rss.tagged {
+			if _, err := call.nextOK(); err != nil {
+				return err
+			}
+			continue
+		}
+		calls = append(calls, call)
+	}
+	for _, call := range calls {
+		if _, err := call.nextOK(); err != nil {
+			return err
+		}
+	}
+	if rss.pipelined {
+		// Wait until all frames are actually written to disk.
+		if _, err := rss.command("!sync"); err != nil {
+			return err
 		}
-		go func(stderr io.ReadCloser) {
-			s := bufio.NewScanner(stderr)
-			for s.Scan() {
-				line := strings.TrimSpace(s.Text())
-				rss.up.logf("realsense-snapshot: %s", line)
+	}
+	return nil
+}
+
+func (rss *RealSenseSnapshotter) PackEnabled() bool {
+	return rss.pack
+}
+
+// TakePack writes numFrames frames and meta into <prefix>pack.rspack. meta must not contain newlines.
+func (rss *RealSenseSnapshotter) TakePack(ctx context.Context, prefix string, numFrames int, meta []byte) error {
+	if bytes.IndexByte(meta, '\n') >= 0 {
+		return errors.New("pack metadata must be a single line")
+	}
+	unlock, err := rss.lockAndStart()
+	if err != nil {
+		return err
+	}
+	defer unlock()
+
+	call, err := rss.request(ctx, numFrames+1, "%s frames=%d%s pack=1 meta=%s", prefix, numFrames, rss.requestOptions(), meta)
+	if err != nil {
+		return err
+	}
+	return rss.readFrames(call, numFrames)
+}
+
+func (rss *RealSenseSnapshotter) FramesEnabled() bool {
+	return rss.shm != ""
+}
+
+// TakeFrames captures a single frame through the shared-memory ring. The images are keyed
+// by what would be their file names without the extensions: <prefix>color, <prefix>depth,
+// or <prefix><camera>-color, etc. with several cameras. With depthPreview, the depth is the colorized JPEG.
+func (rss *RealSenseSnapshotter) TakeFrames(ctx context.Context, prefix string) (map[string][]byte, error) {
+	unlock, err := rss.lockAndStart()
+	if err != nil {
+		return nil, err
+	}
+	// Before the first request, realsense-snapshot may not have created the ring yet. Then the frames
+	// are only known from the reply.
+	ring := rss.currentShmRing()
+	var after uint32
+	if ring != nil {
+		after = ring.published()
+	}
+	token := rss.nextShmToken()
+	call, err := rss.request(ctx, 1, "%s shm=%d%s", prefix, token, rss.liveOptions())
+	if err != nil {
+		unlock()
+		return nil, err
+	}
+	// The reply comes right after the frames are published, or without them: UNCHANGED or ERR. The frames
+	// are taken as soon as they are in the ring, and the reply, which is still due, is read in the background.
+	// Without tagged requests, rss.mu is held until then, which keeps stdout in lock-step.
+	replies := make(chan shmReply, 1)
+	go func() {
+		defer unlock()
+		rest, err := call.nextOK()
+		replies <- shmReply{rest, err}
+	}()
+	var published chan []*shmFrame
+	stop := make(chan struct{})
+	defer close(stop)
+	if ring != nil {
+		published = make(chan []*shmFrame, 1)
+		go func() { published <- ring.waitRequest(token, after, stop) }()
+	}
+	select {
+	case frames := <-published:
+		return shmImages(prefix, frames), nil
+	case reply := <-replies:
+		if reply.err != nil {
+			return nil, reply.err
+		}
+		return rss.readShmReply(ring, prefix, reply.rest)
+	}
+}
+
+// shmReply is the final reply to a shm request.
+type shmReply struct {
+	rest string
+	err  error
+}
+
+// nextShmToken returns the token of a new shm request. They start at a random point, so that two agents
+// sharing the daemon don't take each other's frames.
+func (rss *RealSenseSnapshotter) nextShmToken() uint32 {
+	rss.shmTokenOnce.Do(func() {
+		atomic.StoreUint32(&rss.shmToken, uint32(time.Now().UnixNano()))
+	})
+	for {
+		// 0 would turn shm off.
+		if token := atomic.AddUint32(&rss.shmToken, 1); token != 0 {
+			return token
+		}
+	}
+}
+
+// readShmReply reads the frames the OK reply to a shm request points to, from ring, if it's not nil.
+// If they are not there, ring is not the one of the running realsense-snapshot: they are read from
+// whatever /dev/shm/<name> is now. The ring, which has them, is used from then on.
+func (rss *RealSenseSnapshotter) readShmReply(ring *shmRing, prefix, rest string) (map[string][]byte, error) {
+	var first, count uint32
+	for _, kv := range strings.Fields(rest) {
+		if strings.HasPrefix(kv, "shm=") {
+			if _, err := fmt.Sscanf(kv, "shm=%d:%d", &first, &count); err != nil {
+				return nil, fmt.Errorf("unexpected shm key in the realsense-snapshot reply: %v", kv)
 			}
-			if s.Err() != nil {
-				rss.up.logf("failed to read from realsense-snapshot stderr: %v", err)
-				return
+		}
+	}
+	if count == 0 {
+		return nil, fmt.Errorf("no shm frames in the realsense-snapshot reply: %v", rest)
+	}
+	var frames []*shmFrame
+	var err error
+	if ring != nil {
+		frames, err = readShmFrames(ring, first, count)
+	}
+	if ring == nil || err != nil {
+		var openErr error
+		if ring, openErr = openShmRing(rss.shm); openErr != nil {
+			return nil, fmt.Errorf("failed to open the realsense-snapshot shared memory ring: %v", openErr)
+		}
+		if frames, err = readShmFrames(ring, first, count); err != nil {
+			return nil, err
+		}
+	}
+	rss.shmMu.Lock()
+	rss.shmRing = ring
+	rss.shmMu.Unlock()
+	return shmImages(prefix, frames), nil
+}
+
+func readShmFrames(ring *shmRing, first, count uint32) ([]*shmFrame, error) {
+	var frames []*shmFrame
+	for id := first; id < first+count; id++ {
+		fr, err := ring.read(id)
+		if err != nil {
+			return nil, err
+		}
+		frames = append(frames, fr)
+	}
+	return frames, nil
+}
+
+func shmImages(prefix string, frames []*shmFrame) map[string][]byte {
+	images := make(map[string][]byte)
+	for _, fr := range frames {
+		images[prefix+fr.tag+"color"] = fr.color
+		images[prefix+fr.tag+"depth"] = fr.depth
+	}
+	return images
+}
+
+// Prewarm starts realsense-snapshot in advance. The camera warm-up runs in the background,
+// and the first snapshot only waits for what's left of it.
+func (rss *RealSenseSnapshotter) Prewarm() {
+	rss.mu.Lock()
+	defer rss.mu.Unlock()
+
+	if err := rss.start(); err != nil {
+		rss.up.logf("Failed to prewarm realsense-snapshot: %v", err)
+	}
+}
+
+// currentShmRing returns the ring to pick the frames of a request from, as they are published: the one
+// of the last OK reply, unless its realsense-snapshot is gone, or whatever /dev/shm/<name> is now.
+// It's nil, if there's no ring of a running realsense-snapshot. realsense-snapshot creates the ring,
+// before it opens the cameras, but it may not have got that far yet.
+func (rss *RealSenseSnapshotter) currentShmRing() *shmRing {
+	rss.shmMu.Lock()
+	defer rss.shmMu.Unlock()
+	if rss.shmRing != nil && !rss.shmRing.writerAlive() {
+		rss.shmRing = nil
+	}
+	if rss.shmRing != nil {
+		return rss.shmRing
+	}
+	// Not kept until an OK reply points to it: it may still be the ring of a previous run.
+	ring, err := openShmRing(rss.shm)
+	if err != nil {
+		return nil
+	}
+	return ring
+}
+
+// lockAndStart starts realsense-snapshot, and returns the function to call, once the request is done.
+// Without tagged requests, rss.mu is held until then.
+func (rss *RealSenseSnapshotter) lockAndStart() (func(), error) {
+	rss.mu.Lock()
+	if err := rss.start(); err != nil {
+		rss.mu.Unlock()
+		return nil, err
+	}
+	if !rss.tagged {
+		return func() {
+			rss.maybeLogStats()
+			rss.mu.Unlock()
+		}, nil
+	}
+	rss.mu.Unlock()
+	return func() {
+		rss.mu.Lock()
+		defer rss.mu.Unlock()
+		rss.maybeLogStats()
+	}, nil
+}
+
+// start runs realsense-snapshot or connects to the daemon, unless it's done already. rss.mu must be held.
+func (rss *RealSenseSnapshotter) start() error {
+	if rss.stdin != nil {
+		return nil
+	}
+	var stdout io.Reader
+	var err error
+	if rss.daemonSocket != "" {
+		stdout, err = rss.connectDaemon()
+	} else {
+		stdout, err = rss.startChild()
+	}
+	if err != nil {
+		return err
+	}
+	rss.stdoutScan = bufio.NewScanner(stdout)
+	if rss.tagged {
+		rss.router = newReplyRouter(rss.stdoutScan)
+	}
+	return nil
+}
+
+// args returns the realsense-snapshot command line flags.
+func (rss *RealSenseSnapshotter) args() []string {
+	var args []string
+	if rss.pipelined {
+		args = append(args, "--pipelined")
+	}
+	if rss.cameras != "" {
+		args = append(args, "--cameras="+rss.cameras)
+	}
+	if rss.colorProfile != "" {
+		args = append(args, "--color_profile="+rss.colorProfile)
+	}
+	if rss.depthProfile != "" {
+		args = append(args, "--depth_profile="+rss.depthProfile)
+	}
+	if rss.depthFilters != "" {
+		args = append(args, "--depth_filters="+rss.depthFilters)
+	}
+	if rss.decimation > 1 {
+		args = append(args, fmt.Sprintf("--decimation=%d", rss.decimation))
+	}
+	if rss.shm != "" {
+		args = append(args, "--shm="+rss.shm)
+	}
+	if rss.previewSocket != "" {
+		args = append(args, "--preview_socket="+rss.previewSocket)
+	}
+	if rss.pointCloud != "" {
+		args = append(args, "--point_cloud="+rss.pointCloud)
+	}
+	if rss.writeThread {
+		args = append(args, "--write_thread")
+	}
+	if rss.durability != "" {
+		args = append(args, "--durability="+rss.durability)
+	}
+	if rss.depthPreviewRange != "" {
+		args = append(args, "--depth_preview_range="+rss.depthPreviewRange)
+	}
+	if rss.metricsFile != "" {
+		args = append(args, "--metrics_file="+rss.metricsFile)
+	}
+	if rss.uploadSocket != "" {
+		args = append(args, "--upload_socket="+rss.uploadSocket)
+	}
+	if rss.uploadCompression != "" {
+		args = append(args, "--upload_compression="+rss.uploadCompression)
+	}
+	return args
+}
+
+// startChild runs realsense-snapshot as a child process, and returns its stdout.
+func (rss *RealSenseSnapshotter) startChild() (io.Reader, error) {
+	cmd := exec.Command(realSenseSnapshotPath, rss.args()...)
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		return nil, fmt.Errorf("failed to create stdin pipe: %v", err)
+	}
+	stdout, err := cmd.StdoutPipe()
+	if err != nil {
+		return nil, fmt.Errorf("failed to create stdout pipe: %v", err)
+	}
+	stderr, err := cmd.StderrPipe()
+	if err != nil {
+		return nil, fmt.Errorf("failed to create stderr pipe: %v", err)
+	}
+	go func(stderr io.ReadCloser) {
+		s := bufio.NewScanner(stderr)
+		for s.Scan() {
+			line := strings.TrimSpace(s.Text())
+			rss.up.logf("realsense-snapshot: %s", line)
+		}
+		if s.Err() != nil {
+			rss.up.logf("failed to read from realsense-snapshot stderr: %v", err)
+			return
+		}
+	}(stderr)
+	if err = cmd.Start(); err != nil {
+		return nil, fmt.Errorf("failed to start realsense-snapshot: %v", err)
+	}
+	rss.cmd = cmd
+	rss.stdin = stdin
+	return stdout, nil
+}
+
+// connectDaemon connects to the realsense-snapshot daemon, and starts it first, if nobody listens
+// on the socket. The connection is both stdin and stdout.
+func (rss *RealSenseSnapshotter) connectDaemon() (io.Reader, error) {
+	conn, err := net.Dial("unix", rss.daemonSocket)
+	if err != nil {
+		rss.up.logf("Starting the realsense-snapshot daemon, as connecting to it failed: %v", err)
+		if err := rss.startDaemon(); err != nil {
+			return nil, err
+		}
+		// The daemon binds the socket, before it opens the cameras.
+		for deadline := time.Now().Add(realSenseDaemonStartTimeout); ; {
+			if conn, err = net.Dial("unix", rss.daemonSocket); err == nil || time.Now().After(deadline) {
+				break
 			}
-		}(stderr)
-		if err = cmd.Start(); err != nil {
-			return fmt.Errorf("failed to start realsense-snapshot: %v", err)
+			time.Sleep(100 * time.Millisecond)
+		}
+		if err != nil {
+			return nil, fmt.Errorf("failed to connect to the realsense-snapshot daemon: %v", err)
 		}
-		rss.cmd = cmd
-		rss.stdin = stdin
-		rss.stdoutScan = bufio.NewScanner(stdout)
 	}
-	for i := 0; i < numFrames; i++ {
-		if _, err := fmt.Fprintf(rss.stdin, "%s%02d-\n", prefix, i); err != nil {
-			return fmt.Errorf("failed to write to realsense-snapshot stdin: %v", err)
-		}
-		// TODO(krasin): obey context cancellation here.
-		if !rss.stdoutScan.Scan() {
-			err := rss.stdoutScan.Err()
-			if err != nil {
-				return fmt.Errorf("failed to read from realsense-snapshot stdout: %v", err)
+	rss.stdin = conn
+	return conn, nil
+}
+
+// startDaemon starts realsense-snapshot --listen in a session of its own, so that it outlives the agent.
+func (rss *RealSenseSnapshotter) startDaemon() error {
+	logFile, err := os.OpenFile(rss.daemonSocket+".log", os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0644)
+	if err != nil {
+		return fmt.Errorf("failed to open the realsense-snapshot daemon log: %v", err)
+	}
+	defer logFile.Close()
+	cmd := exec.Command(realSenseSnapshotPath, append(rss.args(), "--listen="+rss.daemonSocket)...)
+	cmd.Stderr = logFile
+	cmd.SysProcAttr = &syscall.SysProcAttr{Setsid: true}
+	if err := cmd.Start(); err != nil {
+		return fmt.Errorf("failed to start the realsense-snapshot daemon: %v", err)
+	}
+	// Reaps the daemon, if it exits before the agent does.
+	go cmd.Wait()
+	return nil
+}
+
+// takeBatch requests all frames at once. realsense-snapshot names the files exactly like
+// the frame-by-frame protocol does: <prefix>00-color.jpg, <prefix>01-color.jpg, etc.
+func (rss *RealSenseSnapshotter) takeBatch(ctx context.Context, prefix string, numFrames int) error {
+	call, err := rss.request(ctx, numFrames+1, "%s frames=%d%s", prefix, numFrames, rss.requestOptions())
+	if err != nil {
+		return err
+	}
+	return rss.readFrames(call, numFrames)
+}
+
+// requestOptions returns the options of the batch and pack requests after frames=N.
+func (rss *RealSenseSnapshotter) requestOptions() string {
+	var opts string
+	if rss.burst {
+		opts += " burst=1"
+	}
+	if rss.roi != "" {
+		opts += " roi=" + rss.roi
+	}
+	if rss.scale > 1 {
+		opts += fmt.Sprintf(" scale=%d", rss.scale)
+	}
+	return opts
+}
+
+// readFrames reads the FRAME lines of a batch request up to the final OK.
+func (rss *RealSenseSnapshotter) readFrames(call *realSenseCall, numFrames int) error {
+	defer call.close()
+	for done := 0; ; {
+		reply, err := call.next()
+		if err != nil {
+			return err
+		}
+		if isOK(reply) {
+			if done != numFrames {
+				return fmt.Errorf("realsense-snapshot reported %d frames out of %d requested", done, numFrames)
 			}
-			return errors.New("realsense-snapshot is probably dead, as reading from stdout reached EOF")
+			return nil
 		}
-		reply := strings.TrimSpace(rss.stdoutScan.Text())
-		if reply != "OK" {
+		var idx int
+		if _, err := fmt.Sscanf(reply, "FRAME %d OK", &idx); err != nil {
 			return fmt.Errorf("unexpected reply from realsense-snapshot: %v", reply)
 		}
+		if rss.burst {
+			// Frame numbers, timestamps and the color-depth skew of the burst frames.
+			rss.up.logf("realsense-snapshot: %s", reply)
+		}
+		done++
+	}
+}
+
+// readLine reads a reply line of an untagged request or command.
+func (rss *RealSenseSnapshotter) readLine() (string, error) {
+	if rss.router != nil {
+		return rss.router.readUntagged()
+	}
+	if !rss.stdoutScan.Scan() {
+		err := rss.stdoutScan.Err()
+		if err != nil {
+			return "", fmt.Errorf("failed to read from realsense-snapshot stdout: %v", err)
+		}
+		return "", errors.New("realsense-snapshot is probably dead, as reading from stdout reached EOF")
+	}
+	return strings.TrimSpace(rss.stdoutScan.Text()), nil
+}
+
+// isUnchanged returns true for the reply to an if_changed=1 request, whose frame is the same as the last one.
+func isUnchanged(reply string) bool {
+	return reply == "UNCHANGED" || strings.HasPrefix(reply, "UNCHANGED ")
+}
+
+// isOK returns true for an OK reply. It may be followed by the stage timings: "OK t_wait=0.52 t_align=4.10".
+func isOK(reply string) bool {
+	return reply == "OK" || strings.HasPrefix(reply, "OK ")
+}
+
+// readOKLine reads an OK reply and returns whatever follows the OK.
+func (rss *RealSenseSnapshotter) readOKLine() (string, error) {
+	reply, err := rss.readLine()
+	if err != nil {
+		return "", err
+	}
+	if !isOK(reply) {
+		return "", fmt.Errorf("unexpected reply from realsense-snapshot: %v", reply)
+	}
+	return strings.TrimSpace(strings.TrimPrefix(reply, "OK")), nil
+}
+
+// writeLine writes a line to the realsense-snapshot stdin.
+func (rss *RealSenseSnapshotter) writeLine(format string, args ...interface{}) error {
+	rss.writeMu.Lock()
+	defer rss.writeMu.Unlock()
+	if _, err := fmt.Fprintf(rss.stdin, format+"\n", args...); err != nil {
+		return fmt.Errorf("failed to write to realsense-snapshot stdin: %v", err)
 	}
 	return nil
 }
+
+// command sends an untagged command, like !stats, and returns whatever follows the OK of its reply.
+// Without tagged requests, rss.mu must be held.
+func (rss *RealSenseSnapshotter) command(cmd string) (string, error) {
+	rss.commandMu.Lock()
+	defer rss.commandMu.Unlock()
+	if err := rss.writeLine("%s", cmd); err != nil {
+		return "", err
+	}
+	return rss.readOKLine()
+}
+
+// maybeLogStats logs the rolling p50/p99 latencies of every realsense-snapshot stage,
+// and the metrics, if enabled, once in statsEvery snapshots. rss.mu must be held.
+func (rss *RealSenseSnapshotter) maybeLogStats() {
+	if rss.statsEvery <= 0 || rss.stdin == nil {
+		return
+	}
+	rss.snapshots++
+	if rss.snapshots%rss.statsEvery != 0 {
+		return
+	}
+	stats, err := rss.command("!stats")
+	if err != nil {
+		rss.up.logf("Failed to read realsense-snapshot stats: %v", err)
+		return
+	}
+	rss.up.logf("realsense-snapshot latency p50/p99 ms/samples after %d snapshots: %s", rss.snapshots, stats)
+	if !rss.metrics {
+		return
+	}
+	metrics, err := rss.command("!metrics")
+	if err != nil {
+		rss.up.logf("Failed to read realsense-snapshot metrics: %v", err)
+		return
+	}
+	rss.up.logf("realsense-snapshot metrics after %d snapshots: %s", rss.snapshots, metrics)
+}
@@ -20,6 +20,8 @@ type Shell struct {
 	exe          *Executor
 	mu           sync.Mutex
 	curJobCancel context.CancelFunc
+	// Stops the running preview, if any.
+	previewCancel context.CancelFunc
 }
 
 func NewShell(up *Uplink, down Downlink, exe *Executor) *Shell {
@@ -188,6 +190,22 @@ func (sh *Shell) processGcodeUpdates(reqJson string, lastTS int64) int64 {
 			dur := time.Now().Sub(start)
 			sh.up.logf("RealSense train pack (packID=%s, graspID=%s) is successfully created. Took %.2f seconds.", packID, graspID, dur.Seconds())
 			continue
+		case "preview":
+			// preview [seconds]: stream the live camera preview to the uplink, for a minute by default.
+			dur := time.Minute
+			if arg1 != "" {
+				sec, err := strconv.Atoi(arg1)
+				if err != nil || sec <= 0 {
+					sh.up.logf("preview: invalid duration %q, want a positive number of seconds", arg1)
+					return lastTS
+				}
+				dur = time.Duration(sec) * time.Second
+			}
+			sh.startPreview(dur)
+			continue
+		case "preview-stop":
+			sh.stopPreview()
+			continue
 		case "reboot", "restart":
 			err := sh.Reboot()
 			if err != nil {
@@ -234,6 +252,38 @@ func (sh *Shell) Reboot() error {
 	return nil
 }
 
+// startPreview runs the camera preview in the background for dur, replacing the running one, if any.
+func (sh *Shell) startPreview(dur time.Duration) {
+	ctx, cancel := context.WithTimeout(context.Background(), dur)
+	sh.mu.Lock()
+	if sh.previewCancel != nil {
+		sh.previewCancel()
+	}
+	sh.previewCancel = cancel
+	sh.mu.Unlock()
+	go func() {
+		defer cancel()
+		sh.up.logf("Camera preview started for %v", dur)
+		if err := sh.exe.Preview(ctx); err != nil {
+			sh.up.logf("Camera preview failed: %v", err)
+			return
+		}
+		sh.up.logf("Camera preview stopped")
+	}()
+}
+
+func (sh *Shell) stopPreview() {
+	sh.mu.Lock()
+	cancel := sh.previewCancel
+	sh.previewCancel = nil
+	sh.mu.Unlock()
+	if cancel == nil {
+		sh.up.logf("Nothing to stop: no camera preview is running.")
+		return
+	}
+	cancel()
+}
+
 func (sh *Shell) getNewJobContext() (context.Context, error) {
 	sh.mu.Lock()
 	defer sh.mu.Unlock()
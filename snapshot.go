@@ -2,6 +2,7 @@ package main
 
 import (
 	"context"
+	"errors"
 	"fmt"
 	"strings"
 	"sync"
@@ -11,6 +12,48 @@ type Snapshotter interface {
 	TakeSnapshot(ctx context.Context, prefix string, numFrames int) error
 }
 
+// PackSnapshotter is implemented by the snapshotters, which can write all frames and
+// the metadata of a train pack into a single pack file, <prefix>pack.rspack.
+type PackSnapshotter interface {
+	Snapshotter
+	// PackEnabled returns true, if TakePack should be used for the train packs.
+	PackEnabled() bool
+	TakePack(ctx context.Context, prefix string, numFrames int, meta []byte) error
+}
+
+// FrameSnapshotter is implemented by the snapshotters, which can hand the encoded images
+// of a single snapshot over in memory, without writing them to disk.
+type FrameSnapshotter interface {
+	Snapshotter
+	// FramesEnabled returns true, if TakeFrames should be used for the live snapshots.
+	FramesEnabled() bool
+	// TakeFrames returns the images keyed by what would be their file names without the extensions.
+	// It's only used for the live snapshots, so it may return ErrUnchanged, like LiveSnapshotter.
+	TakeFrames(ctx context.Context, prefix string) (map[string][]byte, error)
+}
+
+// ErrUnchanged is returned instead of a live snapshot, which would be the same as the last one.
+var ErrUnchanged = errors.New("nothing has changed since the last snapshot")
+
+// LiveSnapshotter is implemented by the snapshotters, which take the live snapshots differently
+// from the frames of the train packs: e.g. skip them, if nothing has changed since the last one,
+// or let them overtake the train packs.
+type LiveSnapshotter interface {
+	Snapshotter
+	// TakeLiveSnapshot is TakeSnapshot of a single frame. It may return ErrUnchanged instead.
+	TakeLiveSnapshot(ctx context.Context, prefix string) error
+}
+
+// PreviewSnapshotter is implemented by the snapshotters, which can stream a live, low-rate preview.
+type PreviewSnapshotter interface {
+	Snapshotter
+	// PreviewEnabled returns true, if Preview is available.
+	PreviewEnabled() bool
+	// Preview calls fn with the images of every preview frame, keyed like by FrameSnapshotter.TakeFrames,
+	// until ctx is done.
+	Preview(ctx context.Context, prefix string, fn func(images map[string][]byte)) error
+}
+
 type CombinedSnapshotter struct {
 	Snaps map[string]Snapshotter
 }
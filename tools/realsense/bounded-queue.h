@@ -0,0 +1,110 @@
+#ifndef REALSENSE_BOUNDED_QUEUE_H_
+#define REALSENSE_BOUNDED_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// BoundedQueue is a fixed-capacity FIFO used to connect pipeline stages.
+// Storage is allocated once; push blocks when the queue is full, which is how
+// a slow stage applies backpressure to the stage before it.
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : items_(capacity) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_full_.wait(lock, [this] { return size_ < items_.size(); });
+    put(std::move(item));
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  // Same as push, but the item goes ahead of everything in the queue: the next pop returns it.
+  void push_front(T item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_full_.wait(lock, [this] { return size_ < items_.size(); });
+    head_ = (head_ + items_.size() - 1) % items_.size();
+    items_[head_] = std::move(item);
+    size_++;
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  // Same as push, but returns false instead of waiting, if the queue is full.
+  bool try_push(T item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (size_ == items_.size()) {
+      return false;
+    }
+    put(std::move(item));
+    lock.unlock();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  T pop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_empty_.wait(lock, [this] { return size_ > 0; });
+    T item = std::move(items_[head_]);
+    items_[head_] = T();
+    head_ = (head_ + 1) % items_.size();
+    size_--;
+    lock.unlock();
+    not_full_.notify_one();
+    return item;
+  }
+
+  // Same as pop, but returns false, if the queue is still empty after timeout.
+  template <class Rep, class Period>
+  bool pop_for(T* item, std::chrono::duration<Rep, Period> timeout) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (!not_empty_.wait_for(lock, timeout, [this] { return size_ > 0; })) {
+      return false;
+    }
+    *item = std::move(items_[head_]);
+    items_[head_] = T();
+    head_ = (head_ + 1) % items_.size();
+    size_--;
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Same as pop, but returns false instead of waiting, if the queue is empty.
+  bool try_pop(T* item) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (size_ == 0) {
+      return false;
+    }
+    *item = std::move(items_[head_]);
+    items_[head_] = T();
+    head_ = (head_ + 1) % items_.size();
+    size_--;
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return size_;
+  }
+
+ private:
+  void put(T item) {
+    items_[(head_ + size_) % items_.size()] = std::move(item);
+    size_++;
+  }
+
+  std::mutex mu_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::vector<T> items_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
+#endif  // REALSENSE_BOUNDED_QUEUE_H_
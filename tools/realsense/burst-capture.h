@@ -0,0 +1,79 @@
+#ifndef REALSENSE_BURST_CAPTURE_H_
+#define REALSENSE_BURST_CAPTURE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "frame-ring.h"
+
+// BurstCapture collects consecutive framesets of a camera into its own preallocated slots,
+// bypassing the ring, so that a burst gets every frame the sensor produces, not the latest
+// frame at the moment the request thread gets to it. The frames are encoded after the burst.
+//
+// The request thread arms a burst and waits for it; the capture thread fills the slots.
+class BurstCapture {
+ public:
+  BurstCapture(size_t color_size, size_t depth_size) : color_size_(color_size), depth_size_(depth_size) {}
+
+  // Request thread. Starts collecting the next num_frames framesets. The slots are allocated on the
+  // first burst of this size and reused afterwards.
+  void arm(int num_frames) {
+    while (static_cast<int>(slots_.size()) < num_frames) {
+      slots_.emplace_back(new FrameSlot);
+      slots_.back()->color.resize(color_size_);
+      slots_.back()->depth.resize(depth_size_);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      num_frames_ = num_frames;
+      captured_ = 0;
+      done_ = false;
+    }
+    armed_.store(true, std::memory_order_release);
+  }
+
+  // Request thread. Waits until all frames of the armed burst are captured.
+  void wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_cv_.wait(lock, [this] { return done_; });
+  }
+
+  // Request thread, after wait.
+  FrameSlot* slot(int index) { return slots_[index].get(); }
+
+  // Capture thread. Returns the slot for the next frame of the burst, or nullptr, if no burst is armed.
+  FrameSlot* begin_write() {
+    if (!armed_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return slots_[captured_].get();
+  }
+
+  // Capture thread. The slot returned by begin_write is filled.
+  void commit() {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (++captured_ == num_frames_) {
+      armed_.store(false, std::memory_order_release);
+      done_ = true;
+      done_cv_.notify_all();
+    }
+  }
+
+ private:
+  size_t color_size_;
+  size_t depth_size_;
+  // Only resized by the request thread, while no burst is armed.
+  std::vector<std::unique_ptr<FrameSlot>> slots_;
+  std::atomic<bool> armed_{false};
+
+  std::mutex mu_;
+  std::condition_variable done_cv_;
+  int num_frames_ = 0;
+  int captured_ = 0;
+  bool done_ = false;
+};
+
+#endif  // REALSENSE_BURST_CAPTURE_H_
@@ -0,0 +1,52 @@
+#include "change-detect.h"
+
+#include "pixel-kernels.h"
+
+namespace {
+
+bool same_region(const ChangeRegion& a, const ChangeRegion& b) {
+  return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+}  // namespace
+
+bool ChangeDetector::compare(const uint8_t* bgr, int bgr_stride, int color_width, const uint16_t* depth,
+                             int depth_stride, int depth_width, float depth_scale, const ChangeRegion& region,
+                             ChangeScore* score) {
+  int step = opts_.step;
+  int cols = region.width / step;
+  int rows = region.height / step;
+  color_.resize(static_cast<size_t>(cols) * rows * 3);
+  depth_.resize(static_cast<size_t>(cols) * rows);
+  region_ = region;
+  // The sample is the center of its step x step cell.
+  uint8_t* color_out = color_.data();
+  uint16_t* depth_out = depth_.data();
+  for (int v = 0; v < rows; v++) {
+    int y = region.y + v * step + step / 2;
+    int depth_y = y * depth_width / color_width;
+    gather_pixels<Bgr8>(image_row<Bgr8>(bgr, bgr_stride, y), region.x + step / 2, step, cols, color_out);
+    color_out += cols * Bgr8::kChannels;
+    const uint16_t* depth_row = image_row<Z16>(depth, depth_stride, depth_y);
+    for (int u = 0; u < cols; u++) {
+      int x = region.x + u * step + step / 2;
+      *depth_out++ = depth_row[x * depth_width / color_width];
+    }
+  }
+  *score = ChangeScore();
+  if (!has_ref_ || !same_region(region_, ref_region_) || color_.empty()) {
+    return true;
+  }
+  score->color_sad = static_cast<float>(sad_u8(color_.data(), ref_color_.data(), color_.size())) / color_.size();
+  int delta = static_cast<int>(opts_.depth_delta_mm / 1000 / depth_scale);
+  score->depth_moved =
+      static_cast<float>(count_moved_z16(depth_.data(), ref_depth_.data(), depth_.size(), delta)) / depth_.size();
+  return score->color_sad > opts_.color_threshold || score->depth_moved > opts_.depth_threshold;
+}
+
+void ChangeDetector::keep() {
+  ref_color_.swap(color_);
+  ref_depth_.swap(depth_);
+  ref_region_ = region_;
+  has_ref_ = true;
+}
@@ -0,0 +1,65 @@
+#ifndef REALSENSE_CHANGE_DETECT_H_
+#define REALSENSE_CHANGE_DETECT_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+// Thresholds of the if_changed=1 requests, as in --change_color_threshold, etc.
+struct ChangeOptions {
+  // Distance between the samples, in color pixels.
+  int step = 8;
+  // Mean absolute difference of the sampled color channels, 0-255, above which the frame has changed.
+  float color_threshold = 3;
+  // Depth difference in mm, above which a depth sample has moved. A hole, which appears or goes away, has too.
+  float depth_delta_mm = 30;
+  // Fraction of the depth samples, which may move in a frame, that hasn't changed.
+  float depth_threshold = 0.01f;
+};
+
+// The part of the color frame to compare, in color pixels.
+struct ChangeRegion {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+};
+
+struct ChangeScore {
+  // Mean absolute difference of the sampled color channels.
+  float color_sad = 0;
+  // Fraction of the depth samples, which moved.
+  float depth_moved = 0;
+};
+
+// ChangeDetector tells, whether a frame differs from the reference, the last frame it was told to keep.
+// It only looks at a sparse grid of samples, a few thousand per frame: the sum of absolute differences
+// of the color, and the share of the depth samples, which moved by more than depth_delta_mm. The samples
+// are gathered into plain arrays first, so that the comparisons are the SIMD kernels of pixel-kernels.h.
+// The sample arrays of the frame and of the reference are swapped by keep, not copied, and only grow, when
+// the region does. Not thread-safe.
+class ChangeDetector {
+ public:
+  explicit ChangeDetector(const ChangeOptions& opts) : opts_(opts) {}
+
+  // Samples the region of the frame and compares it with the reference. The depth is aligned to color,
+  // but may be decimated: it's sampled at the same points, scaled by depth_width / color_width.
+  // Returns true, if the frame has changed, or if there's no reference for this region yet.
+  bool compare(const uint8_t* bgr, int bgr_stride, int color_width, const uint16_t* depth, int depth_stride,
+               int depth_width, float depth_scale, const ChangeRegion& region, ChangeScore* score);
+
+  // Makes the frame of the last compare the reference.
+  void keep();
+
+ private:
+  ChangeOptions opts_;
+  std::vector<uint8_t> color_;
+  std::vector<uint16_t> depth_;
+  ChangeRegion region_;
+  std::vector<uint8_t> ref_color_;
+  std::vector<uint16_t> ref_depth_;
+  ChangeRegion ref_region_;
+  bool has_ref_ = false;
+};
+
+#endif  // REALSENSE_CHANGE_DETECT_H_
@@ -0,0 +1,160 @@
+#include "depth-align.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <librealsense2/rsutil.h>
+
+// Rays through the top-left (0) and the bottom-right (1) corners of every depth pixel,
+// rotated into the color camera frame. A corner at distance z is at z * ray + t.
+struct ReprojectionTable {
+  int depth_width = 0;
+  int depth_height = 0;
+  int width = 0;
+  int height = 0;
+  float depth_scale = 0;
+  float fx = 0, fy = 0, ppx = 0, ppy = 0;
+  float tx = 0, ty = 0, tz = 0;
+  std::vector<float> x0, y0, z0, x1, y1, z1;
+};
+
+namespace {
+
+// rs2_project_point_to_pixel only distorts the points for these models.
+bool has_projection_distortion(const rs2_intrinsics& intrin) {
+  if (intrin.model != RS2_DISTORTION_MODIFIED_BROWN_CONRADY && intrin.model != RS2_DISTORTION_BROWN_CONRADY) {
+    return false;
+  }
+  for (float c : intrin.coeffs) {
+    if (c != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void rotated_ray(const rs2_intrinsics& depth, const rs2_extrinsics& ext, float px, float py, float ray[3]) {
+  float pixel[2] = {px, py};
+  float p[3];
+  rs2_deproject_pixel_to_point(p, &depth, pixel, 1);
+  // The rotation is column-major, same as in rs2_transform_point_to_point.
+  const float* r = ext.rotation;
+  ray[0] = r[0] * p[0] + r[3] * p[1] + r[6] * p[2];
+  ray[1] = r[1] * p[0] + r[4] * p[1] + r[7] * p[2];
+  ray[2] = r[2] * p[0] + r[5] * p[1] + r[8] * p[2];
+}
+
+// Projects the corners of a depth row into the color image. Written without branches, to be vectorized.
+// The pixel coordinates are clamped before the conversion to int, so that a corner behind the camera
+// or of a pixel without depth can't overflow. Those are skipped later anyway.
+void project_row(const ReprojectionTable& t, const float* __restrict__ rx, const float* __restrict__ ry,
+                 const float* __restrict__ rz, const uint16_t* __restrict__ depth, int n, int* __restrict__ out_x,
+                 int* __restrict__ out_y) {
+  const float max_x = t.width + 1;
+  const float max_y = t.height + 1;
+  for (int i = 0; i < n; i++) {
+    float z = depth[i] * t.depth_scale;
+    float qx = z * rx[i] + t.tx;
+    float qy = z * ry[i] + t.ty;
+    float qz = z * rz[i] + t.tz;
+    float inv = 1.0f / qz;
+    float u = t.fx * qx * inv + t.ppx;
+    float v = t.fy * qy * inv + t.ppy;
+    // fmaxf/fminf also turn NaN into the bound.
+    out_x[i] = static_cast<int>(fminf(fmaxf(u + 0.5f, -2.0f), max_x));
+    out_y[i] = static_cast<int>(fminf(fmaxf(v + 0.5f, -2.0f), max_y));
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<DepthAligner> DepthAligner::create(const rs2_intrinsics& depth, const rs2_intrinsics& color,
+                                                   const rs2_extrinsics& depth_to_color, float depth_scale,
+                                                   std::string* err) {
+  if (has_projection_distortion(color)) {
+    *err = "the color stream has a lens distortion";
+    return nullptr;
+  }
+  std::shared_ptr<ReprojectionTable> t = std::make_shared<ReprojectionTable>();
+  t->depth_width = depth.width;
+  t->depth_height = depth.height;
+  t->width = color.width;
+  t->height = color.height;
+  t->depth_scale = depth_scale;
+  t->fx = color.fx;
+  t->fy = color.fy;
+  t->ppx = color.ppx;
+  t->ppy = color.ppy;
+  t->tx = depth_to_color.translation[0];
+  t->ty = depth_to_color.translation[1];
+  t->tz = depth_to_color.translation[2];
+  size_t n = depth.width * depth.height;
+  for (std::vector<float>* v : {&t->x0, &t->y0, &t->z0, &t->x1, &t->y1, &t->z1}) {
+    v->resize(n);
+  }
+  for (int y = 0; y < depth.height; y++) {
+    for (int x = 0; x < depth.width; x++) {
+      size_t i = y * depth.width + x;
+      float ray[3];
+      rotated_ray(depth, depth_to_color, x - 0.5f, y - 0.5f, ray);
+      t->x0[i] = ray[0];
+      t->y0[i] = ray[1];
+      t->z0[i] = ray[2];
+      rotated_ray(depth, depth_to_color, x + 0.5f, y + 0.5f, ray);
+      t->x1[i] = ray[0];
+      t->y1[i] = ray[1];
+      t->z1[i] = ray[2];
+    }
+  }
+  return std::unique_ptr<DepthAligner>(new DepthAligner(t));
+}
+
+DepthAligner::DepthAligner(std::shared_ptr<const ReprojectionTable> table)
+    : table_(table),
+      x0_(table->depth_width),
+      y0_(table->depth_width),
+      x1_(table->depth_width),
+      y1_(table->depth_width) {}
+
+std::unique_ptr<DepthAligner> DepthAligner::clone() const {
+  return std::unique_ptr<DepthAligner>(new DepthAligner(table_));
+}
+
+int DepthAligner::width() const {
+  return table_->width;
+}
+
+int DepthAligner::height() const {
+  return table_->height;
+}
+
+void DepthAligner::align(const uint16_t* depth, int depth_stride, uint16_t* out) {
+  const ReprojectionTable& t = *table_;
+  memset(out, 0, t.width * t.height * sizeof(uint16_t));
+  for (int y = 0; y < t.depth_height; y++) {
+    const uint16_t* row = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(depth) + y * depth_stride);
+    size_t base = y * t.depth_width;
+    project_row(t, &t.x0[base], &t.y0[base], &t.z0[base], row, t.depth_width, x0_.data(), y0_.data());
+    project_row(t, &t.x1[base], &t.y1[base], &t.z1[base], row, t.depth_width, x1_.data(), y1_.data());
+    for (int x = 0; x < t.depth_width; x++) {
+      uint16_t d = row[x];
+      if (d == 0) {
+        continue;
+      }
+      // Same as rs2::align: a pixel, which doesn't fit into the color image completely, is dropped.
+      if (x0_[x] < 0 || y0_[x] < 0 || x1_[x] >= t.width || y1_[x] >= t.height) {
+        continue;
+      }
+      for (int oy = y0_[x]; oy <= y1_[x]; oy++) {
+        uint16_t* dst = out + oy * t.width;
+        for (int ox = x0_[x]; ox <= x1_[x]; ox++) {
+          if (dst[ox] == 0 || d < dst[ox]) {
+            dst[ox] = d;
+          }
+        }
+      }
+    }
+  }
+}
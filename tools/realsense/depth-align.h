@@ -0,0 +1,48 @@
+#ifndef REALSENSE_DEPTH_ALIGN_H_
+#define REALSENSE_DEPTH_ALIGN_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+struct ReprojectionTable;
+
+// DepthAligner maps depth frames to the viewpoint of the color camera, like rs2::align(RS2_STREAM_COLOR) does.
+//
+// The intrinsics and the extrinsics are fixed for the session, so the direction of the ray through
+// every depth pixel corner, already rotated into the color camera frame, is computed once. Per frame,
+// a corner at distance z is then just z * ray + translation, projected with the pinhole color intrinsics.
+// The projection runs row by row over plain float arrays, so that the compiler vectorizes it.
+//
+// Like rs2::align, every depth pixel is splatted to the rectangle between the projections of its
+// top-left and bottom-right corners, and the nearest depth wins where rectangles overlap.
+class DepthAligner {
+ public:
+  // Returns nullptr and sets err, if the color stream has a lens distortion, which the tables don't model.
+  // rs2::align handles such streams.
+  static std::unique_ptr<DepthAligner> create(const rs2_intrinsics& depth, const rs2_intrinsics& color,
+                                              const rs2_extrinsics& depth_to_color, float depth_scale,
+                                              std::string* err);
+
+  // Another aligner with the same tables, for another thread. The tables are shared, the scratch buffers are not.
+  std::unique_ptr<DepthAligner> clone() const;
+
+  // depth_stride is in bytes. out has color width * color height pixels, tightly packed.
+  void align(const uint16_t* depth, int depth_stride, uint16_t* out);
+
+  int width() const;
+  int height() const;
+
+ private:
+  explicit DepthAligner(std::shared_ptr<const ReprojectionTable> table);
+
+  std::shared_ptr<const ReprojectionTable> table_;
+  // Projected corners of the current depth row.
+  std::vector<int> x0_, y0_, x1_, y1_;
+};
+
+#endif  // REALSENSE_DEPTH_ALIGN_H_
@@ -0,0 +1,53 @@
+#include "depth-colorize.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pixel-kernels.h"
+
+namespace {
+
+uint8_t jet_channel(float t, float center) {
+  float v = 1.5f - fabsf(4 * t - center);
+  return static_cast<uint8_t>(std::min(1.0f, std::max(0.0f, v)) * 255 + 0.5f);
+}
+
+}  // namespace
+
+DepthColorizer::DepthColorizer(float min_depth, float max_depth) : min_depth_(min_depth), max_depth_(max_depth) {
+  memset(palette_[0], 0, sizeof(palette_[0]));
+  for (int i = 1; i < 256; i++) {
+    float t = (i - 1) / 254.0f;
+    palette_[i][0] = jet_channel(t, 1);
+    palette_[i][1] = jet_channel(t, 2);
+    palette_[i][2] = jet_channel(t, 3);
+  }
+}
+
+void DepthColorizer::colorize(const uint16_t* depth, int depth_stride, int width, int height, int step,
+                              float depth_scale, uint8_t* bgr, int bgr_stride) {
+  // The range in depth units. It's at least a unit wide, so that mul is finite, and (hi - lo) * mul
+  // stays within 32 bits.
+  uint32_t lo = static_cast<uint32_t>(std::min(65534.0f, min_depth_ / depth_scale));
+  uint32_t hi = static_cast<uint32_t>(std::min(65535.0f, max_depth_ / depth_scale));
+  hi = std::max(hi, lo + 1);
+  uint32_t mul = (254u << 16) / (hi - lo);
+  int cols = (width + step - 1) / step;
+  int rows = (height + step - 1) / step;
+  row_.resize(cols);
+  index_.resize(cols);
+  for (int y = 0; y < rows; y++) {
+    const uint16_t* src = image_row<Z16>(depth, depth_stride, y * step);
+    if (step > 1) {
+      gather_pixels<Z16>(src, 0, step, cols, row_.data());
+      src = row_.data();
+    }
+    depth_to_index(src, cols, lo, hi, mul, index_.data());
+    uint8_t* out = bgr + y * bgr_stride;
+    for (int x = 0; x < cols; x++) {
+      memcpy(out + x * 3, palette_[index_[x]], 3);
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef REALSENSE_DEPTH_COLORIZE_H_
+#define REALSENSE_DEPTH_COLORIZE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+// Colorized depth previews of the depth_preview=1 requests, as in --depth_preview_range, etc.
+struct DepthPreviewOptions {
+  // Depth mapped to the ends of the color map, in meters. Nearer and farther points are clamped.
+  float min_depth = 0.2f;
+  float max_depth = 4;
+  // Max width of the preview images. The depth is subsampled by a whole step, so they may be narrower.
+  int width = 320;
+  int quality = 75;
+};
+
+// DepthColorizer turns 16-bit depth into BGR with the jet color map: near is blue, far is red, no data
+// is black. Every row takes two passes: the depth is mapped to 8-bit color map indices in fixed point
+// (depth_to_index of pixel-kernels.h), and the indices are looked up in a 256-entry palette,
+// which stays in L1. The row buffers are sized by the widest image so far. Not thread-safe: every thread,
+// which colorizes, has a colorizer of its own.
+class DepthColorizer {
+ public:
+  DepthColorizer(float min_depth, float max_depth);
+
+  // Colorizes every step-th pixel of every step-th row of the depth image into bgr, which must hold
+  // ceil(width / step) x ceil(height / step) pixels. The depth is not interpolated: that would make up
+  // distances between the objects and the background. depth_scale is meters per depth unit.
+  void colorize(const uint16_t* depth, int depth_stride, int width, int height, int step, float depth_scale,
+                uint8_t* bgr, int bgr_stride);
+
+ private:
+  float min_depth_;
+  float max_depth_;
+  // Index 0 is no data, 1-255 go from min_depth to max_depth.
+  uint8_t palette_[256][3];
+  // The subsampled depth of a row and its color map indices.
+  std::vector<uint16_t> row_;
+  std::vector<uint8_t> index_;
+};
+
+#endif  // REALSENSE_DEPTH_COLORIZE_H_
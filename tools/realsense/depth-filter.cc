@@ -0,0 +1,83 @@
+#include "depth-filter.h"
+
+#include <algorithm>
+#include <sstream>
+
+bool parse_depth_filters(const std::string& list, DepthFilterOptions* opts, std::string* err) {
+  *opts = DepthFilterOptions();
+  std::istringstream in(list);
+  std::string name;
+  while (std::getline(in, name, ',')) {
+    if (name == "spatial") {
+      opts->spatial = true;
+    } else if (name == "temporal") {
+      opts->temporal = true;
+    } else if (name == "hole_filling") {
+      opts->hole_filling = true;
+    } else {
+      *err = "unknown depth filter " + name + ", want spatial, temporal or hole_filling";
+      return false;
+    }
+  }
+  return true;
+}
+
+DepthFilterChain::DepthFilterChain(const DepthFilterOptions& opts) {
+  bool disparity = opts.spatial || opts.temporal;
+  if (disparity) {
+    filters_.push_back(&to_disparity_);
+  }
+  if (opts.spatial) {
+    filters_.push_back(&spatial_);
+  }
+  if (opts.temporal) {
+    filters_.push_back(&temporal_);
+  }
+  if (disparity) {
+    filters_.push_back(&to_depth_);
+  }
+  if (opts.hole_filling) {
+    filters_.push_back(&hole_filling_);
+  }
+}
+
+rs2::frameset DepthFilterChain::process(const rs2::frameset& data) {
+  // The filters take a frameset and only replace the depth frame in it.
+  rs2::frame res = data;
+  for (const rs2::filter* f : filters_) {
+    res = f->process(res);
+  }
+  return rs2::frameset(res);
+}
+
+void decimate_depth(const uint16_t* src, int src_stride, int width, int height, int factor, uint16_t* dst) {
+  int out_width = width / factor;
+  int out_height = height / factor;
+  uint16_t block[kMaxDecimation * kMaxDecimation];
+  for (int y = 0; y < out_height; y++) {
+    for (int x = 0; x < out_width; x++) {
+      int n = 0;
+      for (int by = 0; by < factor; by++) {
+        const uint16_t* row =
+            reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(src) + (y * factor + by) * src_stride);
+        for (int bx = x * factor; bx < (x + 1) * factor; bx++) {
+          if (row[bx] != 0) {
+            block[n++] = row[bx];
+          }
+        }
+      }
+      uint16_t d = 0;
+      if (n > 0 && factor <= 3) {
+        std::nth_element(block, block + n / 2, block + n);
+        d = block[n / 2];
+      } else if (n > 0) {
+        uint32_t sum = 0;
+        for (int i = 0; i < n; i++) {
+          sum += block[i];
+        }
+        d = sum / n;
+      }
+      dst[y * out_width + x] = d;
+    }
+  }
+}
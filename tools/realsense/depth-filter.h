@@ -0,0 +1,57 @@
+#ifndef REALSENSE_DEPTH_FILTER_H_
+#define REALSENSE_DEPTH_FILTER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+// Depth post-processing filters, as in --depth_filters=spatial,temporal,hole_filling.
+struct DepthFilterOptions {
+  bool spatial = false;
+  bool temporal = false;
+  bool hole_filling = false;
+};
+
+// Parses a comma-separated list of filter names. An empty list means no filters.
+bool parse_depth_filters(const std::string& list, DepthFilterOptions* opts, std::string* err);
+
+// DepthFilterChain runs the librealsense post-processing filters over the raw depth of every frameset,
+// in the order recommended by librealsense: spatial and temporal in the disparity domain, hole filling last.
+// The filters run before the alignment, on the depth as the sensor sees it.
+//
+// The temporal filter keeps a history of the previous frames, so the chain must see every frame of the
+// camera in order, the warm-up ones included, and it must only be used by one thread at a time.
+class DepthFilterChain {
+ public:
+  explicit DepthFilterChain(const DepthFilterOptions& opts);
+
+  bool empty() const { return filters_.empty(); }
+
+  // Returns the frameset with the filtered depth frame. The color frame is passed through.
+  rs2::frameset process(const rs2::frameset& data);
+
+ private:
+  rs2::disparity_transform to_disparity_{true};
+  rs2::disparity_transform to_depth_{false};
+  rs2::spatial_filter spatial_;
+  rs2::temporal_filter temporal_;
+  rs2::hole_filling_filter hole_filling_;
+  std::vector<const rs2::filter*> filters_;
+};
+
+// Max --decimation factor, same as in rs2::decimation_filter.
+const int kMaxDecimation = 8;
+
+// Downscales a depth image by factor in both directions, like rs2::decimation_filter does: every
+// factor x factor block becomes the median of its non-zero values for the factors 2 and 3, and their
+// mean for the larger ones. A block without data stays 0. The partial blocks at the right and bottom
+// edges are dropped.
+//
+// src_stride is in bytes. dst is (width / factor) x (height / factor), tightly packed. It may be the same
+// buffer as src, if src is tightly packed too: every block is read before its pixel is written.
+void decimate_depth(const uint16_t* src, int src_stride, int width, int height, int factor, uint16_t* dst);
+
+#endif  // REALSENSE_DEPTH_FILTER_H_
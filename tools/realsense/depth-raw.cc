@@ -0,0 +1,249 @@
+#include "depth-raw.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+// zstd levels above 1 cost more CPU than the PNG encoder we are replacing.
+const int kZstdLevel = 1;
+
+}  // namespace
+
+struct ZstdContext {
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* cctx = nullptr;
+#endif
+};
+
+bool parse_z16_compression(const std::string& name, Z16Compression* res, std::string* err) {
+  if (name == "none") {
+    *res = kZ16None;
+    return true;
+  }
+  if (name == "lz4") {
+#ifdef HAVE_LZ4
+    *res = kZ16Lz4;
+    return true;
+#else
+    *err = "realsense-snapshot is built without liblz4";
+    return false;
+#endif
+  }
+  if (name == "zstd") {
+#ifdef HAVE_ZSTD
+    *res = kZ16Zstd;
+    return true;
+#else
+    *err = "realsense-snapshot is built without libzstd";
+    return false;
+#endif
+  }
+  *err = "unknown depth compression " + name;
+  return false;
+}
+
+Z16Writer::Z16Writer(Z16Compression compression) : compression_(compression) {
+#ifdef HAVE_ZSTD
+  if (compression_ == kZ16Zstd) {
+    zstd_ = new ZstdContext;
+    zstd_->cctx = ZSTD_createCCtx();
+  }
+#endif
+}
+
+Z16Writer::~Z16Writer() {
+#ifdef HAVE_ZSTD
+  if (zstd_) {
+    ZSTD_freeCCtx(zstd_->cctx);
+  }
+#endif
+  delete zstd_;
+}
+
+Z16Header Z16Writer::make_header(int width, int height, float depth_scale, double timestamp,
+                                 unsigned long long frame_number, uint32_t payload_size) const {
+  Z16Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "Z16", 4);
+  header.version = kZ16Version;
+  header.compression = compression_;
+  header.width = width;
+  header.height = height;
+  header.depth_scale = depth_scale;
+  header.payload_size = payload_size;
+  header.timestamp = timestamp;
+  header.frame_number = frame_number;
+  return header;
+}
+
+bool Z16Writer::write(const std::string& fname, const uint16_t* depth, int width, int height, int stride,
+                      float depth_scale, double timestamp, unsigned long long frame_number) {
+  if (compression_ == kZ16None) {
+    Z16Header header = make_header(width, height, depth_scale, timestamp, frame_number, width * height * 2);
+    return write_mapped(fname, header, depth, width, height, stride);
+  }
+  size_t size = encode(depth, width, height, stride, depth_scale, timestamp, frame_number, &compressed_);
+  if (size == 0) {
+    return false;
+  }
+  int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(fname.c_str());
+    return false;
+  }
+  ssize_t n;
+  do {
+    n = ::write(fd, compressed_.data(), size);
+  } while (n < 0 && errno == EINTR);
+  if (n != static_cast<ssize_t>(size)) {
+    // Regular files don't do short writes, unless the disk is full.
+    if (n < 0) {
+      perror(fname.c_str());
+    } else {
+      fprintf(stderr, "%s: short write\n", fname.c_str());
+    }
+    close(fd);
+    return false;
+  }
+  return close(fd) == 0;
+}
+
+size_t Z16Writer::encode(const uint16_t* depth, int width, int height, int stride, float depth_scale,
+                         double timestamp, unsigned long long frame_number, std::vector<uint8_t>* buf) {
+  size_t raw_size = width * height * 2;
+  size_t max_payload = compression_ == kZ16None ? raw_size : compress_bound(raw_size);
+  if (buf->size() < sizeof(Z16Header) + max_payload) {
+    buf->resize(sizeof(Z16Header) + max_payload);
+  }
+  uint8_t* payload = buf->data() + sizeof(Z16Header);
+  size_t payload_size = raw_size;
+  if (compression_ == kZ16None) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(depth);
+    size_t row_size = width * 2;
+    for (int y = 0; y < height; y++) {
+      memcpy(payload + y * row_size, src + y * stride, row_size);
+    }
+  } else {
+    payload_size = compress(contiguous(depth, width, height, stride), raw_size, payload);
+    if (payload_size == 0) {
+      return 0;
+    }
+  }
+  Z16Header header = make_header(width, height, depth_scale, timestamp, frame_number, payload_size);
+  memcpy(buf->data(), &header, sizeof(header));
+  return sizeof(header) + payload_size;
+}
+
+// The file is sized upfront and mapped, so the depth rows are copied straight from the frame
+// into the page cache: no intermediate buffer and no write() per row. Its blocks are allocated before
+// it's mapped: a store into a page, which the disk has no room for, is a SIGBUS, not an error.
+bool Z16Writer::write_mapped(const std::string& fname, const Z16Header& header, const uint16_t* depth, int width,
+                             int height, int stride) {
+  size_t size = sizeof(Z16Header) + header.payload_size;
+  int fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(fname.c_str());
+    return false;
+  }
+  int err = posix_fallocate(fd, 0, size);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", fname.c_str(), strerror(err));
+    close(fd);
+    return false;
+  }
+  void* mem = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    perror(fname.c_str());
+    close(fd);
+    return false;
+  }
+  uint8_t* dst = static_cast<uint8_t*>(mem);
+  memcpy(dst, &header, sizeof(header));
+  dst += sizeof(header);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(depth);
+  size_t row_size = width * 2;
+  if (static_cast<size_t>(stride) == row_size) {
+    memcpy(dst, src, row_size * height);
+  } else {
+    for (int y = 0; y < height; y++) {
+      memcpy(dst + y * row_size, src + y * stride, row_size);
+    }
+  }
+  munmap(mem, size);
+  return close(fd) == 0;
+}
+
+const uint8_t* Z16Writer::contiguous(const uint16_t* depth, int width, int height, int stride) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(depth);
+  size_t row_size = width * 2;
+  if (static_cast<size_t>(stride) == row_size) {
+    return src;
+  }
+  // Both compressors want a contiguous input.
+  packed_.resize(row_size * height);
+  for (int y = 0; y < height; y++) {
+    memcpy(packed_.data() + y * row_size, src + y * stride, row_size);
+  }
+  return packed_.data();
+}
+
+size_t Z16Writer::compress_bound(size_t size) const {
+  switch (compression_) {
+#ifdef HAVE_LZ4
+    case kZ16Lz4:
+      return LZ4_compressBound(size);
+#endif
+#ifdef HAVE_ZSTD
+    case kZ16Zstd:
+      return ZSTD_compressBound(size);
+#endif
+    default:
+      return size;
+  }
+}
+
+size_t Z16Writer::compress(const uint8_t* src, size_t size, uint8_t* dst) {
+  switch (compression_) {
+#ifdef HAVE_LZ4
+    case kZ16Lz4: {
+      int n = LZ4_compress_default(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst), size,
+                                   compress_bound(size));
+      if (n <= 0) {
+        fprintf(stderr, "LZ4_compress_default failed\n");
+        return 0;
+      }
+      return n;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kZ16Zstd: {
+      size_t n = ZSTD_compressCCtx(zstd_->cctx, dst, compress_bound(size), src, size, kZstdLevel);
+      if (ZSTD_isError(n)) {
+        fprintf(stderr, "ZSTD_compressCCtx: %s\n", ZSTD_getErrorName(n));
+        return 0;
+      }
+      return n;
+    }
+#endif
+    default:
+      // Without liblz4 and libzstd, nothing else uses them.
+      (void)src;
+      (void)size;
+      (void)dst;
+      fprintf(stderr, "Unsupported depth compression %d\n", compression_);
+      return 0;
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef REALSENSE_DEPTH_RAW_H_
+#define REALSENSE_DEPTH_RAW_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Raw depth file format (.z16). All fields are little-endian.
+//
+//   Z16Header (48 bytes)
+//   payload   (payload_size bytes)
+//
+// Without compression, the payload is height rows of width uint16 depth values, with no padding.
+// Multiply a value by depth_scale to get the distance in meters; 0 means no data.
+// With compression, the payload is a single LZ4 block or a single zstd frame, which decompresses
+// to exactly width * height * 2 bytes.
+//
+// An uncompressed file can be memory-mapped and used as is, starting at offset sizeof(Z16Header).
+enum Z16Compression {
+  kZ16None = 0,
+  kZ16Lz4 = 1,
+  kZ16Zstd = 2,
+};
+
+struct Z16Header {
+  char magic[4];  // "Z16\0"
+  uint16_t version;
+  uint16_t compression;  // Z16Compression
+  uint32_t width;
+  uint32_t height;
+  float depth_scale;
+  uint32_t payload_size;
+  double timestamp;  // librealsense frame timestamp, ms.
+  uint64_t frame_number;
+  uint32_t reserved[2];
+};
+
+static_assert(sizeof(Z16Header) == 48, "Z16Header must be 48 bytes");
+
+const uint16_t kZ16Version = 1;
+
+// Parses none, lz4 or zstd. Returns false, if the name is unknown or the library is not linked in.
+bool parse_z16_compression(const std::string& name, Z16Compression* res, std::string* err);
+
+struct ZstdContext;
+
+// Z16Writer writes depth frames in the .z16 format. It keeps its scratch buffers between calls,
+// so an instance should be reused for all frames written by a thread. Not thread-safe.
+class Z16Writer {
+ public:
+  explicit Z16Writer(Z16Compression compression);
+  ~Z16Writer();
+
+  // stride is the distance between the rows of depth, in bytes.
+  bool write(const std::string& fname, const uint16_t* depth, int width, int height, int stride,
+             float depth_scale, double timestamp, unsigned long long frame_number);
+
+  // Same as write, but puts the whole file into the beginning of buf instead.
+  // Returns the size of the file, or 0 on failure.
+  size_t encode(const uint16_t* depth, int width, int height, int stride, float depth_scale, double timestamp,
+                unsigned long long frame_number, std::vector<uint8_t>* buf);
+
+ private:
+  Z16Header make_header(int width, int height, float depth_scale, double timestamp,
+                        unsigned long long frame_number, uint32_t payload_size) const;
+  bool write_mapped(const std::string& fname, const Z16Header& header, const uint16_t* depth, int width,
+                    int height, int stride);
+  // Returns depth with the rows packed without gaps. May point to packed_.
+  const uint8_t* contiguous(const uint16_t* depth, int width, int height, int stride);
+  // Compresses src into dst, which has room for at least compress_bound(size) bytes. Returns 0 on failure.
+  size_t compress(const uint8_t* src, size_t size, uint8_t* dst);
+  size_t compress_bound(size_t size) const;
+
+  Z16Compression compression_;
+  std::vector<uint8_t> packed_;
+  std::vector<uint8_t> compressed_;
+  ZstdContext* zstd_ = nullptr;
+};
+
+#endif  // REALSENSE_DEPTH_RAW_H_
@@ -0,0 +1,110 @@
+#include "file-io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+// Length of the directory part of fname, without the trailing slash. 0 means the current directory.
+size_t parent_dir_len(const std::string& fname) {
+  size_t slash = fname.rfind('/');
+  if (slash == std::string::npos) {
+    return 0;
+  }
+  // The root directory keeps its slash.
+  return slash == 0 ? 1 : slash;
+}
+
+}  // namespace
+
+bool parse_durability(const std::string& name, Durability* res, std::string* err) {
+  if (name == "none") {
+    *res = kDurabilityNone;
+    return true;
+  }
+  if (name == "pack") {
+    *res = kDurabilityPack;
+    return true;
+  }
+  if (name == "frame") {
+    *res = kDurabilityFrame;
+    return true;
+  }
+  *err = "must be none, pack or frame";
+  return false;
+}
+
+int create_file(const std::string& fname, const uint8_t* data, size_t size) {
+  int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(fname.c_str());
+    return -1;
+  }
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror(fname.c_str());
+      close(fd);
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return fd;
+}
+
+bool write_file(const std::string& fname, const uint8_t* data, size_t size, bool sync) {
+  int fd = create_file(fname, data, size);
+  if (fd < 0) {
+    return false;
+  }
+  if (sync && fdatasync(fd) != 0) {
+    perror(fname.c_str());
+    close(fd);
+    return false;
+  }
+  if (close(fd) != 0) {
+    perror(fname.c_str());
+    return false;
+  }
+  return !sync || sync_parent_dir(fname);
+}
+
+bool sync_parent_dir(const std::string& fname) {
+  // On the stack: this runs for every file with --durability=frame, which must not allocate.
+  char dir[PATH_MAX];
+  size_t len = parent_dir_len(fname);
+  if (len >= sizeof(dir)) {
+    fprintf(stderr, "%s: path is too long\n", fname.c_str());
+    return false;
+  }
+  if (len == 0) {
+    strcpy(dir, ".");
+  } else {
+    memcpy(dir, fname.data(), len);
+    dir[len] = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    perror(dir);
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  if (!ok) {
+    perror(dir);
+  }
+  close(fd);
+  return ok;
+}
+
+bool same_parent_dir(const std::string& a, const std::string& b) {
+  size_t len = parent_dir_len(a);
+  return len == parent_dir_len(b) && a.compare(0, len, b, 0, len) == 0;
+}
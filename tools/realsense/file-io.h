@@ -0,0 +1,35 @@
+#ifndef REALSENSE_FILE_IO_H_
+#define REALSENSE_FILE_IO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// What is on the disk, not just in the page cache, by the time a request is acknowledged.
+enum Durability {
+  kDurabilityNone = 0,
+  // The pack files are fsynced. Separate files are left to the page cache.
+  kDurabilityPack = 1,
+  // Every file is fdatasynced, and so is its directory, before its frame is reported done.
+  kDurabilityFrame = 2,
+};
+
+// Parses none, pack or frame.
+bool parse_durability(const std::string& name, Durability* res, std::string* err);
+
+// Creates or truncates fname and writes data into it. Returns the open file descriptor, or -1 on failure.
+// The error has been reported by then.
+int create_file(const std::string& fname, const uint8_t* data, size_t size);
+
+// Writes data to a file, replacing it, if it exists. With sync, the data and the directory entry are on disk
+// once it returns.
+bool write_file(const std::string& fname, const uint8_t* data, size_t size, bool sync);
+
+// fsyncs the directory fname is in, so that a newly created or renamed file survives a power loss.
+bool sync_parent_dir(const std::string& fname);
+
+// Returns true, if both files are in the same directory.
+bool same_parent_dir(const std::string& a, const std::string& b);
+
+#endif  // REALSENSE_FILE_IO_H_
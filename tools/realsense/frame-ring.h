@@ -0,0 +1,172 @@
+#ifndef REALSENSE_FRAME_RING_H_
+#define REALSENSE_FRAME_RING_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+#include "stats.h"
+
+// FrameSlot holds one aligned color + depth frame pair. The pixels either live in the slot's own
+// buffers, allocated once at startup and reused for the whole life of the process, or, in the
+// zero-copy mode, in the librealsense frames the slot holds a reference to.
+struct FrameSlot {
+  std::vector<uint8_t> color;
+  std::vector<uint8_t> depth;
+
+  // Zero-copy mode only. Holding the references keeps the data pointers below valid.
+  rs2::frame color_frame;
+  rs2::frame depth_frame;
+
+  // Point either to the buffers above, or to the librealsense frame data.
+  const uint8_t* color_data = nullptr;
+  const uint8_t* depth_data = nullptr;
+  int color_stride = 0;
+  int depth_stride = 0;
+  // Resolution of the depth image. It's the color resolution, unless the depth is decimated.
+  int depth_width = 0;
+  int depth_height = 0;
+
+  // Publication number assigned by FrameRing::publish. 0 means the slot has never been published.
+  uint64_t seq = 0;
+  unsigned long long frame_number = 0;
+  double timestamp = 0;
+  // Timestamp of the depth frame. In a well synchronized frameset, it's the same as the color one.
+  double depth_timestamp = 0;
+  // Capture, align and copy times of this frame.
+  Timings timings;
+
+  // Lazy alignment only: the frameset as captured, and whether it's aligned into the fields above yet.
+  rs2::frameset raw;
+  bool aligned = true;
+
+  // -1 while the producer fills the slot, otherwise the number of readers holding it.
+  std::atomic<int> pins{0};
+};
+
+// FrameRing is a single-producer, multi-consumer ring of preallocated frame slots.
+//
+// The producer (capture thread) only ever writes into a slot that is neither the latest
+// published one, nor pinned by a reader. Readers pin the latest slot and keep it for as long
+// as they need. Ownership is handed over with compare-and-swap on FrameSlot::pins, so neither
+// side takes a lock and the capture thread never waits for the encoders.
+//
+// A reader waiting for a new frame sleeps on a condition variable. The producer only takes its mutex,
+// to wake the reader, if somebody waits: with no request waiting, publishing stays lock-free.
+class FrameRing {
+ public:
+  // color_size and depth_size may be 0, if the slots are never going to hold a copy of the pixels.
+  FrameRing(size_t num_slots, size_t color_size, size_t depth_size) : slots_(num_slots) {
+    for (FrameSlot& slot : slots_) {
+      slot.color.resize(color_size);
+      slot.depth.resize(depth_size);
+    }
+  }
+
+  // Producer side. Returns nullptr if all slots are busy, in which case the frame must be dropped.
+  FrameSlot* begin_write() {
+    int latest = latest_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < slots_.size(); i++) {
+      if (static_cast<int>(i) == latest) {
+        continue;
+      }
+      int expected = 0;
+      if (slots_[i].pins.compare_exchange_strong(expected, -1, std::memory_order_acquire)) {
+        return &slots_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Producer side. Gives back a slot taken with begin_write without publishing it.
+  void abort_write(FrameSlot* slot) {
+    slot->pins.store(0, std::memory_order_release);
+  }
+
+  void publish(FrameSlot* slot) {
+    slot->seq = next_seq_++;
+    slot->pins.store(0, std::memory_order_release);
+    latest_.store(static_cast<int>(slot - slots_.data()), std::memory_order_release);
+    // Sequentially consistent with waiters_ in acquire: either the reader sees the new seq, or we see it waiting.
+    published_seq_.store(slot->seq);
+    if (waiters_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mu_);
+      published_.notify_all();
+    }
+  }
+
+  // Consumer side. Pins and returns the latest slot, if it's newer than after_seq.
+  // Returns nullptr otherwise.
+  FrameSlot* try_acquire(uint64_t after_seq) {
+    while (1) {
+      int idx = latest_.load(std::memory_order_acquire);
+      if (idx < 0) {
+        return nullptr;
+      }
+      FrameSlot* slot = &slots_[idx];
+      int pins = slot->pins.load(std::memory_order_relaxed);
+      if (pins < 0 || !slot->pins.compare_exchange_weak(pins, pins + 1, std::memory_order_acquire)) {
+        continue;
+      }
+      if (latest_.load(std::memory_order_acquire) != idx) {
+        // A newer frame was published while we were pinning this one. Try again.
+        release(slot);
+        continue;
+      }
+      if (slot->seq <= after_seq) {
+        release(slot);
+        return nullptr;
+      }
+      return slot;
+    }
+  }
+
+  // Same as try_acquire, but waits until a frame newer than after_seq is published.
+  FrameSlot* acquire(uint64_t after_seq) {
+    while (1) {
+      FrameSlot* slot = try_acquire(after_seq);
+      if (slot) {
+        return slot;
+      }
+      waiters_.fetch_add(1);
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        published_.wait(lock, [this, after_seq] { return published_seq_.load() > after_seq; });
+      }
+      waiters_.fetch_sub(1);
+    }
+  }
+
+  void release(FrameSlot* slot) {
+    slot->pins.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Publication number of the latest frame, or 0 if nothing is published yet.
+  uint64_t latest_seq() {
+    FrameSlot* slot = try_acquire(0);
+    if (!slot) {
+      return 0;
+    }
+    uint64_t seq = slot->seq;
+    release(slot);
+    return seq;
+  }
+
+ private:
+  std::vector<FrameSlot> slots_;
+  std::atomic<int> latest_{-1};
+  // Only accessed by the producer.
+  uint64_t next_seq_ = 1;
+  // Seq of the latest published frame, and the readers blocked in acquire.
+  std::atomic<uint64_t> published_seq_{0};
+  std::atomic<int> waiters_{0};
+  std::mutex mu_;
+  std::condition_variable published_;
+};
+
+#endif  // REALSENSE_FRAME_RING_H_
@@ -0,0 +1,58 @@
+#include "heap-stats.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+void* allocate(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  // operator new must return a unique pointer even for 0 bytes.
+  return malloc(size ? size : 1);
+}
+
+}  // namespace
+
+uint64_t heap_allocations() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+  void* p = allocate(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  free(p);
+}
@@ -0,0 +1,12 @@
+#ifndef REALSENSE_HEAP_STATS_H_
+#define REALSENSE_HEAP_STATS_H_
+
+#include <stdint.h>
+
+// Number of the heap allocations of the process so far. heap-stats.cc replaces the global operator new,
+// so this counts everything allocated through it: our code, the standard library, and the C++ parts
+// of librealsense and OpenCV. Plain malloc calls of the C libraries under them (libpng, libjpeg) are not
+// counted. Thread-safe, and cheap enough to leave on: a relaxed atomic increment per allocation.
+uint64_t heap_allocations();
+
+#endif  // REALSENSE_HEAP_STATS_H_
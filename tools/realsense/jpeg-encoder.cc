@@ -0,0 +1,329 @@
+#include "jpeg-encoder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef HAVE_V4L2
+#include <linux/videodev2.h>
+#endif
+
+namespace {
+
+class OpenCvJpegEncoder : public JpegEncoder {
+ public:
+  explicit OpenCvJpegEncoder(int quality) : params_{CV_IMWRITE_JPEG_QUALITY, quality} {}
+
+  size_t encode(const uint8_t* bgr, int width, int height, int stride, std::vector<uint8_t>* buf) override {
+    cv::Mat mat(height, width, CV_8UC3, const_cast<uint8_t*>(bgr), stride);
+    if (!cv::imencode(".jpg", mat, *buf, params_)) {
+      return 0;
+    }
+    return buf->size();
+  }
+
+ private:
+  std::vector<int> params_;
+};
+
+#ifdef HAVE_TURBOJPEG
+class TurboJpegEncoder : public JpegEncoder {
+ public:
+  explicit TurboJpegEncoder(int quality) : quality_(quality), handle_(tjInitCompress()) {}
+
+  ~TurboJpegEncoder() override {
+    if (handle_) {
+      tjDestroy(handle_);
+    }
+  }
+
+  bool ok() const { return handle_ != nullptr; }
+
+  size_t encode(const uint8_t* bgr, int width, int height, int stride, std::vector<uint8_t>* buf) override {
+    // tjBufSize is the worst case, so with TJFLAG_NOREALLOC the library writes straight into buf.
+    unsigned long max_size = tjBufSize(width, height, TJSAMP_420);
+    if (buf->size() < max_size) {
+      buf->resize(max_size);
+    }
+    unsigned char* dst = buf->data();
+    unsigned long size = buf->size();
+    if (tjCompress2(handle_, bgr, width, stride, height, TJPF_BGR, &dst, &size, TJSAMP_420, quality_,
+                    TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0) {
+      fprintf(stderr, "tjCompress2: %s\n", tjGetErrorStr2(handle_));
+      return 0;
+    }
+    return size;
+  }
+
+ private:
+  int quality_;
+  tjhandle handle_;
+};
+#endif  // HAVE_TURBOJPEG
+
+#ifdef HAVE_V4L2
+// V4l2JpegEncoder drives a multi-planar V4L2 memory-to-memory JPEG encoder with a single
+// MMAP buffer on each queue. The device is configured lazily, on the first frame of a given size.
+class V4l2JpegEncoder : public JpegEncoder {
+ public:
+  explicit V4l2JpegEncoder(int quality) : quality_(quality) {}
+
+  ~V4l2JpegEncoder() override {
+    release_buffers();
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool open_device(const std::string& device, std::string* err) {
+    fd_ = open(device.c_str(), O_RDWR);
+    if (fd_ < 0) {
+      *err = "failed to open " + device + ": " + strerror(errno);
+      return false;
+    }
+    v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(VIDIOC_QUERYCAP, &cap) < 0) {
+      *err = "VIDIOC_QUERYCAP failed on " + device + ": " + strerror(errno);
+      return false;
+    }
+    uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE) || !(caps & V4L2_CAP_STREAMING)) {
+      *err = device + " is not a multi-planar memory-to-memory device";
+      return false;
+    }
+    v4l2_control ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+    ctrl.value = quality_;
+    if (xioctl(VIDIOC_S_CTRL, &ctrl) < 0) {
+      fprintf(stderr, "%s: failed to set JPEG quality to %d: %s. Using the driver default.\n",
+              device.c_str(), quality_, strerror(errno));
+    }
+    return true;
+  }
+
+  size_t encode(const uint8_t* bgr, int width, int height, int stride, std::vector<uint8_t>* buf) override {
+    if (width != width_ || height != height_) {
+      if (!configure(width, height)) {
+        return 0;
+      }
+    }
+    // The device may want a wider line than ours, so copy line by line.
+    uint8_t* dst = static_cast<uint8_t*>(in_.start);
+    for (int y = 0; y < height; y++) {
+      memcpy(dst + y * in_bytesperline_, bgr + y * stride, width * 3);
+    }
+
+    v4l2_plane out_plane;
+    v4l2_buffer out_buf;
+    init_buffer(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &out_buf, &out_plane);
+    if (xioctl(VIDIOC_QBUF, &out_buf) < 0) {
+      perror("VIDIOC_QBUF (capture)");
+      return 0;
+    }
+    v4l2_plane in_plane;
+    v4l2_buffer in_buf;
+    init_buffer(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &in_buf, &in_plane);
+    in_plane.bytesused = in_bytesperline_ * height;
+    in_plane.length = in_.length;
+    if (xioctl(VIDIOC_QBUF, &in_buf) < 0) {
+      perror("VIDIOC_QBUF (output)");
+      return 0;
+    }
+
+    init_buffer(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &out_buf, &out_plane);
+    if (xioctl(VIDIOC_DQBUF, &out_buf) < 0) {
+      perror("VIDIOC_DQBUF (capture)");
+      return 0;
+    }
+    init_buffer(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &in_buf, &in_plane);
+    if (xioctl(VIDIOC_DQBUF, &in_buf) < 0) {
+      perror("VIDIOC_DQBUF (output)");
+      return 0;
+    }
+    size_t size = out_plane.bytesused;
+    if (buf->size() < size) {
+      buf->resize(size);
+    }
+    memcpy(buf->data(), out_.start, size);
+    return size;
+  }
+
+ private:
+  struct Mapping {
+    void* start = nullptr;
+    size_t length = 0;
+  };
+
+  int xioctl(unsigned long request, void* arg) {
+    int res;
+    do {
+      res = ioctl(fd_, request, arg);
+    } while (res < 0 && errno == EINTR);
+    return res;
+  }
+
+  void init_buffer(uint32_t type, v4l2_buffer* buf, v4l2_plane* plane) {
+    memset(buf, 0, sizeof(*buf));
+    memset(plane, 0, sizeof(*plane));
+    buf->type = type;
+    buf->memory = V4L2_MEMORY_MMAP;
+    buf->index = 0;
+    buf->m.planes = plane;
+    buf->length = 1;
+  }
+
+  bool configure(int width, int height) {
+    release_buffers();
+
+    v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    fmt.fmt.pix_mp.width = width;
+    fmt.fmt.pix_mp.height = height;
+    fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_BGR24;
+    fmt.fmt.pix_mp.num_planes = 1;
+    fmt.fmt.pix_mp.plane_fmt[0].bytesperline = width * 3;
+    if (xioctl(VIDIOC_S_FMT, &fmt) < 0) {
+      perror("VIDIOC_S_FMT (output)");
+      return false;
+    }
+    if (fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_BGR24 || static_cast<int>(fmt.fmt.pix_mp.width) != width ||
+        static_cast<int>(fmt.fmt.pix_mp.height) != height) {
+      fprintf(stderr, "V4L2 JPEG encoder does not accept %dx%d BGR24 images\n", width, height);
+      return false;
+    }
+    in_bytesperline_ = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    fmt.fmt.pix_mp.width = width;
+    fmt.fmt.pix_mp.height = height;
+    fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_JPEG;
+    fmt.fmt.pix_mp.num_planes = 1;
+    if (xioctl(VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_JPEG) {
+      fprintf(stderr, "V4L2 device can't produce JPEG images\n");
+      return false;
+    }
+
+    if (!map_buffer(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &in_) ||
+        !map_buffer(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &out_)) {
+      return false;
+    }
+    int types[] = {V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE};
+    for (int type : types) {
+      if (xioctl(VIDIOC_STREAMON, &type) < 0) {
+        perror("VIDIOC_STREAMON");
+        return false;
+      }
+    }
+    streaming_ = true;
+    width_ = width;
+    height_ = height;
+    return true;
+  }
+
+  bool map_buffer(uint32_t type, Mapping* mapping) {
+    v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.type = type;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count = 1;
+    if (xioctl(VIDIOC_REQBUFS, &req) < 0 || req.count < 1) {
+      perror("VIDIOC_REQBUFS");
+      return false;
+    }
+    v4l2_plane plane;
+    v4l2_buffer buf;
+    init_buffer(type, &buf, &plane);
+    if (xioctl(VIDIOC_QUERYBUF, &buf) < 0) {
+      perror("VIDIOC_QUERYBUF");
+      return false;
+    }
+    void* start = mmap(nullptr, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, plane.m.mem_offset);
+    if (start == MAP_FAILED) {
+      perror("mmap");
+      return false;
+    }
+    mapping->start = start;
+    mapping->length = plane.length;
+    return true;
+  }
+
+  void release_buffers() {
+    if (streaming_) {
+      int types[] = {V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE};
+      for (int type : types) {
+        xioctl(VIDIOC_STREAMOFF, &type);
+      }
+      streaming_ = false;
+    }
+    Mapping* mappings[] = {&in_, &out_};
+    for (Mapping* m : mappings) {
+      if (m->start) {
+        munmap(m->start, m->length);
+        *m = Mapping();
+      }
+    }
+    width_ = 0;
+    height_ = 0;
+  }
+
+  int quality_;
+  int fd_ = -1;
+  int width_ = 0;
+  int height_ = 0;
+  int in_bytesperline_ = 0;
+  bool streaming_ = false;
+  Mapping in_;
+  Mapping out_;
+};
+#endif  // HAVE_V4L2
+
+}  // namespace
+
+std::unique_ptr<JpegEncoder> create_jpeg_encoder(const std::string& backend, int quality,
+                                                 const std::string& v4l2_device, std::string* err) {
+  if (backend == "opencv") {
+    return std::unique_ptr<JpegEncoder>(new OpenCvJpegEncoder(quality));
+  }
+  if (backend == "turbojpeg") {
+#ifdef HAVE_TURBOJPEG
+    std::unique_ptr<TurboJpegEncoder> enc(new TurboJpegEncoder(quality));
+    if (!enc->ok()) {
+      *err = "tjInitCompress failed";
+      return nullptr;
+    }
+    return std::unique_ptr<JpegEncoder>(std::move(enc));
+#else
+    *err = "realsense-snapshot is built without libturbojpeg";
+    return nullptr;
+#endif
+  }
+  if (backend == "v4l2") {
+#ifdef HAVE_V4L2
+    std::unique_ptr<V4l2JpegEncoder> enc(new V4l2JpegEncoder(quality));
+    if (!enc->open_device(v4l2_device, err)) {
+      return nullptr;
+    }
+    return std::unique_ptr<JpegEncoder>(std::move(enc));
+#else
+    (void)v4l2_device;
+    *err = "realsense-snapshot is built without V4L2 support";
+    return nullptr;
+#endif
+  }
+  *err = "unknown JPEG encoder " + backend;
+  return nullptr;
+}
@@ -0,0 +1,33 @@
+#ifndef REALSENSE_JPEG_ENCODER_H_
+#define REALSENSE_JPEG_ENCODER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// JpegEncoder compresses BGR8 images. Implementations are not thread-safe:
+// every encoder thread creates its own instance.
+class JpegEncoder {
+ public:
+  virtual ~JpegEncoder() {}
+
+  // Encodes the image into the beginning of buf and returns the size of the JPEG, or 0 on failure.
+  // buf is grown as needed and is meant to be reused between the calls, so that the steady state
+  // does not allocate.
+  virtual size_t encode(const uint8_t* bgr, int width, int height, int stride, std::vector<uint8_t>* buf) = 0;
+};
+
+// Creates an encoder backend by name:
+//
+//   opencv    - cv::imencode. Always available.
+//   turbojpeg - libjpeg-turbo with its SIMD paths. Needs the tool to be built with libturbojpeg.
+//   v4l2      - hardware JPEG encoder exposed as a V4L2 memory-to-memory device (e.g. bcm2835-codec
+//               on Raspberry Pi, which is the V4L2 face of the MMAL encoder).
+//
+// Returns nullptr and sets err, if the backend is unknown or not available on this host.
+std::unique_ptr<JpegEncoder> create_jpeg_encoder(const std::string& backend, int quality,
+                                                 const std::string& v4l2_device, std::string* err);
+
+#endif  // REALSENSE_JPEG_ENCODER_H_
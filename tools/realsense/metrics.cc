@@ -0,0 +1,106 @@
+#include "metrics.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace {
+
+// Integers, like the byte and frame counters, are printed exactly: rate() of a rounded counter jumps.
+// 15 digits keep everything else, e.g. the CPU seconds, to the microsecond for years of uptime.
+void append_value(std::string* out, double value) {
+  char buf[32];
+  if (value == floor(value) && fabs(value) < 1e15) {
+    snprintf(buf, sizeof(buf), "%.0f", value);
+  } else {
+    snprintf(buf, sizeof(buf), "%.15g", value);
+  }
+  *out += buf;
+}
+
+// Escapes a label value as the text exposition format wants it.
+void append_label_value(std::string* out, const std::string& value) {
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      *out += '\\';
+      *out += c;
+    } else if (c == '\n') {
+      *out += "\\n";
+    } else {
+      *out += c;
+    }
+  }
+}
+
+}  // namespace
+
+void CameraMetrics::frameset_received(uint64_t frame_number, double timestamp_ms, uint64_t host_us, size_t size,
+                                      int64_t exposure) {
+  uint64_t expected_now = 1;
+  if (received.load(std::memory_order_relaxed) == 0) {
+    first_timestamp_ms_ = timestamp_ms;
+    first_host_us_ = host_us;
+  } else if (frame_number > last_frame_number_) {
+    expected_now = frame_number - last_frame_number_;
+  }
+  // Otherwise the numbering has started over, e.g. a recording is replayed from the start again.
+  last_frame_number_ = frame_number;
+  received.fetch_add(1, std::memory_order_relaxed);
+  expected.fetch_add(expected_now, std::memory_order_relaxed);
+  bytes.fetch_add(size, std::memory_order_relaxed);
+  exposure_us.store(exposure, std::memory_order_relaxed);
+  int64_t camera_us = static_cast<int64_t>((timestamp_ms - first_timestamp_ms_) * 1000);
+  drift_us.store(camera_us - static_cast<int64_t>(host_us - first_host_us_), std::memory_order_relaxed);
+}
+
+ProcessMetrics::ProcessMetrics() : bytes_written(0), bytes_published(0) {
+  for (auto& us : stage_cpu_us) {
+    us.store(0);
+  }
+}
+
+uint64_t thread_cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void MetricsText::add(const char* name, const char* type, const char* help, const char* label,
+                      const std::string& value_label, double value) {
+  samples_.push_back(Sample{name, type, help, label, value_label, value});
+}
+
+std::string MetricsText::prometheus() const {
+  std::string out;
+  for (size_t i = 0; i < samples_.size(); i++) {
+    const Sample& s = samples_[i];
+    if (i == 0 || strcmp(s.name, samples_[i - 1].name) != 0) {
+      out.append("# HELP realsense_").append(s.name).append(" ").append(s.help).append("\n");
+      out.append("# TYPE realsense_").append(s.name).append(" ").append(s.type).append("\n");
+    }
+    out.append("realsense_").append(s.name);
+    if (s.label) {
+      out.append("{").append(s.label).append("=\"");
+      append_label_value(&out, s.value_label);
+      out.append("\"}");
+    }
+    out += ' ';
+    append_value(&out, s.value);
+    out += '\n';
+  }
+  return out;
+}
+
+std::string MetricsText::line() const {
+  std::string out;
+  for (const Sample& s : samples_) {
+    out += ' ';
+    if (s.label && !s.value_label.empty()) {
+      out.append(s.value_label).append(".");
+    }
+    out.append(s.name).append("=");
+    append_value(&out, s.value);
+  }
+  return out;
+}
@@ -0,0 +1,85 @@
+#ifndef REALSENSE_METRICS_H_
+#define REALSENSE_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+// Live counters of a camera, as its capture thread sees the framesets come in. Only that thread writes
+// them, and the metrics thread reads them, so they are relaxed atomics.
+struct CameraMetrics {
+  // Framesets received, and the ones, which should have been, judging by the color frame numbers.
+  // The difference is what the camera, the USB link or librealsense dropped.
+  std::atomic<uint64_t> received{0};
+  std::atomic<uint64_t> expected{0};
+  // Framesets dropped by us: the align stage or all ring slots were busy, or a stream was missing.
+  std::atomic<uint64_t> dropped{0};
+  // Bytes of the color and the raw depth frames received: the USB payload.
+  std::atomic<uint64_t> bytes{0};
+  // Actual exposure of the latest color frame in microseconds, -1 without the frame metadata.
+  std::atomic<int64_t> exposure_us{-1};
+  // How far the camera timestamps have run ahead of the host monotonic clock since the first frameset,
+  // in microseconds. It includes the jitter of the capture thread wakeups.
+  std::atomic<int64_t> drift_us{0};
+
+  // Called by the capture thread for every frameset it receives, with the color frame number and timestamp.
+  void frameset_received(uint64_t frame_number, double timestamp_ms, uint64_t host_us, size_t size,
+                         int64_t exposure);
+
+ private:
+  uint64_t last_frame_number_ = 0;
+  double first_timestamp_ms_ = 0;
+  uint64_t first_host_us_ = 0;
+};
+
+// Process-wide counters, updated by whichever thread does the work. Relaxed atomics.
+struct ProcessMetrics {
+  ProcessMetrics();
+
+  // Encoded files and packs written to disk.
+  std::atomic<uint64_t> bytes_written;
+  // Encoded frames published into the shared-memory ring.
+  std::atomic<uint64_t> bytes_published;
+  // CPU time of the threads, which did the stage, in microseconds. The wait and total stages are
+  // not CPU work, and have none.
+  std::atomic<uint64_t> stage_cpu_us[kNumStages];
+
+  void add_cpu(Stage stage, uint64_t us) { stage_cpu_us[stage].fetch_add(us, std::memory_order_relaxed); }
+};
+
+// CPU time of the calling thread, microseconds.
+uint64_t thread_cpu_us();
+
+// MetricsText collects the samples of a single dump, and formats them either in the Prometheus text
+// exposition format, or as a single line of key=value pairs for the !metrics command.
+class MetricsText {
+ public:
+  // type is "counter" or "gauge". Counter names end with _total. label is the name of the only label, and
+  // value_label its value, or both are null for a sample without labels. All the samples of a metric must
+  // be added one after another.
+  void add(const char* name, const char* type, const char* help, const char* label, const std::string& value_label,
+           double value);
+
+  // # HELP and # TYPE once per metric, then a line per sample: name{label="value"} 12.5
+  std::string prometheus() const;
+  // " name=12.5 value.name=3 ...": the label value goes in front of the name, as in the FRAME lines.
+  std::string line() const;
+
+ private:
+  struct Sample {
+    const char* name;
+    const char* type;
+    const char* help;
+    const char* label;
+    std::string value_label;
+    double value;
+  };
+  std::vector<Sample> samples_;
+};
+
+#endif  // REALSENSE_METRICS_H_
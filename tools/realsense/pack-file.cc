@@ -0,0 +1,137 @@
+#include "pack-file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "file-io.h"
+
+namespace {
+
+const uint32_t kPackVersion = 1;
+
+uint8_t zeros[kPackAlignment];
+
+uint64_t align_up(uint64_t offset) {
+  return (offset + kPackAlignment - 1) / kPackAlignment * kPackAlignment;
+}
+
+// Writes all iovecs, handling partial writes and IOV_MAX.
+bool write_all(int fd, std::vector<iovec>* iov) {
+  size_t pos = 0;
+  while (pos < iov->size()) {
+    int count = std::min<size_t>(iov->size() - pos, IOV_MAX);
+    ssize_t n = writev(fd, iov->data() + pos, count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    // Skip the iovecs written completely and adjust the partially written one.
+    while (pos < iov->size() && static_cast<size_t>(n) >= (*iov)[pos].iov_len) {
+      n -= (*iov)[pos].iov_len;
+      pos++;
+    }
+    if (n > 0) {
+      (*iov)[pos].iov_base = static_cast<uint8_t*>((*iov)[pos].iov_base) + n;
+      (*iov)[pos].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void PackWriter::clear() {
+  records_.clear();
+  index_.clear();
+}
+
+bool PackWriter::add(PackRecordType type, int frame, const std::string& name, const uint8_t* data, size_t size) {
+  if (name.size() > kPackMaxName) {
+    return false;
+  }
+  PackIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.type = type;
+  entry.frame = frame;
+  entry.size = size;
+  memcpy(entry.name, name.data(), name.size());
+  index_.push_back(entry);
+  Record rec;
+  rec.data = data;
+  rec.size = size;
+  records_.push_back(rec);
+  return true;
+}
+
+uint64_t PackWriter::layout(std::vector<iovec>* iov) {
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, kPackMagic, sizeof(header_.magic));
+  header_.version = kPackVersion;
+
+  iov->clear();
+  iov->reserve(2 * records_.size() + 3);
+  iovec v;
+  v.iov_base = &header_;
+  v.iov_len = sizeof(header_);
+  iov->push_back(v);
+  uint64_t offset = sizeof(header_);
+  for (size_t i = 0; i < records_.size(); i++) {
+    uint64_t aligned = align_up(offset);
+    if (aligned > offset) {
+      v.iov_base = zeros;
+      v.iov_len = aligned - offset;
+      iov->push_back(v);
+    }
+    index_[i].offset = aligned;
+    v.iov_base = const_cast<uint8_t*>(records_[i].data);
+    v.iov_len = records_[i].size;
+    iov->push_back(v);
+    offset = aligned + records_[i].size;
+  }
+
+  memset(&footer_, 0, sizeof(footer_));
+  footer_.index_offset = offset;
+  footer_.num_records = index_.size();
+  memcpy(footer_.magic, kPackIndexMagic, sizeof(footer_.magic));
+  if (!index_.empty()) {
+    v.iov_base = index_.data();
+    v.iov_len = index_.size() * sizeof(PackIndexEntry);
+    iov->push_back(v);
+  }
+  v.iov_base = &footer_;
+  v.iov_len = sizeof(footer_);
+  iov->push_back(v);
+  return offset + index_.size() * sizeof(PackIndexEntry) + sizeof(footer_);
+}
+
+bool PackWriter::write(const std::string& fname, bool sync) {
+  std::vector<iovec> iov;
+  layout(&iov);
+  std::string tmp_fname = fname + ".tmp";
+  int fd = open(tmp_fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(tmp_fname.c_str());
+    return false;
+  }
+  if (!write_all(fd, &iov) || (sync && fsync(fd) != 0)) {
+    perror(tmp_fname.c_str());
+    close(fd);
+    unlink(tmp_fname.c_str());
+    return false;
+  }
+  if (close(fd) != 0 || rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+    perror(fname.c_str());
+    unlink(tmp_fname.c_str());
+    return false;
+  }
+  return !sync || sync_parent_dir(fname);
+}
@@ -0,0 +1,90 @@
+#ifndef REALSENSE_PACK_FILE_H_
+#define REALSENSE_PACK_FILE_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <vector>
+
+// Pack file format (.rspack): all frames of a train pack and its metadata in a single file.
+// All fields are little-endian.
+//
+//   PackFileHeader
+//   record data, each record starts at a multiple of kPackAlignment
+//   PackIndexEntry[num_records]
+//   PackFooter
+//
+// The index is at the end, so the file is written in one sequential pass. To read it,
+// take the footer from the last sizeof(PackFooter) bytes, then the index at index_offset.
+// Records keep the names the outputs would have as separate files (e.g. "03-color.jpg"),
+// so a pack can be unpacked into exactly the same files. The metadata record is named "meta.json".
+enum PackRecordType {
+  kPackMeta = 0,
+  kPackColor = 1,
+  kPackDepth = 2,
+  kPackPoints = 3,
+};
+
+const char kPackMagic[8] = {'R', 'S', 'P', 'A', 'C', 'K', '1', '\0'};
+const char kPackIndexMagic[8] = {'R', 'S', 'P', 'I', 'D', 'X', '1', '\0'};
+// Record data is aligned, so that raw depth records can be memory-mapped and used in place.
+const uint64_t kPackAlignment = 64;
+
+struct PackFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct PackIndexEntry {
+  uint32_t type;  // PackRecordType
+  uint32_t frame;
+  uint64_t offset;
+  uint64_t size;
+  char name[40];
+};
+
+struct PackFooter {
+  uint64_t index_offset;
+  uint32_t num_records;
+  uint32_t reserved;
+  char magic[8];
+};
+
+// Longest record name. The name in PackIndexEntry is NUL-terminated.
+const size_t kPackMaxName = sizeof(PackIndexEntry::name) - 1;
+
+static_assert(sizeof(PackFileHeader) == 16, "PackFileHeader must be 16 bytes");
+static_assert(sizeof(PackIndexEntry) == 64, "PackIndexEntry must be 64 bytes");
+static_assert(sizeof(PackFooter) == 24, "PackFooter must be 24 bytes");
+
+// PackWriter collects the records of a pack and writes them with a single writev and a single fsync.
+class PackWriter {
+ public:
+  void clear();
+
+  // The data is not copied and must stay valid until write returns. Returns false, if the name is longer
+  // than kPackMaxName: the index has no room for it, and nothing is added.
+  bool add(PackRecordType type, int frame, const std::string& name, const uint8_t* data, size_t size);
+
+  // Writes the pack to a temporary file and renames it to fname, so that a reader never sees a partially
+  // written pack. With sync, the file is fsynced before the rename, and the directory after it.
+  bool write(const std::string& fname, bool sync);
+
+  // Lays the pack out exactly as write puts it into the file, without copying the records: the iovecs point
+  // at the records and into the writer. They stay valid until the next call. Returns the size of the pack.
+  uint64_t layout(std::vector<iovec>* iov);
+
+ private:
+  struct Record {
+    const uint8_t* data;
+    size_t size;
+  };
+  std::vector<Record> records_;
+  std::vector<PackIndexEntry> index_;
+  PackFileHeader header_;
+  PackFooter footer_;
+};
+
+#endif  // REALSENSE_PACK_FILE_H_
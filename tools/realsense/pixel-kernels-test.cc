@@ -0,0 +1,190 @@
+// pixel-kernels-test checks the AVX2 and NEON versions of the pixel kernels (see pixel-kernels.h) against
+// plain scalar loops, on random buffers of every length up to a few vectors and a few larger ones, so that
+// the tails and the vector loops both get their share, and with the deltas around the 16-bit edges.
+//
+//   pixel-kernels-test [--bench]
+//
+// Whatever version the target flags choose is tested: built with the default flags, it's the portable one
+// on x86-64. CMakeLists.txt also builds it with -mavx2, which exits with 77, skipped, on a CPU without AVX2.
+// With --bench, it also prints the throughput of the kernels on a 640x480 frame. The speedup of a SIMD version
+// is its throughput over the one of the portable build: the scalar loops here are vectorized by the compiler
+// as the flags allow, so they are no baseline.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <random>
+#include <vector>
+
+#include "pixel-kernels.h"
+
+namespace {
+
+// Exit status of a test, which can't run on this CPU.
+const int kSkipped = 77;
+
+uint64_t sad_u8_scalar(const uint8_t* a, const uint8_t* b, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  }
+  return sum;
+}
+
+size_t count_moved_z16_scalar(const uint16_t* a, const uint16_t* b, size_t n, int delta) {
+  size_t moved = 0;
+  for (size_t i = 0; i < n; i++) {
+    int d = abs(static_cast<int>(a[i]) - static_cast<int>(b[i]));
+    if (d > delta || (a[i] == 0) != (b[i] == 0)) {
+      moved++;
+    }
+  }
+  return moved;
+}
+
+std::vector<size_t> test_lengths() {
+  std::vector<size_t> res;
+  // Every tail of up to two AVX2 loops of either kernel.
+  for (size_t n = 0; n <= 70; n++) {
+    res.push_back(n);
+  }
+  for (size_t n : {127, 128, 129, 1000, 4099, 640 * 480}) {
+    res.push_back(n);
+  }
+  return res;
+}
+
+int failures = 0;
+
+void check(bool ok, const char* kernel, size_t n, int delta, unsigned long long got, unsigned long long want) {
+  if (!ok) {
+    fprintf(stderr, "%s: n=%zu delta=%d: got %llu, want %llu\n", kernel, n, delta, got, want);
+    failures++;
+  }
+}
+
+void test_sad_u8(std::mt19937* rng) {
+  std::uniform_int_distribution<int> byte(0, 255);
+  for (size_t n : test_lengths()) {
+    std::vector<uint8_t> a(n), b(n);
+    for (int round = 0; round < 3; round++) {
+      for (size_t i = 0; i < n; i++) {
+        if (round == 0) {
+          a[i] = byte(*rng);
+          b[i] = byte(*rng);
+        } else {
+          // The largest differences, both ways, which overflow anything narrower than 16 bits.
+          a[i] = (round == 1) == (i % 2 == 0) ? 255 : 0;
+          b[i] = 255 - a[i];
+        }
+      }
+      uint64_t want = sad_u8_scalar(a.data(), b.data(), n);
+      uint64_t got = sad_u8(a.data(), b.data(), n);
+      check(got == want, "sad_u8", n, -1, got, want);
+    }
+  }
+}
+
+void test_count_moved_z16(std::mt19937* rng) {
+  const int kDeltas[] = {0, 1, 7, 255, 1000, 32767, 32768, 40000, 65534, 65535, 65536, 100000};
+  std::uniform_int_distribution<int> value(0, 65535);
+  std::uniform_int_distribution<int> percent(0, 99);
+  for (size_t n : test_lengths()) {
+    std::vector<uint16_t> a(n), b(n);
+    for (int delta : kDeltas) {
+      for (size_t i = 0; i < n; i++) {
+        a[i] = value(*rng);
+        int p = percent(*rng);
+        if (p < 10) {
+          // Holes on one side, or both.
+          a[i] = 0;
+          b[i] = p < 5 ? 0 : value(*rng);
+        } else if (p < 60) {
+          // Right at the delta: one more or less tells moved from still.
+          int d = delta + (p % 3) - 1;
+          int v = p % 2 ? a[i] + d : a[i] - d;
+          b[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+        } else {
+          b[i] = value(*rng);
+        }
+      }
+      size_t want = count_moved_z16_scalar(a.data(), b.data(), n, delta);
+      size_t got = count_moved_z16(a.data(), b.data(), n, delta);
+      check(got == want, "count_moved_z16", n, delta, got, want);
+    }
+  }
+}
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Calls f until a second is up, and returns the calls per second. The sum keeps the calls from being dropped.
+template <class F>
+double calls_per_second(F f, uint64_t* sum) {
+  double start = now_s();
+  int calls = 0;
+  while (now_s() - start < 1) {
+    for (int i = 0; i < 10; i++) {
+      *sum += f();
+    }
+    calls += 10;
+  }
+  return calls / (now_s() - start);
+}
+
+void bench(std::mt19937* rng) {
+  const size_t kPixels = 640 * 480;
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::uniform_int_distribution<int> value(0, 65535);
+  std::vector<uint8_t> a8(kPixels * 3), b8(kPixels * 3);
+  std::vector<uint16_t> a16(kPixels), b16(kPixels);
+  for (size_t i = 0; i < a8.size(); i++) {
+    a8[i] = byte(*rng);
+    b8[i] = byte(*rng);
+  }
+  for (size_t i = 0; i < kPixels; i++) {
+    a16[i] = value(*rng);
+    b16[i] = value(*rng);
+  }
+  uint64_t sum = 0;
+  double sad = calls_per_second([&] { return sad_u8(a8.data(), b8.data(), a8.size()); }, &sum);
+  double moved = calls_per_second([&] { return count_moved_z16(a16.data(), b16.data(), kPixels, 30); }, &sum);
+  printf("sad_u8 640x480 BGR8: %.0f frames/s\n", sad);
+  printf("count_moved_z16 640x480: %.0f frames/s\n", moved);
+  // Never true, but the compiler doesn't know.
+  if (sum == 1) {
+    printf("\n");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+#if defined(__AVX2__)
+  if (!__builtin_cpu_supports("avx2")) {
+    fprintf(stderr, "No AVX2 on this CPU, skipped\n");
+    return kSkipped;
+  }
+  const char* version = "AVX2";
+#elif defined(REALSENSE_NEON)
+  const char* version = "NEON";
+#else
+  const char* version = "portable";
+#endif
+  std::mt19937 rng(12345);
+  test_sad_u8(&rng);
+  test_count_moved_z16(&rng);
+  if (failures > 0) {
+    fprintf(stderr, "%s kernels: %d failures\n", version, failures);
+    return 1;
+  }
+  printf("%s kernels: OK\n", version);
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench(&rng);
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef REALSENSE_PIXEL_KERNELS_H_
+#define REALSENSE_PIXEL_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define REALSENSE_NEON 1
+#endif
+
+// Row kernels for the only two pixel formats the tool ever sees: BGR8 color and Z16 depth.
+//
+// The format is a template parameter, so the pixel size is a constant: copying a pixel is a fixed-size load
+// and store, not a memcpy with a runtime size, or a dispatch on the type as in cv::Mat. The arithmetic kernels
+// have AVX2 and NEON versions, chosen at compile time by the target flags (see CMakeLists.txt). The portable
+// versions, which also do the tails of the rows, are written without branches, for the compiler to vectorize.
+
+struct Bgr8 {
+  typedef uint8_t Channel;
+  static const int kChannels = 3;
+};
+
+struct Z16 {
+  typedef uint16_t Channel;
+  static const int kChannels = 1;
+};
+
+// Returns the row y of an image with stride bytes per row.
+template <class Format>
+inline const typename Format::Channel* image_row(const void* data, int stride, int y) {
+  return reinterpret_cast<const typename Format::Channel*>(static_cast<const uint8_t*>(data) +
+                                                           static_cast<size_t>(y) * stride);
+}
+
+// Copies n pixels of the row into out, tightly packed: the pixel x, then every step-th one.
+template <class Format>
+inline void gather_pixels(const typename Format::Channel* row, int x, int step, int n,
+                          typename Format::Channel* out) {
+  const int kChannels = Format::kChannels;
+  row += x * kChannels;
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < kChannels; c++) {
+      out[c] = row[c];
+    }
+    row += step * kChannels;
+    out += kChannels;
+  }
+}
+
+// Sum of the absolute differences of n bytes.
+inline uint64_t sad_u8(const uint8_t* a, const uint8_t* b, size_t n) {
+  uint64_t sum = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    // Four 64-bit sums of eight absolute differences each.
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(REALSENSE_NEON)
+  uint64x2_t acc = vdupq_n_u64(0);
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(d)));
+  }
+  sum = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+#endif
+  for (; i < n; i++) {
+    int d = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+    sum += d < 0 ? -d : d;
+  }
+  return sum;
+}
+
+// Number of the depth values, which differ by more than delta, or of which exactly one is 0, no data.
+// delta must not be negative.
+inline size_t count_moved_z16(const uint16_t* a, const uint16_t* b, size_t n, int delta) {
+  size_t moved = 0;
+  size_t i = 0;
+#if defined(__AVX2__) || defined(REALSENSE_NEON)
+  // No difference is larger than that.
+  uint16_t delta16 = static_cast<uint16_t>(delta > 65535 ? 65535 : delta);
+#endif
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i vdelta = _mm256_set1_epi16(static_cast<int16_t>(delta16));
+  const __m256i minus_one = _mm256_set1_epi16(-1);
+  __m256i acc = zero;
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    // There are no unsigned 16-bit comparisons: |a - b| > delta is (|a - b| - delta, saturated) != 0.
+    __m256i d = _mm256_or_si256(_mm256_subs_epu16(va, vb), _mm256_subs_epu16(vb, va));
+    __m256i still = _mm256_cmpeq_epi16(_mm256_subs_epu16(d, vdelta), zero);
+    __m256i hole = _mm256_xor_si256(_mm256_cmpeq_epi16(va, zero), _mm256_cmpeq_epi16(vb, zero));
+    // All ones in the lanes, which moved.
+    __m256i m = _mm256_or_si256(_mm256_andnot_si256(still, minus_one), hole);
+    // (-1) * (-1) + (-1) * (-1) per pair of lanes: the number of the moved ones in 32 bits.
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(m, minus_one));
+  }
+  uint32_t lanes[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  for (uint32_t lane : lanes) {
+    moved += lane;
+  }
+#elif defined(REALSENSE_NEON)
+  const uint16x8_t zero = vdupq_n_u16(0);
+  const uint16x8_t vdelta = vdupq_n_u16(delta16);
+  uint32x4_t acc = vdupq_n_u32(0);
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t va = vld1q_u16(a + i);
+    uint16x8_t vb = vld1q_u16(b + i);
+    uint16x8_t m = vcgtq_u16(vabdq_u16(va, vb), vdelta);
+    m = vorrq_u16(m, veorq_u16(vceqq_u16(va, zero), vceqq_u16(vb, zero)));
+    // One in the lanes, which moved.
+    acc = vpadalq_u16(acc, vshrq_n_u16(m, 15));
+  }
+  moved = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+  for (; i < n; i++) {
+    int d = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+    d = d < 0 ? -d : d;
+    moved += (d > delta) | ((a[i] == 0) != (b[i] == 0));
+  }
+  return moved;
+}
+
+// Maps n depth values to the indices of a 256-entry color map: 0 for no data, and 1 + (d - lo) * 254 / (hi - lo)
+// for the rest, clamped to [lo, hi]. mul is 254 / (hi - lo) in 16.16 fixed point, and (hi - lo) * mul must fit
+// into 32 bits. The compiler vectorizes it well enough for any target.
+inline void depth_to_index(const uint16_t* __restrict__ depth, size_t n, uint32_t lo, uint32_t hi, uint32_t mul,
+                           uint8_t* __restrict__ index) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t d = depth[i];
+    uint32_t v = d < lo ? lo : d;
+    v = v > hi ? hi : v;
+    uint32_t idx = 1 + (((v - lo) * mul) >> 16);
+    index[i] = d == 0 ? 0 : idx;
+  }
+}
+
+#endif  // REALSENSE_PIXEL_KERNELS_H_
@@ -0,0 +1,129 @@
+#include "point-cloud.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <librealsense2/rsutil.h>
+
+#include "pixel-kernels.h"
+
+namespace {
+
+// Number of the tables a PointCloudEncoder keeps.
+const size_t kMaxTables = 4;
+
+bool same_table(const rs2_intrinsics& a, const PointCloudGeometry& ga, const rs2_intrinsics& b,
+                const PointCloudGeometry& gb) {
+  return memcmp(&a, &b, sizeof(a)) == 0 && ga.x == gb.x && ga.y == gb.y && ga.step == gb.step &&
+         ga.width == gb.width && ga.height == gb.height;
+}
+
+// Rounds and clamps to int16. The selects compile to min/max instructions, unlike fminf and fmaxf,
+// which have to care about NaNs. There are none here: the depth and the rays are finite.
+inline int16_t to_int16(float v) {
+  v += copysignf(0.5f, v);
+  v = v < -32767.0f ? -32767.0f : v;
+  v = v > 32767.0f ? 32767.0f : v;
+  return static_cast<int16_t>(v);
+}
+
+// Deprojects a row of depth. Written without branches, to be vectorized.
+void deproject_row(const float* __restrict__ rx, const float* __restrict__ ry, const uint16_t* __restrict__ depth,
+                   int n, float to_mm, int16_t* __restrict__ x, int16_t* __restrict__ y, int16_t* __restrict__ z) {
+  for (int i = 0; i < n; i++) {
+    float zm = depth[i] * to_mm;
+    x[i] = to_int16(zm * rx[i]);
+    y[i] = to_int16(zm * ry[i]);
+    z[i] = to_int16(zm);
+  }
+}
+
+}  // namespace
+
+const PointCloudEncoder::RayTable& PointCloudEncoder::table(const rs2_intrinsics& intrinsics,
+                                                            const PointCloudGeometry& geometry) {
+  for (size_t i = 0; i < tables_.size(); i++) {
+    if (same_table(tables_[i].intrinsics, tables_[i].geometry, intrinsics, geometry)) {
+      if (i > 0) {
+        std::swap(tables_[0], tables_[i]);
+      }
+      return tables_[0];
+    }
+  }
+  if (tables_.size() == kMaxTables) {
+    tables_.pop_back();
+  }
+  tables_.insert(tables_.begin(), RayTable());
+  RayTable& t = tables_[0];
+  t.intrinsics = intrinsics;
+  t.geometry = geometry;
+  t.x.resize(geometry.width * geometry.height);
+  t.y.resize(geometry.width * geometry.height);
+  // The ray through the center of the color pixels a depth pixel stands for.
+  float center = (geometry.step - 1) * 0.5f;
+  for (int v = 0; v < geometry.height; v++) {
+    for (int u = 0; u < geometry.width; u++) {
+      float pixel[2] = {geometry.x + u * geometry.step + center, geometry.y + v * geometry.step + center};
+      float p[3];
+      rs2_deproject_pixel_to_point(p, &intrinsics, pixel, 1);
+      t.x[v * geometry.width + u] = p[0];
+      t.y[v * geometry.width + u] = p[1];
+    }
+  }
+  return t;
+}
+
+size_t PointCloudEncoder::encode(const rs2_intrinsics& color_intrinsics, const PointCloudGeometry& geometry,
+                                 const uint16_t* depth, int depth_stride, float depth_scale, const uint8_t* bgr,
+                                 int bgr_stride, double timestamp, unsigned long long frame_number,
+                                 std::vector<uint8_t>* buf) {
+  const RayTable& t = table(color_intrinsics, geometry);
+  int width = geometry.width;
+  size_t point_size = bgr ? 9 : 6;
+  size_t max_size = sizeof(PointCloudHeader) + static_cast<size_t>(width) * geometry.height * point_size;
+  if (buf->size() < max_size) {
+    buf->resize(max_size);
+  }
+  x_.resize(width);
+  y_.resize(width);
+  z_.resize(width);
+  float to_mm = depth_scale * 1000;
+  uint8_t* out = buf->data() + sizeof(PointCloudHeader);
+  uint32_t num_points = 0;
+  for (int v = 0; v < geometry.height; v++) {
+    const uint16_t* row = image_row<Z16>(depth, depth_stride, v);
+    deproject_row(&t.x[v * width], &t.y[v * width], row, width, to_mm, x_.data(), y_.data(), z_.data());
+    // The color of a point is the color pixel at the center of the ones its depth pixel stands for.
+    const uint8_t* color_row = nullptr;
+    if (bgr) {
+      color_row = bgr + (geometry.y + v * geometry.step + geometry.step / 2) * bgr_stride +
+                  (geometry.x + geometry.step / 2) * 3;
+    }
+    for (int u = 0; u < width; u++) {
+      if (row[u] == 0) {
+        continue;
+      }
+      int16_t xyz[3] = {x_[u], y_[u], z_[u]};
+      memcpy(out, xyz, sizeof(xyz));
+      if (color_row) {
+        memcpy(out + sizeof(xyz), color_row + u * geometry.step * 3, 3);
+      }
+      out += point_size;
+      num_points++;
+    }
+  }
+  PointCloudHeader h = {};
+  memcpy(h.magic, "PC16", sizeof(h.magic));
+  h.version = kPointCloudVersion;
+  h.flags = bgr ? kPointCloudColor : 0;
+  h.width = width;
+  h.height = geometry.height;
+  h.num_points = num_points;
+  h.unit = 0.001f;
+  h.timestamp = timestamp;
+  h.frame_number = frame_number;
+  memcpy(buf->data(), &h, sizeof(h));
+  return out - buf->data();
+}
@@ -0,0 +1,84 @@
+#ifndef REALSENSE_POINT_CLOUD_H_
+#define REALSENSE_POINT_CLOUD_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+// Point cloud file format (.pc16). All fields are little-endian.
+//
+//   PointCloudHeader (48 bytes)
+//   num_points points
+//
+// A point is int16 x, y, z in millimeters, in the color camera frame (x right, y down, z forward),
+// clamped to +-32.767 m, followed by uint8 b, g, r, if flags has kPointCloudColor. The points are packed
+// without padding, in the row-major order of the depth pixels they come from. Pixels without depth
+// have no points.
+enum PointCloudFlags {
+  kPointCloudColor = 1,
+};
+
+struct PointCloudHeader {
+  char magic[4];  // "PC16"
+  uint16_t version;
+  uint16_t flags;  // PointCloudFlags
+  // Resolution of the depth image the points come from.
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_points;
+  float unit;  // Meters per x, y, z unit.
+  double timestamp;  // librealsense frame timestamp, ms.
+  uint64_t frame_number;
+  uint32_t reserved[2];
+};
+
+static_assert(sizeof(PointCloudHeader) == 48, "PointCloudHeader must be 48 bytes");
+
+const uint16_t kPointCloudVersion = 1;
+
+// Where the pixels of a depth image are in the color image: the depth pixel (u, v) stands for
+// the step x step color pixels starting at (x + u * step, y + v * step). The depth is aligned to color,
+// so a full frame is x = y = 0 and step = 1, and a cropped or decimated one is a part of that grid.
+struct PointCloudGeometry {
+  int x = 0;
+  int y = 0;
+  int step = 1;
+  int width = 0;
+  int height = 0;
+};
+
+// PointCloudEncoder deprojects aligned depth images into .pc16 point clouds.
+//
+// The ray through every pixel, z = 1, is computed once per intrinsics and geometry. Then a point is just
+// its depth times the ray, which the deprojection runs over plain float arrays, row by row, so that
+// the compiler vectorizes it. Any lens distortion of the color stream is in the tables already.
+//
+// Keeps the tables and the scratch buffers between calls, so an instance should be reused for all frames
+// encoded by a thread. Not thread-safe.
+class PointCloudEncoder {
+ public:
+  // depth_stride and bgr_stride are in bytes. bgr is the whole color image, or nullptr for no color.
+  // Returns the size of the file put into the beginning of buf.
+  size_t encode(const rs2_intrinsics& color_intrinsics, const PointCloudGeometry& geometry, const uint16_t* depth,
+                int depth_stride, float depth_scale, const uint8_t* bgr, int bgr_stride, double timestamp,
+                unsigned long long frame_number, std::vector<uint8_t>* buf);
+
+ private:
+  struct RayTable {
+    rs2_intrinsics intrinsics;
+    PointCloudGeometry geometry;
+    std::vector<float> x, y;
+  };
+
+  const RayTable& table(const rs2_intrinsics& intrinsics, const PointCloudGeometry& geometry);
+
+  // The most recently used tables, the last one first. A few cameras or crops take turns
+  // without rebuilding the tables.
+  std::vector<RayTable> tables_;
+  // Deprojected points of the current row.
+  std::vector<int16_t> x_, y_, z_;
+};
+
+#endif  // REALSENSE_POINT_CLOUD_H_
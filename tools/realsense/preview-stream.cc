@@ -0,0 +1,192 @@
+#include "preview-stream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <opencv2/opencv.hpp>
+
+#include "stats.h"
+#include "unix-socket.h"
+
+namespace {
+
+// A client, which can't take a preview frame for that long, is disconnected.
+const int kSendTimeoutSec = 2;
+
+bool send_all(int fd, const void* header, size_t header_size, const void* data, size_t size) {
+  struct iovec iov[2] = {{const_cast<void*>(header), header_size}, {const_cast<void*>(data), size}};
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  while (msg.msg_iovlen > 0) {
+    // MSG_NOSIGNAL: a closed client is an error, not a SIGPIPE.
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    while (msg.msg_iovlen > 0 && static_cast<size_t>(n) >= msg.msg_iov[0].iov_len) {
+      n -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov[0].iov_base = static_cast<uint8_t*>(msg.msg_iov[0].iov_base) + n;
+      msg.msg_iov[0].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void PreviewSource::offer(const rs2::frameset& data) {
+  if (!stream_->connected_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  uint64_t now = now_us();
+  if (now < next_us_) {
+    return;
+  }
+  next_us_ = now + stream_->interval_us_;
+  PreviewStream::Item item;
+  item.source = this;
+  item.data = data;
+  item.offered_us = now;
+  // The preview thread may hold on to the frames for a while, don't let librealsense recycle them.
+  item.data.keep();
+  stream_->queue_.try_push(item);
+}
+
+std::unique_ptr<PreviewStream> PreviewStream::create(const PreviewOptions& opts, int num_cameras, std::string* err) {
+  int fd = listen_unix_socket(opts.socket_path, 1, err);
+  if (fd < 0) {
+    return nullptr;
+  }
+  return std::unique_ptr<PreviewStream>(new PreviewStream(opts, num_cameras, fd));
+}
+
+PreviewStream::PreviewStream(const PreviewOptions& opts, int num_cameras, int listen_fd)
+    : opts_(opts),
+      interval_us_(static_cast<uint64_t>(1e6 / opts.fps)),
+      listen_fd_(listen_fd),
+      queue_(num_cameras),
+      quality_(opts.quality),
+      colorizer_(0, opts.max_depth) {}
+
+PreviewStream::~PreviewStream() {
+  close(listen_fd_);
+  if (client_fd_ >= 0) {
+    close(client_fd_);
+  }
+}
+
+void PreviewStream::start() {
+  std::thread(&PreviewStream::run, this).detach();
+}
+
+void PreviewStream::run() {
+  while (1) {
+    client_fd_ = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client_fd_ < 0) {
+      perror("preview: accept");
+      sleep(1);
+      continue;
+    }
+    struct timeval timeout = {kSendTimeoutSec, 0};
+    setsockopt(client_fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    fprintf(stderr, "Preview client connected\n");
+    quality_ = opts_.quality;
+    connected_.store(true, std::memory_order_relaxed);
+    while (1) {
+      Item item = queue_.pop();
+      // Whatever waited for more than a frame period, while we were sending the previous one, is stale.
+      if (now_us() - item.offered_us > interval_us_) {
+        continue;
+      }
+      if (!send_frameset(item)) {
+        break;
+      }
+    }
+    connected_.store(false, std::memory_order_relaxed);
+    close(client_fd_);
+    client_fd_ = -1;
+    fprintf(stderr, "Preview client disconnected\n");
+  }
+}
+
+bool PreviewStream::send_frameset(const Item& item) {
+  rs2::video_frame color = item.data.get_color_frame();
+  rs2::depth_frame depth = item.data.get_depth_frame();
+  if (!color || !depth) {
+    return true;
+  }
+  int width = opts_.width;
+  int height = color.get_height() * width / color.get_width();
+  std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, quality_};
+  uint64_t start = now_us();
+
+  cv::Mat color_mat(color.get_height(), color.get_width(), CV_8UC3, const_cast<void*>(color.get_data()),
+                    color.get_stride_in_bytes());
+  cv::Mat small;
+  cv::resize(color_mat, small, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+  std::vector<uint8_t> jpeg;
+  if (!cv::imencode(".jpg", small, jpeg, params)) {
+    fprintf(stderr, "preview: failed to encode the color frame\n");
+    return true;
+  }
+  if (!send_image(*item.source, kPreviewColor, color, jpeg, width, height)) {
+    return false;
+  }
+
+  cv::Mat depth_mat(depth.get_height(), depth.get_width(), CV_16UC1, const_cast<void*>(depth.get_data()),
+                    depth.get_stride_in_bytes());
+  cv::Mat small_depth;
+  // Interpolating depth makes up distances between the objects and the background.
+  cv::resize(depth_mat, small_depth, cv::Size(width, height), 0, 0, cv::INTER_NEAREST);
+  cv::Mat colorized(height, width, CV_8UC3);
+  colorizer_.colorize(small_depth.ptr<uint16_t>(), small_depth.step, width, height, 1, item.source->depth_scale_,
+                      colorized.data, colorized.step);
+  if (!cv::imencode(".jpg", colorized, jpeg, params)) {
+    fprintf(stderr, "preview: failed to encode the depth frame\n");
+    return true;
+  }
+  if (!send_image(*item.source, kPreviewDepth, color, jpeg, width, height)) {
+    return false;
+  }
+  adapt_quality(now_us() - start);
+  return true;
+}
+
+bool PreviewStream::send_image(const PreviewSource& source, PreviewKind kind, const rs2::video_frame& frame,
+                               const std::vector<uint8_t>& jpeg, int width, int height) {
+  PreviewFrameHeader h = {};
+  memcpy(h.magic, "RSPV", sizeof(h.magic));
+  h.kind = kind;
+  h.quality = quality_;
+  h.size = jpeg.size();
+  h.width = width;
+  h.height = height;
+  h.frame_number = frame.get_frame_number();
+  h.timestamp = frame.get_timestamp();
+  strncpy(h.camera, source.camera_.c_str(), sizeof(h.camera) - 1);
+  return send_all(client_fd_, &h, sizeof(h), jpeg.data(), jpeg.size());
+}
+
+void PreviewStream::adapt_quality(uint64_t send_us) {
+  // A slow client or uplink shows up as blocking sends. Give it smaller frames, until
+  // a frameset takes no more than a quarter of the frame period, then try better ones again.
+  if (send_us > interval_us_ / 2) {
+    quality_ = std::max(opts_.min_quality, quality_ - 10);
+  } else if (send_us < interval_us_ / 4) {
+    quality_ = std::min(opts_.quality, quality_ + 5);
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef REALSENSE_PREVIEW_STREAM_H_
+#define REALSENSE_PREVIEW_STREAM_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <librealsense2/rs.hpp>
+
+#include "bounded-queue.h"
+#include "depth-colorize.h"
+
+struct PreviewOptions {
+  // Unix socket a preview client connects to.
+  std::string socket_path;
+  // Max preview frames per second of every camera.
+  double fps = 2;
+  // Width of the preview images. The height keeps the aspect ratio.
+  int width = 320;
+  // JPEG quality the preview starts with and never exceeds. It goes down to min_quality,
+  // while the client can't keep up.
+  int quality = 70;
+  int min_quality = 30;
+  // Depth mapped to the end of the color map, in meters. Farther points are clamped.
+  float max_depth = 4;
+};
+
+// Preview frame on the socket, followed by size bytes of JPEG. All fields are little-endian.
+// A color frame is followed by the depth frame of the same frameset. Both carry the frame number and
+// the timestamp of the color frame.
+struct PreviewFrameHeader {
+  char magic[4];  // "RSPV"
+  uint8_t kind;   // kPreviewColor or kPreviewDepth
+  uint8_t quality;
+  uint16_t reserved;
+  uint32_t size;
+  uint16_t width;
+  uint16_t height;
+  uint64_t frame_number;
+  double timestamp;  // librealsense frame timestamp, ms.
+  // Camera name as in --cameras, empty for the single camera mode. NUL-terminated: it has room for
+  // the longest name --cameras takes.
+  char camera[32];
+};
+
+static_assert(sizeof(PreviewFrameHeader) == 64, "PreviewFrameHeader must be 64 bytes");
+
+enum PreviewKind {
+  kPreviewColor = 0,
+  // Depth, colorized with the jet color map. No data is black.
+  kPreviewDepth = 1,
+};
+
+class PreviewStream;
+
+// PreviewSource is the camera side of the preview: the capture thread of the camera offers it every frameset.
+class PreviewSource {
+ public:
+  PreviewSource(PreviewStream* stream, const std::string& camera, float depth_scale)
+      : stream_(stream), camera_(camera), depth_scale_(depth_scale) {}
+
+  // Capture thread. Hands the frameset over to the preview thread, if a client is connected and the next
+  // preview frame is due. Never blocks: if the preview thread is still busy, the frameset is dropped.
+  void offer(const rs2::frameset& data);
+
+ private:
+  friend class PreviewStream;
+
+  PreviewStream* stream_;
+  std::string camera_;
+  float depth_scale_;
+  // Only used by the capture thread.
+  uint64_t next_us_ = 0;
+};
+
+// PreviewStream streams downscaled color and colorized depth JPEGs of all cameras to a single client of
+// a Unix socket, at a low rate. The preview thread does all the scaling and encoding, so that the capture
+// threads only pay for a queue push a few times a second, and nothing at all without a client.
+//
+// Under backpressure, the framesets are dropped, rather than queued, and the JPEG quality goes down,
+// until the frames are sent within a fraction of the frame period. It goes back up, once they are.
+class PreviewStream {
+ public:
+  // Binds the socket. Returns nullptr and sets err on failure.
+  static std::unique_ptr<PreviewStream> create(const PreviewOptions& opts, int num_cameras, std::string* err);
+  ~PreviewStream();
+
+  // Starts the preview thread.
+  void start();
+
+ private:
+  friend class PreviewSource;
+
+  struct Item {
+    PreviewSource* source = nullptr;
+    rs2::frameset data;
+    uint64_t offered_us = 0;
+  };
+
+  PreviewStream(const PreviewOptions& opts, int num_cameras, int listen_fd);
+
+  void run();
+  // Sends both images of the frameset. Returns false, if the client is gone.
+  bool send_frameset(const Item& item);
+  bool send_image(const PreviewSource& source, PreviewKind kind, const rs2::video_frame& frame,
+                  const std::vector<uint8_t>& jpeg, int width, int height);
+  void adapt_quality(uint64_t send_us);
+
+  PreviewOptions opts_;
+  uint64_t interval_us_;
+  int listen_fd_;
+  int client_fd_ = -1;
+  std::atomic<bool> connected_{false};
+  BoundedQueue<Item> queue_;
+  // Only used by the preview thread.
+  int quality_;
+  DepthColorizer colorizer_;
+};
+
+#endif  // REALSENSE_PREVIEW_STREAM_H_
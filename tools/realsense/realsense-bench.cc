@@ -0,0 +1,404 @@
+// realsense-bench measures realsense-snapshot without a camera: it replays a librealsense recording (.bag)
+// through the same capture, align, encode and write path with every set of options to compare.
+//
+//   realsense-bench --playback=scene.bag [--snapshot=PATH] [--requests=200] [--warmup_requests=10]
+//                   [--request="frames=4 pack=1"] [--out_dir=/tmp/realsense-bench] [--real_time]
+//                   [--max_allocs_per_frame=N] ["--color_encoder=turbojpeg --depth_format=z16" ...]
+//
+// Every positional argument is a variant: realsense-snapshot flags, separated by spaces. Without any,
+// a default set compares the color encoders, the depth formats and the point clouds. Every variant gets
+// its own realsense-snapshot process, which replays the recording as fast as it takes the frames
+// (unless --real_time), and the same requests, sent one after another, after the warm-up ones.
+// The files go to --out_dir, every request overwrites the previous one.
+//
+// One line per variant is printed:
+//
+//   <variant>: 41.2 frames/s, cpu 183%, peak rss 215.4 MB, allocs/frame 0.0, t_wait=0.05/0.21/0.80 ...
+//
+// The timings are p50/p90/p99 in ms of the ones on the reply lines, see stats.h. cpu is the CPU time
+// of realsense-snapshot during the measured requests, relative to a single core. allocs/frame is the number
+// of heap allocations during the measured requests per frame, as counted by heap-stats.h: in a steady state,
+// it should stay flat, ideally at the few allocations of parsing and replying to a request.
+// With --max_allocs_per_frame, the variants over the limit are marked, and the exit status is 1.
+// The stderr of every run goes to <out_dir>/<variant index>.log.
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+namespace {
+
+const char* kDefaultVariants[] = {
+    "--color_encoder=opencv --depth_format=png",
+    "--color_encoder=turbojpeg --depth_format=png",
+    "--color_encoder=opencv --depth_format=z16",
+    "--color_encoder=opencv --depth_format=z16 --depth_compression=lz4",
+    "--color_encoder=opencv --depth_format=z16 --depth_compression=zstd",
+    "--align_engine=table --depth_format=z16",
+    "--zero_copy --depth_format=z16",
+    "--depth_format=z16 --point_cloud=xyzrgb",
+};
+
+struct Flags {
+  std::string snapshot;
+  std::string playback;
+  int requests = 200;
+  int warmup_requests = 10;
+  // Options of every request, after the prefix.
+  std::string request;
+  std::string out_dir = "/tmp/realsense-bench";
+  bool real_time = false;
+  // Negative means no limit.
+  double max_allocs_per_frame = -1;
+  std::vector<std::string> variants;
+};
+
+Flags flags;
+
+void fail(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  _exit(1);
+}
+
+bool match_flag(const std::string& arg, const char* name, std::string* value) {
+  std::string prefix = std::string("--") + name;
+  if (arg == prefix) {
+    *value = "";
+    return true;
+  }
+  if (arg.compare(0, prefix.size() + 1, prefix + "=") == 0) {
+    *value = arg.substr(prefix.size() + 1);
+    return true;
+  }
+  return false;
+}
+
+int parse_int(const std::string& name, const std::string& value, int min) {
+  char* end = nullptr;
+  long res = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || res < min) {
+    fprintf(stderr, "--%s: want an integer of at least %d, got %s\n", name.c_str(), min, value.c_str());
+    fail("Failed to parse flags");
+  }
+  return static_cast<int>(res);
+}
+
+// realsense-snapshot next to this binary, as built by the same CMakeLists.txt.
+std::string default_snapshot() {
+  char buf[4096];
+  ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+  if (n <= 0) {
+    return "realsense-snapshot";
+  }
+  std::string self(buf, n);
+  return self.substr(0, self.rfind('/') + 1) + "realsense-snapshot";
+}
+
+void parse_flags(int argc, char** argv) {
+  flags.snapshot = default_snapshot();
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value;
+    if (arg.compare(0, 2, "--") != 0 || arg.find(' ') != std::string::npos) {
+      flags.variants.push_back(arg);
+      continue;
+    }
+    if (match_flag(arg, "snapshot", &value)) {
+      flags.snapshot = value;
+    } else if (match_flag(arg, "playback", &value)) {
+      flags.playback = value;
+    } else if (match_flag(arg, "requests", &value)) {
+      flags.requests = parse_int("requests", value, 1);
+    } else if (match_flag(arg, "warmup_requests", &value)) {
+      flags.warmup_requests = parse_int("warmup_requests", value, 0);
+    } else if (match_flag(arg, "request", &value)) {
+      flags.request = value;
+    } else if (match_flag(arg, "out_dir", &value)) {
+      flags.out_dir = value;
+    } else if (match_flag(arg, "real_time", &value)) {
+      flags.real_time = value.empty() || value == "true" || value == "1";
+    } else if (match_flag(arg, "max_allocs_per_frame", &value)) {
+      char* end = nullptr;
+      flags.max_allocs_per_frame = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.max_allocs_per_frame < 0) {
+        fail("--max_allocs_per_frame must be a non-negative number");
+      }
+    } else {
+      // A variant of a single flag.
+      flags.variants.push_back(arg);
+    }
+  }
+  if (flags.playback.empty()) {
+    fail("--playback is required");
+  }
+  if (flags.variants.empty()) {
+    flags.variants.assign(std::begin(kDefaultVariants), std::end(kDefaultVariants));
+  }
+}
+
+// A running realsense-snapshot, talking through pipes.
+struct Child {
+  pid_t pid = -1;
+  FILE* in = nullptr;
+  FILE* out = nullptr;
+};
+
+bool spawn(const std::string& variant, const std::string& log, Child* child) {
+  std::vector<std::string> args = {flags.snapshot, "--playback=" + flags.playback};
+  if (!flags.real_time) {
+    args.push_back("--playback_real_time=false");
+  }
+  std::istringstream split(variant);
+  std::string arg;
+  while (split >> arg) {
+    args.push_back(arg);
+  }
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) {
+    perror("pipe2");
+    return false;
+  }
+  int log_fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (log_fd < 0) {
+    perror(log.c_str());
+    return false;
+  }
+  child->pid = fork();
+  if (child->pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (child->pid == 0) {
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    dup2(log_fd, 2);
+    std::vector<char*> argv;
+    for (std::string& a : args) {
+      argv.push_back(&a[0]);
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(log_fd);
+  child->in = fdopen(in[1], "w");
+  child->out = fdopen(out[0], "r");
+  return true;
+}
+
+// Stops the child and waits for it to exit.
+void finish(Child* child) {
+  // realsense-snapshot exits once its stdin is closed.
+  fclose(child->in);
+  fclose(child->out);
+  int status = 0;
+  while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {
+  }
+}
+
+bool read_line(Child* child, std::string* line) {
+  char buf[4096];
+  if (!fgets(buf, sizeof(buf), child->out)) {
+    return false;
+  }
+  *line = buf;
+  if (!line->empty() && line->back() == '\n') {
+    line->pop_back();
+  }
+  return true;
+}
+
+// A request and its reply.
+struct Result {
+  bool ok = false;
+  std::string error;
+  int frames = 0;
+  // Stage timings of the OK line, in ms, -1 for the ones not on it.
+  double ms[kNumStages];
+};
+
+Result run_request(Child* child, const std::string& prefix) {
+  Result res;
+  std::fill(res.ms, res.ms + kNumStages, -1.0);
+  fprintf(child->in, "%s %s\n", prefix.c_str(), flags.request.c_str());
+  fflush(child->in);
+  std::string line;
+  while (read_line(child, &line)) {
+    if (line.compare(0, 6, "FRAME ") == 0) {
+      res.frames++;
+      continue;
+    }
+    if (line.compare(0, 2, "OK") != 0) {
+      res.error = line;
+      return res;
+    }
+    res.ok = true;
+    res.frames = std::max(res.frames, 1);
+    std::istringstream fields(line);
+    std::string field;
+    while (fields >> field) {
+      size_t eq = field.find('=');
+      for (int i = 0; i < kNumStages && eq != std::string::npos; i++) {
+        if (field.compare(0, eq, stage_name(static_cast<Stage>(i))) == 0) {
+          res.ms[i] = atof(field.c_str() + eq + 1);
+        }
+      }
+    }
+    return res;
+  }
+  res.error = "realsense-snapshot exited";
+  return res;
+}
+
+// Heap allocations of realsense-snapshot so far, from the !stats reply. Returns false, if it has none.
+bool heap_allocations(Child* child, unsigned long long* allocs) {
+  fprintf(child->in, "!stats\n");
+  fflush(child->in);
+  std::string line;
+  if (!read_line(child, &line)) {
+    return false;
+  }
+  size_t pos = line.find(" allocs=");
+  if (line.compare(0, 2, "OK") != 0 || pos == std::string::npos) {
+    return false;
+  }
+  *allocs = strtoull(line.c_str() + pos + strlen(" allocs="), nullptr, 10);
+  return true;
+}
+
+// CPU time of the process so far, in seconds.
+double cpu_seconds(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  std::getline(in, stat);
+  // The command name may have spaces, the fields after it don't.
+  size_t paren = stat.rfind(')');
+  if (paren == std::string::npos) {
+    return 0;
+  }
+  std::istringstream fields(stat.substr(paren + 2));
+  std::string field;
+  unsigned long long utime = 0, stime = 0;
+  // utime and stime are the fields 14 and 15, the state is the field 3.
+  for (int i = 3; i <= 15 && fields >> field; i++) {
+    if (i == 14) {
+      utime = strtoull(field.c_str(), nullptr, 10);
+    } else if (i == 15) {
+      stime = strtoull(field.c_str(), nullptr, 10);
+    }
+  }
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Peak resident set size of the process, in kB.
+long peak_rss_kb(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return atol(line.c_str() + 6);
+    }
+  }
+  return 0;
+}
+
+double percentile(const std::vector<double>& sorted, int p) {
+  return sorted[(sorted.size() - 1) * p / 100];
+}
+
+// Runs the warm-up and the measured requests with a variant, and prints its line.
+// Returns false, if the variant failed or is over --max_allocs_per_frame.
+bool bench(size_t index, const std::string& variant) {
+  std::string log = flags.out_dir + "/" + std::to_string(index) + ".log";
+  Child child;
+  if (!spawn(variant, log, &child)) {
+    fail("Failed to start realsense-snapshot");
+  }
+  std::string prefix = flags.out_dir + "/" + std::to_string(index) + "-";
+  for (int i = 0; i < flags.warmup_requests; i++) {
+    Result res = run_request(&child, prefix);
+    if (!res.ok) {
+      finish(&child);
+      printf("%s: failed: %s, see %s\n", variant.c_str(), res.error.c_str(), log.c_str());
+      return false;
+    }
+  }
+  std::vector<double> ms[kNumStages];
+  int frames = 0;
+  unsigned long long allocs_start = 0, allocs_end = 0;
+  bool have_allocs = heap_allocations(&child, &allocs_start);
+  double cpu_start = cpu_seconds(child.pid);
+  uint64_t start = now_us();
+  for (int i = 0; i < flags.requests; i++) {
+    Result res = run_request(&child, prefix);
+    if (!res.ok) {
+      finish(&child);
+      printf("%s: failed: %s, see %s\n", variant.c_str(), res.error.c_str(), log.c_str());
+      return false;
+    }
+    frames += res.frames;
+    for (int s = 0; s < kNumStages; s++) {
+      if (res.ms[s] >= 0) {
+        ms[s].push_back(res.ms[s]);
+      }
+    }
+  }
+  double wall = (now_us() - start) / 1e6;
+  double cpu = cpu_seconds(child.pid) - cpu_start;
+  long rss_kb = peak_rss_kb(child.pid);
+  have_allocs = have_allocs && heap_allocations(&child, &allocs_end);
+  finish(&child);
+
+  printf("%s: %.1f frames/s, cpu %.0f%%, peak rss %.1f MB,", variant.c_str(), frames / wall, cpu / wall * 100,
+         rss_kb / 1024.0);
+  bool ok = true;
+  if (have_allocs) {
+    double per_frame = static_cast<double>(allocs_end - allocs_start) / frames;
+    printf(" allocs/frame %.1f,", per_frame);
+    ok = flags.max_allocs_per_frame < 0 || per_frame <= flags.max_allocs_per_frame;
+  }
+  for (int s = 0; s < kNumStages; s++) {
+    if (ms[s].empty()) {
+      continue;
+    }
+    std::sort(ms[s].begin(), ms[s].end());
+    printf(" %s=%.2f/%.2f/%.2f", stage_name(static_cast<Stage>(s)), percentile(ms[s], 50), percentile(ms[s], 90),
+           percentile(ms[s], 99));
+  }
+  printf("%s\n", ok ? "" : " OVER ALLOCATION LIMIT");
+  fflush(stdout);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  parse_flags(argc, argv);
+  // A dead realsense-snapshot is reported as a failed variant, not a SIGPIPE.
+  signal(SIGPIPE, SIG_IGN);
+  if (mkdir(flags.out_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    perror(flags.out_dir.c_str());
+    fail("Failed to create --out_dir");
+  }
+  bool ok = true;
+  for (size_t i = 0; i < flags.variants.size(); i++) {
+    ok = bench(i, flags.variants[i]) && ok;
+  }
+  return ok ? 0 : 1;
+}
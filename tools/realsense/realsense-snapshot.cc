@@ -1,20 +1,219 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <librealsense2/rs.hpp>
 #include <opencv2/opencv.hpp>
 
-const int kSkipFirstFrames = 60;
+#include "bounded-queue.h"
+#include "burst-capture.h"
+#include "change-detect.h"
+#include "depth-align.h"
+#include "depth-colorize.h"
+#include "depth-filter.h"
+#include "depth-raw.h"
+#include "file-io.h"
+#include "frame-ring.h"
+#include "heap-stats.h"
+#include "jpeg-encoder.h"
+#include "metrics.h"
+#include "pack-file.h"
+#include "point-cloud.h"
+#include "preview-stream.h"
+#include "shm-ring.h"
+#include "stats.h"
+#include "unix-socket.h"
+#include "upload-stream.h"
+
+// Warm-up: the auto-exposure needs a few frames to converge after the camera starts.
+// We wait until the exposure, the image brightness and the depth fill rate stop changing
+// for kStableFrames frames in a row, but don't serve anything before kMinWarmupFrames.
+const int kMinWarmupFrames = 5;
+const int kStableFrames = 3;
+
+// Number of preallocated frames in the capture ring. One slot is always the latest frame,
+// one is being written by the capture thread, the rest can be held by the requests.
+const int kRingSlots = 4;
+
+// Resolution and frame rate of a stream, as in --color_profile=1280x720@30.
+struct StreamProfile {
+  int width;
+  int height;
+  int fps;
+};
+
+struct Flags {
+  // If true, every request waits for a frame captured after the request has arrived.
+  // Otherwise, the newest frame not yet handed to a previous request is used right away.
+  bool fresh_frames = false;
+
+  // If true, capture and alignment run as separate stages connected by a bounded queue,
+  // and a single-frame request is acknowledged as soon as its frame is handed to the encoder.
+  // Use the !sync command to wait until all acknowledged frames are written to disk.
+  bool pipelined = false;
+
+  // Max number of frames waiting to be encoded.
+  int encode_queue = 8;
+
+  // If true, the encoders hand the encoded files over to a writer thread, which writes them in batches.
+  // A stalling disk then only backs up the write queue: a frame goes back to the ring once it's encoded.
+  bool write_thread = false;
+  // Max number of encoded files waiting for the writer thread.
+  int write_queue = 16;
+  // What is on disk by the time a frame or a request is reported done: none, pack or frame.
+  // See file-io.h. Packs have always been fsynced, hence the default.
+  Durability durability = kDurabilityPack;
+
+  // If true, the ring holds references to the librealsense frames instead of copying the pixels,
+  // and the encoders read straight from the librealsense buffers.
+  bool zero_copy = false;
+
+  // Number of encoder threads. Color and depth of the same frame are encoded in parallel,
+  // and so are the frames of a batch. 0 means one thread per core, but no more than 4.
+  int encode_threads = 0;
+
+  // JPEG encoder backend for the color stream: opencv, turbojpeg or v4l2. See jpeg-encoder.h.
+  std::string color_encoder = "opencv";
+  int jpeg_quality = 90;
+  // The V4L2 memory-to-memory device used by --color_encoder=v4l2.
+  std::string v4l2_device = "/dev/video31";
+
+  // Depth output format: png (16-bit grayscale PNG, <prefix>depth.png) or z16 (raw depth with
+  // a small header, <prefix>depth.z16, see depth-raw.h).
+  std::string depth_format = "png";
+  // Compression of the z16 payload: none, lz4 or zstd.
+  Z16Compression depth_compression = kZ16None;
+
+  // Max number of frames to skip at startup, while waiting for the auto-exposure to settle.
+  // This used to be a fixed 60 frame skip.
+  int warmup_max_frames = 60;
+  // Depth to color alignment: rs2 (rs2::align) or table (precomputed reprojection tables, see depth-align.h).
+  std::string align_engine = "rs2";
+  // If true, the capture thread publishes the framesets as they come from the camera,
+  // and only the frames taken by the requests are aligned.
+  bool lazy_align = false;
+
+  // Cameras to capture from: a comma-separated list of name=serial or just serial (then the serial is
+  // the name), or "all" for every connected device, named by their serials. Empty means the first
+  // device found, and no camera names in the file names.
+  std::string cameras;
+  // Stream profiles. Depth is aligned to color, so the depth images have the color resolution.
+  StreamProfile color = {640, 480, 30};
+  StreamProfile depth = {640, 480, 30};
+  // If not empty, the frames come from this librealsense recording (.bag), replayed in a loop, instead of
+  // a camera. The stream profiles are the recorded ones; the color stream must be BGR8. Single camera only.
+  std::string playback;
+  // If false, the recording is replayed as fast as the capture thread takes the frames, not at the recorded rate.
+  bool playback_real_time = true;
+  // If true, the first camera in --cameras triggers the others through the sync cable.
+  bool inter_cam_sync = false;
+  // Max frames in a burst request. Every frame of a burst has its own preallocated buffers.
+  int max_burst_frames = 30;
+
+  // librealsense post-processing filters applied to the raw depth of every frame, before the alignment.
+  DepthFilterOptions depth_filters;
+  // If greater than 1, the aligned depth is downscaled by this factor in both directions before encoding.
+  int decimation = 1;
+
+  // If not empty, the name of the shared-memory ring for the shm=1 requests, see shm-ring.h.
+  std::string shm;
+  // Number of frames in the shared-memory ring. A shm=1 request must fit into it.
+  int shm_slots = 8;
+
+  // Point cloud output, <prefix>points.pc16 (see point-cloud.h): none, xyz or xyzrgb.
+  // Not published with the shm=1 requests.
+  std::string point_cloud = "none";
+
+  // Colorized depth of the depth_preview=1 requests, <prefix>depth-preview.jpg, see depth-colorize.h.
+  DepthPreviewOptions depth_preview;
+
+  // An interactive request (priority=1), which comes while bulk frames wait for the encoders, is downscaled
+  // by this factor, unless it asks for more. 1 keeps the resolution, but it still overtakes the bulk frames.
+  int busy_scale = 2;
+
+  // Thresholds of the if_changed=1 requests, see change-detect.h.
+  ChangeOptions change;
+
+  // Live preview of all cameras for a client of --preview_socket, see preview-stream.h. Off, if the socket is empty.
+  PreviewOptions preview;
+
+  // Upload stream of the pack=1 requests for a client of --upload_socket, see upload-stream.h. Off, if the socket
+  // is empty. The packs are written to disk all the same.
+  UploadOptions upload;
+
+  // If not empty, realsense-snapshot runs as a daemon: it serves any number of clients of this Unix socket,
+  // each one the same way as stdin, which is not read then. The cameras stay warm while the clients come and go.
+  std::string listen;
+
+  // If not empty, the metrics (see !metrics) are written to this file in the Prometheus text format every
+  // kMetricsIntervalMs, e.g. for the textfile collector of node_exporter. It's replaced atomically.
+  std::string metrics_file;
+
+  // Max relative frame-to-frame change of the exposure and the brightness in a stable image.
+  // The depth fill rate is compared with the same absolute tolerance.
+  double warmup_tolerance = 0.02;
+};
+
+Flags flags;
+
+// Max number of frames in a single batch request. File names carry a two-digit frame index.
+const int kMaxBatchFrames = 100;
 
 void fail(const char* msg) {
   fprintf(stderr, "%s\n", msg);
   _exit(1);
 }
 
+// Client is where the requests come from and the replies go to: stdin and stdout, or a connection to --listen.
+struct Client {
+  Client(int in_fd, int out_fd) : in_fd(in_fd), out_fd(out_fd) {}
+  // Closes a --listen connection. stdin and stdout stay open.
+  ~Client() {
+    if (in_fd == out_fd) {
+      close(in_fd);
+    }
+  }
+
+  int in_fd;
+  int out_fd;
+  // Keeps the reply lines whole.
+  std::mutex mu;
+};
+
+// Writes a single reply line to the client. Safe to call from any thread.
+void reply(Client* client, const char* format, ...) {
+  // Way longer than any reply. Formatted on the stack, so that replying does not allocate.
+  char buf[4096];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf) - 1, format, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  }
+  n = std::min(n, static_cast<int>(sizeof(buf)) - 2);
+  buf[n] = '\n';
+  std::lock_guard<std::mutex> lock(client->mu);
+  // A client, which is gone, is noticed by its reader.
+  write_all(client->out_fd, buf, n + 1);
+}
+
 float get_depth_scale(const rs2::device &dev) {
   for (rs2::sensor& sensor : dev.query_sensors()) {
     // Check if the sensor if a depth sensor
@@ -54,92 +253,2601 @@ rs2_stream find_stream_to_align(const std::vector<rs2::stream_profile>& streams)
   return align_to;
 }
 
-const int kColorWidth = 640;
-const int kColorHeight = 480;
-const int kDepthWidth = 640;
-const int kDepthHeight = 480;
+// Returns true if arg is --name or --name=value, and sets value accordingly.
+bool match_flag(const std::string& arg, const char* name, std::string* value) {
+  std::string prefix = std::string("--") + name;
+  if (arg == prefix) {
+    *value = "";
+    return true;
+  }
+  if (arg.compare(0, prefix.size() + 1, prefix + "=") == 0) {
+    *value = arg.substr(prefix.size() + 1);
+    return true;
+  }
+  return false;
+}
 
-int main(void) {
-  rs2::config cfg;
-  cfg.enable_stream(rs2_stream::RS2_STREAM_COLOR, 0, kColorWidth, kColorHeight, rs2_format::RS2_FORMAT_BGR8, 30);
-  cfg.enable_stream(rs2_stream::RS2_STREAM_DEPTH, 0, kDepthWidth, kDepthHeight, rs2_format::RS2_FORMAT_Z16, 30);
+bool parse_bool(const std::string& name, const std::string& value) {
+  if (value == "" || value == "true" || value == "1") {
+    return true;
+  }
+  if (value == "false" || value == "0") {
+    return false;
+  }
+  fprintf(stderr, "--%s: invalid boolean value %s\n", name.c_str(), value.c_str());
+  fail("Failed to parse flags");
+  return false;
+}
 
-  rs2::pipeline pipe;
-  rs2::pipeline_profile profile = pipe.start(cfg);
+int parse_int(const std::string& name, const std::string& value) {
+  char* end = nullptr;
+  long res = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0') {
+    fprintf(stderr, "--%s: invalid integer value %s\n", name.c_str(), value.c_str());
+    fail("Failed to parse flags");
+  }
+  return static_cast<int>(res);
+}
 
-  //rs::device * dev = ctx.get_device(0);
-  //fprintf(stderr, "RealSense device opened: %s, SN %s, firmware version %s\n",
-  //        dev->get_name(), dev->get_serial(), dev->get_firmware_version());
-  float depth_scale = get_depth_scale(profile.get_device());
-  fprintf(stderr, "Depth scale: %f\n", depth_scale);
+// Parses WIDTHxHEIGHT@FPS.
+StreamProfile parse_profile(const std::string& name, const std::string& value) {
+  StreamProfile res;
+  char tail;
+  if (sscanf(value.c_str(), "%dx%d@%d%c", &res.width, &res.height, &res.fps, &tail) != 3 || res.width <= 0 ||
+      res.height <= 0 || res.fps <= 0) {
+    fprintf(stderr, "--%s: invalid stream profile %s, want WIDTHxHEIGHT@FPS\n", name.c_str(), value.c_str());
+    fail("Failed to parse flags");
+  }
+  return res;
+}
+
+void parse_flags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value;
+    if (match_flag(arg, "fresh_frames", &value)) {
+      flags.fresh_frames = parse_bool("fresh_frames", value);
+      continue;
+    }
+    if (match_flag(arg, "pipelined", &value)) {
+      flags.pipelined = parse_bool("pipelined", value);
+      continue;
+    }
+    if (match_flag(arg, "encode_queue", &value)) {
+      flags.encode_queue = parse_int("encode_queue", value);
+      if (flags.encode_queue < 1) {
+        fail("--encode_queue must be positive");
+      }
+      continue;
+    }
+    if (match_flag(arg, "write_thread", &value)) {
+      flags.write_thread = parse_bool("write_thread", value);
+      continue;
+    }
+    if (match_flag(arg, "write_queue", &value)) {
+      flags.write_queue = parse_int("write_queue", value);
+      if (flags.write_queue < 1) {
+        fail("--write_queue must be positive");
+      }
+      continue;
+    }
+    if (match_flag(arg, "durability", &value)) {
+      std::string err;
+      if (!parse_durability(value, &flags.durability, &err)) {
+        fprintf(stderr, "--durability: %s\n", err.c_str());
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "zero_copy", &value)) {
+      flags.zero_copy = parse_bool("zero_copy", value);
+      continue;
+    }
+    if (match_flag(arg, "encode_threads", &value)) {
+      flags.encode_threads = parse_int("encode_threads", value);
+      if (flags.encode_threads < 0) {
+        fail("--encode_threads must not be negative");
+      }
+      continue;
+    }
+    if (match_flag(arg, "color_encoder", &value)) {
+      flags.color_encoder = value;
+      continue;
+    }
+    if (match_flag(arg, "jpeg_quality", &value)) {
+      flags.jpeg_quality = parse_int("jpeg_quality", value);
+      if (flags.jpeg_quality < 1 || flags.jpeg_quality > 100) {
+        fail("--jpeg_quality must be in [1, 100]");
+      }
+      continue;
+    }
+    if (match_flag(arg, "v4l2_device", &value)) {
+      flags.v4l2_device = value;
+      continue;
+    }
+    if (match_flag(arg, "depth_format", &value)) {
+      if (value != "png" && value != "z16") {
+        fail("--depth_format must be png or z16");
+      }
+      flags.depth_format = value;
+      continue;
+    }
+    if (match_flag(arg, "depth_compression", &value)) {
+      std::string err;
+      if (!parse_z16_compression(value, &flags.depth_compression, &err)) {
+        fprintf(stderr, "--depth_compression: %s\n", err.c_str());
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "align_engine", &value)) {
+      if (value != "rs2" && value != "table") {
+        fail("--align_engine must be rs2 or table");
+      }
+      flags.align_engine = value;
+      continue;
+    }
+    if (match_flag(arg, "lazy_align", &value)) {
+      flags.lazy_align = parse_bool("lazy_align", value);
+      continue;
+    }
+    if (match_flag(arg, "cameras", &value)) {
+      flags.cameras = value;
+      continue;
+    }
+    if (match_flag(arg, "color_profile", &value)) {
+      flags.color = parse_profile("color_profile", value);
+      continue;
+    }
+    if (match_flag(arg, "depth_profile", &value)) {
+      flags.depth = parse_profile("depth_profile", value);
+      continue;
+    }
+    if (match_flag(arg, "inter_cam_sync", &value)) {
+      flags.inter_cam_sync = parse_bool("inter_cam_sync", value);
+      continue;
+    }
+    if (match_flag(arg, "max_burst_frames", &value)) {
+      flags.max_burst_frames = parse_int("max_burst_frames", value);
+      if (flags.max_burst_frames < 1 || flags.max_burst_frames > kMaxBatchFrames) {
+        fail("--max_burst_frames is out of range");
+      }
+      continue;
+    }
+    if (match_flag(arg, "depth_filters", &value)) {
+      std::string err;
+      if (!parse_depth_filters(value, &flags.depth_filters, &err)) {
+        fprintf(stderr, "--depth_filters: %s\n", err.c_str());
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "decimation", &value)) {
+      flags.decimation = parse_int("decimation", value);
+      if (flags.decimation < 1 || flags.decimation > kMaxDecimation) {
+        fprintf(stderr, "--decimation must be in [1, %d]\n", kMaxDecimation);
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "shm", &value)) {
+      flags.shm = value;
+      continue;
+    }
+    if (match_flag(arg, "shm_slots", &value)) {
+      flags.shm_slots = parse_int("shm_slots", value);
+      if (flags.shm_slots < 1) {
+        fail("--shm_slots must be positive");
+      }
+      continue;
+    }
+    if (match_flag(arg, "point_cloud", &value)) {
+      if (value != "none" && value != "xyz" && value != "xyzrgb") {
+        fail("--point_cloud must be none, xyz or xyzrgb");
+      }
+      flags.point_cloud = value;
+      continue;
+    }
+    if (match_flag(arg, "depth_preview_range", &value)) {
+      DepthPreviewOptions& p = flags.depth_preview;
+      char tail;
+      if (sscanf(value.c_str(), "%f,%f%c", &p.min_depth, &p.max_depth, &tail) != 2 || p.min_depth < 0 ||
+          p.max_depth <= p.min_depth) {
+        fail("--depth_preview_range must be MIN,MAX in meters, with MIN < MAX");
+      }
+      continue;
+    }
+    if (match_flag(arg, "depth_preview_width", &value)) {
+      flags.depth_preview.width = parse_int("depth_preview_width", value);
+      if (flags.depth_preview.width < 16) {
+        fail("--depth_preview_width must be at least 16");
+      }
+      continue;
+    }
+    if (match_flag(arg, "depth_preview_quality", &value)) {
+      flags.depth_preview.quality = parse_int("depth_preview_quality", value);
+      if (flags.depth_preview.quality < 1 || flags.depth_preview.quality > 100) {
+        fail("--depth_preview_quality must be in [1, 100]");
+      }
+      continue;
+    }
+    if (match_flag(arg, "preview_socket", &value)) {
+      flags.preview.socket_path = value;
+      continue;
+    }
+    if (match_flag(arg, "upload_socket", &value)) {
+      flags.upload.socket_path = value;
+      continue;
+    }
+    if (match_flag(arg, "upload_compression", &value)) {
+      std::string err;
+      if (!parse_z16_compression(value, &flags.upload.compression, &err)) {
+        fprintf(stderr, "--upload_compression: %s\n", err.c_str());
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "upload_chunks", &value)) {
+      flags.upload.chunks = parse_int("upload_chunks", value);
+      if (flags.upload.chunks < 2) {
+        fail("--upload_chunks must be at least 2");
+      }
+      continue;
+    }
+    if (match_flag(arg, "metrics_file", &value)) {
+      flags.metrics_file = value;
+      continue;
+    }
+    if (match_flag(arg, "listen", &value)) {
+      flags.listen = value;
+      continue;
+    }
+    if (match_flag(arg, "preview_fps", &value)) {
+      char* end = nullptr;
+      flags.preview.fps = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.preview.fps <= 0 || flags.preview.fps > 30) {
+        fail("--preview_fps must be in (0, 30]");
+      }
+      continue;
+    }
+    if (match_flag(arg, "preview_width", &value)) {
+      flags.preview.width = parse_int("preview_width", value);
+      if (flags.preview.width < 16) {
+        fail("--preview_width must be at least 16");
+      }
+      continue;
+    }
+    if (match_flag(arg, "preview_quality", &value)) {
+      flags.preview.quality = parse_int("preview_quality", value);
+      if (flags.preview.quality < flags.preview.min_quality || flags.preview.quality > 100) {
+        fprintf(stderr, "--preview_quality must be in [%d, 100]\n", flags.preview.min_quality);
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "warmup_max_frames", &value)) {
+      flags.warmup_max_frames = parse_int("warmup_max_frames", value);
+      if (flags.warmup_max_frames < kMinWarmupFrames) {
+        fprintf(stderr, "--warmup_max_frames must be at least %d\n", kMinWarmupFrames);
+        fail("Failed to parse flags");
+      }
+      continue;
+    }
+    if (match_flag(arg, "warmup_tolerance", &value)) {
+      char* end = nullptr;
+      flags.warmup_tolerance = strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.warmup_tolerance < 0) {
+        fail("--warmup_tolerance must be a non-negative number");
+      }
+      continue;
+    }
+    if (match_flag(arg, "busy_scale", &value)) {
+      flags.busy_scale = parse_int("busy_scale", value);
+      if (flags.busy_scale < 1 || flags.busy_scale > kMaxDecimation) {
+        fail("--busy_scale is out of range");
+      }
+      continue;
+    }
+    if (match_flag(arg, "change_step", &value)) {
+      flags.change.step = parse_int("change_step", value);
+      if (flags.change.step < 1) {
+        fail("--change_step must be positive");
+      }
+      continue;
+    }
+    if (match_flag(arg, "change_color_threshold", &value)) {
+      char* end = nullptr;
+      flags.change.color_threshold = strtof(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.change.color_threshold < 0) {
+        fail("--change_color_threshold must be a non-negative number");
+      }
+      continue;
+    }
+    if (match_flag(arg, "change_depth_delta_mm", &value)) {
+      char* end = nullptr;
+      flags.change.depth_delta_mm = strtof(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.change.depth_delta_mm < 0) {
+        fail("--change_depth_delta_mm must be a non-negative number");
+      }
+      continue;
+    }
+    if (match_flag(arg, "change_depth_threshold", &value)) {
+      char* end = nullptr;
+      flags.change.depth_threshold = strtof(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || flags.change.depth_threshold < 0 || flags.change.depth_threshold > 1) {
+        fail("--change_depth_threshold must be in [0, 1]");
+      }
+      continue;
+    }
+    if (match_flag(arg, "playback", &value)) {
+      flags.playback = value;
+      continue;
+    }
+    if (match_flag(arg, "playback_real_time", &value)) {
+      flags.playback_real_time = parse_bool("playback_real_time", value);
+      continue;
+    }
+    fprintf(stderr, "Unknown flag: %s\n", argv[i]);
+    fail("Failed to parse flags");
+  }
+  if (!flags.playback.empty() && !flags.cameras.empty()) {
+    fail("--playback and --cameras are mutually exclusive");
+  }
+}
 
-  rs2_stream align_to = find_stream_to_align(profile.get_streams());
-  rs2::align align(align_to);
+// A frameset with the time spent waiting for it in wait_for_frames.
+// Counters of the whole process, see MetricsCollector.
+ProcessMetrics process_metrics;
+
+struct CapturedFrames {
+  rs2::frameset data;
+  uint64_t capture_us = 0;
+};
+
+// Counts the frameset in the metrics of the camera.
+void count_frameset(const rs2::frameset& data, uint64_t host_us, CameraMetrics* metrics) {
+  rs2::video_frame color = data.get_color_frame();
+  rs2::depth_frame depth = data.get_depth_frame();
+  if (!color) {
+    return;
+  }
+  int64_t exposure = -1;
+  if (color.supports_frame_metadata(RS2_FRAME_METADATA_ACTUAL_EXPOSURE)) {
+    exposure = color.get_frame_metadata(RS2_FRAME_METADATA_ACTUAL_EXPOSURE);
+  }
+  size_t size = color.get_data_size() + (depth ? depth.get_data_size() : 0);
+  metrics->frameset_received(color.get_frame_number(), color.get_timestamp(), host_us, size, exposure);
+}
 
-  size_t color_buf_size = kColorHeight * kColorWidth * 3;
-  size_t depth_buf_size = kDepthHeight * kDepthWidth * 2;
+CapturedFrames capture(rs2::pipeline* pipe, CameraMetrics* metrics) {
+  CapturedFrames res;
+  uint64_t start = now_us();
+  uint64_t cpu_start = thread_cpu_us();
+  res.data = pipe->wait_for_frames();
+  res.capture_us = now_us() - start;
+  process_metrics.add_cpu(kStageCapture, thread_cpu_us() - cpu_start);
+  count_frameset(res.data, now_us(), metrics);
+  return res;
+}
 
-  std::vector<uint8_t> color_buf(color_buf_size);
-  std::vector<uint8_t> depth_buf(depth_buf_size);
+// Stores a frame in the slot: either keeps a reference to it (--zero_copy), or copies the pixels into buf.
+void store_frame(rs2::video_frame frame, std::vector<uint8_t>* buf, rs2::frame* ref, const uint8_t** data,
+                 int* stride) {
+  if (flags.zero_copy) {
+    // Nothing modifies the pixels before they are encoded, so we can just keep the frames around.
+    // keep() tells librealsense not to recycle them, while we hold the references.
+    frame.keep();
+    *ref = frame;
+    *data = static_cast<const uint8_t*>(frame.get_data());
+    *stride = frame.get_stride_in_bytes();
+    return;
+  }
+  // Copy frames to the slot, so that the librealsense frame pool could reuse the memory.
+  memcpy(buf->data(), frame.get_data(), buf->size());
+  *ref = rs2::frame();
+  *data = buf->data();
+  *stride = frame.get_width() * frame.get_bytes_per_pixel();
+}
 
-  // Skip first few frames to make sure we have a stable image.
-  for (int i = 0; i < kSkipFirstFrames; i++) {
-    pipe.wait_for_frames();
+void check_resolution(const char* name, int want_width, int want_height, int width, int height) {
+  if (want_width != width || want_height != height) {
+    fprintf(stderr, "Expected %s resolution %dx%d, got %dx%d\n", name, want_width, want_height, width, height);
+    fail("Unexpected image resolution");
   }
+}
 
-  std::string out_prefix;
-  while (1) {
-    if (out_prefix == "") {
-      if (!std::getline(std::cin, out_prefix)) {
-        fail("Failed to read from stdin");
+// AlignEngine aligns depth to color with rs2::align or, with --align_engine=table, with the reprojection
+// tables precomputed by DepthAligner. Not thread-safe: every thread, which aligns frames, has its own one.
+class AlignEngine {
+ public:
+  // tables may be null, in which case rs2::align is used.
+  AlignEngine(rs2_stream align_to, const DepthAligner* tables)
+      : align_(align_to), align_to_(align_to), tables_(tables ? tables->clone() : nullptr) {}
+
+  // Aligns the frameset and stores the result in the slot.
+  // Returns false, if either color or depth is missing in the frameset.
+  bool align(const rs2::frameset& data, FrameSlot* slot) {
+    uint64_t start = now_us();
+    rs2::video_frame color = data.get_color_frame();
+    rs2::frameset processed;
+    if (tables_) {
+      rs2::depth_frame raw = data.get_depth_frame();
+      if (!color || !raw) {
+        return false;
       }
+      check_resolution("aligned depth", flags.color.width, flags.color.height, tables_->width(), tables_->height());
+      // The aligned depth always goes to the slot buffer, there is no librealsense frame to keep.
+      tables_->align(static_cast<const uint16_t*>(raw.get_data()), raw.get_stride_in_bytes(),
+                     reinterpret_cast<uint16_t*>(slot->depth.data()));
+      slot->depth_frame = rs2::frame();
+      slot->depth_data = slot->depth.data();
+      slot->depth_stride = flags.color.width * 2;
+    } else {
+      processed = align_.proccess(data);
+      color = processed.first(align_to_);
+      if (!color || !processed.get_depth_frame()) {
+        return false;
+      }
+    }
+    check_resolution("color", flags.color.width, flags.color.height, color.get_width(), color.get_height());
+    uint64_t copy_start = now_us();
+    store_frame(color, &slot->color, &slot->color_frame, &slot->color_data, &slot->color_stride);
+    if (!tables_) {
+      // Take the aligned depth frame.
+      rs2::depth_frame depth = processed.get_depth_frame();
+      check_resolution("aligned depth", flags.color.width, flags.color.height, depth.get_width(), depth.get_height());
+      store_frame(depth, &slot->depth, &slot->depth_frame, &slot->depth_data, &slot->depth_stride);
     }
-    rs2::frameset data = pipe.wait_for_frames();
-    auto proccessed = align.proccess(data);
-    rs2::video_frame color = proccessed.first(align_to);
-    // Take the aligned depth frame.
-    rs2::depth_frame depth = proccessed.get_depth_frame();
+    slot->depth_width = flags.color.width;
+    slot->depth_height = flags.color.height;
+    uint64_t decimate_us = 0;
+    if (flags.decimation > 1) {
+      uint64_t decimate_start = now_us();
+      decimate(slot);
+      decimate_us = now_us() - decimate_start;
+    }
+    slot->frame_number = color.get_frame_number();
+    slot->timestamp = color.get_timestamp();
+    slot->depth_timestamp = data.get_depth_frame().get_timestamp();
+    slot->aligned = true;
+    slot->timings.us[kStageAlign] = copy_start - start;
+    slot->timings.us[kStageCopy] = now_us() - copy_start - decimate_us;
+    slot->timings.us[kStageFilter] += decimate_us;
+    return true;
+  }
 
-    if (!color || !depth) {
-      fprintf(stderr, "Either color or depth stream is not available; will retry\n");
-      continue;
+ private:
+  // Downscales the aligned depth of the slot into its own buffer. Without --zero_copy, the depth
+  // is already there, tightly packed, and it's decimated in place.
+  static void decimate(FrameSlot* slot) {
+    decimate_depth(reinterpret_cast<const uint16_t*>(slot->depth_data), slot->depth_stride, slot->depth_width,
+                   slot->depth_height, flags.decimation, reinterpret_cast<uint16_t*>(slot->depth.data()));
+    slot->depth_frame = rs2::frame();
+    slot->depth_data = slot->depth.data();
+    slot->depth_width /= flags.decimation;
+    slot->depth_height /= flags.decimation;
+    slot->depth_stride = slot->depth_width * 2;
+  }
+
+  rs2::align align_;
+  rs2_stream align_to_;
+  std::unique_ptr<DepthAligner> tables_;
+};
+
+// Same as engine->align, but its CPU time is counted in the metrics.
+bool align_frames(AlignEngine* engine, const rs2::frameset& data, FrameSlot* slot) {
+  uint64_t cpu_start = thread_cpu_us();
+  bool ok = engine->align(data, slot);
+  process_metrics.add_cpu(kStageAlign, thread_cpu_us() - cpu_start);
+  return ok;
+}
+
+// Aligns depth to color and publishes the result to the ring. With --lazy_align, the frameset is
+// published as is, and it's aligned by the request, which takes it. See align_slot.
+// While a burst is armed, the frames go to the burst instead of the ring.
+// The depth filters run on every frameset, even with --lazy_align: the temporal one needs them all.
+// preview may be null. The framesets dropped here are counted in metrics.
+void align_and_publish(AlignEngine* engine, DepthFilterChain* filters, PreviewSource* preview,
+                       const CapturedFrames& captured, FrameRing* ring, BurstCapture* burst, CameraMetrics* metrics) {
+  rs2::frameset data = captured.data;
+  uint64_t filter_us = 0;
+  if (!filters->empty()) {
+    uint64_t start = now_us();
+    uint64_t cpu_start = thread_cpu_us();
+    data = filters->process(data);
+    filter_us = now_us() - start;
+    process_metrics.add_cpu(kStageFilter, thread_cpu_us() - cpu_start);
+  }
+  if (preview) {
+    preview->offer(data);
+  }
+  rs2::video_frame color = data.get_color_frame();
+  if (!color || !data.get_depth_frame()) {
+    fprintf(stderr, "Either color or depth stream is not available; skipping the frameset\n");
+    metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  FrameSlot* slot = burst->begin_write();
+  bool in_burst = slot != nullptr;
+  if (!slot) {
+    slot = ring->begin_write();
+  }
+  if (!slot) {
+    fprintf(stderr, "All frame slots are busy; dropping frame %llu\n", color.get_frame_number());
+    metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  slot->timings = Timings();
+  slot->timings.us[kStageCapture] = captured.capture_us;
+  slot->timings.us[kStageFilter] = filter_us;
+  if (flags.lazy_align) {
+    data.keep();
+    slot->raw = data;
+    slot->aligned = false;
+    slot->frame_number = color.get_frame_number();
+    slot->timestamp = color.get_timestamp();
+    slot->depth_timestamp = data.get_depth_frame().get_timestamp();
+  } else if (!align_frames(engine, data, slot)) {
+    fprintf(stderr, "Either aligned color or depth is not available; skipping the frameset\n");
+    metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+    if (!in_burst) {
+      ring->abort_write(slot);
+    }
+    return;
+  }
+  if (in_burst) {
+    burst->commit();
+  } else {
+    ring->publish(slot);
+  }
+}
+
+// Lazy alignment: aligns a frame taken by a request, unless it's already aligned.
+void align_slot(AlignEngine* engine, FrameSlot* slot) {
+  if (slot->aligned) {
+    return;
+  }
+  if (!align_frames(engine, slot->raw, slot)) {
+    fail("Failed to align a frame");
+  }
+  // Let librealsense reuse the frames, unless the slot still points into them.
+  slot->raw = rs2::frameset();
+}
+
+// Runs in its own thread. Pulls framesets from the camera, aligns them and publishes
+// to the ring, so that requests could be served from an already captured frame.
+void capture_loop(rs2::pipeline* pipe, rs2_stream align_to, const DepthAligner* tables, DepthFilterChain* filters,
+                  PreviewSource* preview, FrameRing* ring, BurstCapture* burst, CameraMetrics* metrics) {
+  AlignEngine engine(align_to, tables);
+  while (1) {
+    align_and_publish(&engine, filters, preview, capture(pipe, metrics), ring, burst, metrics);
+  }
+}
+
+// Pipelined mode: the capture stage only pulls framesets from the camera and hands them over
+// to the align stage. If the align stage falls behind, the frameset is dropped: a stale frame
+// is worth nothing to us, and blocking here would make librealsense drop frames anyway.
+void pipelined_capture_loop(rs2::pipeline* pipe, BoundedQueue<CapturedFrames>* aligner, CameraMetrics* metrics) {
+  while (1) {
+    CapturedFrames captured = capture(pipe, metrics);
+    if (!aligner->try_push(captured)) {
+      fprintf(stderr, "Align stage is busy; dropping frame %llu\n", captured.data.get_frame_number());
+      metrics->dropped.fetch_add(1, std::memory_order_relaxed);
     }
+  }
+}
 
-    if (kColorWidth != color.get_width() || kColorHeight != color.get_height()) {
-      fprintf(stderr, "kColorWidth: %d. color.get_width: %d, kColorHeight: %d, color.get_height: %d\n",
-              kColorWidth, color.get_width(), kColorHeight, color.get_height());
-      fail("Unexpected color image resolution");
+void align_loop(BoundedQueue<CapturedFrames>* in, rs2_stream align_to, const DepthAligner* tables,
+                DepthFilterChain* filters, PreviewSource* preview, FrameRing* ring, BurstCapture* burst,
+                CameraMetrics* metrics) {
+  AlignEngine engine(align_to, tables);
+  while (1) {
+    align_and_publish(&engine, filters, preview, in->pop(), ring, burst, metrics);
+  }
+}
+
+// Exposure and image statistics of a frameset, used to detect the end of the warm-up.
+struct WarmupStats {
+  // Actual exposure reported by the camera, or -1 if the metadata is not available.
+  double exposure = -1;
+  // Mean green channel value in [0, 255], sampled on a sparse grid.
+  double brightness = 0;
+  // Fraction of the sampled depth pixels with valid data.
+  double depth_fill = 0;
+};
+
+WarmupStats get_warmup_stats(const rs2::frameset& data) {
+  // Every 8th pixel of every 8th row is plenty to see the exposure change.
+  const int kStep = 8;
+  WarmupStats stats;
+  rs2::video_frame color = data.get_color_frame();
+  rs2::depth_frame depth = data.get_depth_frame();
+  if (!color || !depth) {
+    return stats;
+  }
+  if (color.supports_frame_metadata(RS2_FRAME_METADATA_ACTUAL_EXPOSURE)) {
+    stats.exposure = color.get_frame_metadata(RS2_FRAME_METADATA_ACTUAL_EXPOSURE);
+  }
+  const uint8_t* pixels = static_cast<const uint8_t*>(color.get_data());
+  long sum = 0;
+  int count = 0;
+  for (int y = 0; y < color.get_height(); y += kStep) {
+    const uint8_t* row = pixels + y * color.get_stride_in_bytes();
+    for (int x = 0; x < color.get_width(); x += kStep) {
+      // BGR8: the green channel is the closest to the luminance.
+      sum += row[x * 3 + 1];
+      count++;
     }
-    if (kDepthWidth != depth.get_width() || kDepthHeight != depth.get_height()) {
-      fprintf(stderr, "kDepthWidth: %d, depth.get_width: %d, kDepthHeight: %d, depth.get_height: %d\n",
-              kDepthWidth, depth.get_width(), kDepthHeight, depth.get_height());
-      fail("Unexpected depth image resolution");
+  }
+  stats.brightness = count > 0 ? static_cast<double>(sum) / count : 0;
+  const uint8_t* depth_pixels = static_cast<const uint8_t*>(depth.get_data());
+  int valid = 0;
+  count = 0;
+  for (int y = 0; y < depth.get_height(); y += kStep) {
+    const uint16_t* row = reinterpret_cast<const uint16_t*>(depth_pixels + y * depth.get_stride_in_bytes());
+    for (int x = 0; x < depth.get_width(); x += kStep) {
+      valid += row[x] != 0;
+      count++;
     }
+  }
+  stats.depth_fill = count > 0 ? static_cast<double>(valid) / count : 0;
+  return stats;
+}
+
+bool close_enough(double a, double b, double tolerance) {
+  return fabs(a - b) <= tolerance * std::max(fabs(a), fabs(b));
+}
 
-    // Copy frames to the buffers, so we can modify the contents and be sure that
-    // the new frame won't corrupt the data.
-    memcpy(color_buf.data(), color.get_data(), color_buf_size);
-    memcpy(depth_buf.data(), depth.get_data(), depth_buf_size);
+bool is_stable(const WarmupStats& prev, const WarmupStats& cur) {
+  double tol = flags.warmup_tolerance;
+  if ((prev.exposure < 0) != (cur.exposure < 0)) {
+    return false;
+  }
+  if (cur.exposure >= 0 && !close_enough(prev.exposure, cur.exposure, tol)) {
+    return false;
+  }
+  // An almost black image has a large relative noise, so allow one brightness level of it.
+  if (fabs(prev.brightness - cur.brightness) > std::max(1.0, tol * std::max(prev.brightness, cur.brightness))) {
+    return false;
+  }
+  return fabs(prev.depth_fill - cur.depth_fill) <= tol;
+}
 
-    // Save the color frame as a JPEG image.
-    cv::Mat color_mat(color.get_height(), color.get_width(), CV_8UC3, color_buf.data());
-    //cv::cvtColor(color_mat, color_mat, CV_RGB2BGR);
-    std::vector<int> color_params = { CV_IMWRITE_JPEG_QUALITY, 90 };
-    std::string color_fname = out_prefix + "color.jpg";
-    if (!cv::imwrite(color_fname, color_mat, color_params)) {
-      fail("Failed to save color frame");
+// Skips the frames captured while the auto-exposure converges, but no more than --warmup_max_frames.
+// The skipped frames still go through the depth filters, so that the temporal filter starts with a history.
+void warm_up(rs2::pipeline* pipe, DepthFilterChain* filters) {
+  WarmupStats prev;
+  int stable = 0;
+  int i = 0;
+  for (; i < flags.warmup_max_frames; i++) {
+    rs2::frameset data = pipe->wait_for_frames();
+    if (!filters->empty()) {
+      filters->process(data);
     }
+    WarmupStats cur = get_warmup_stats(data);
+    if (i > 0 && is_stable(prev, cur)) {
+      stable++;
+    } else {
+      stable = 0;
+    }
+    prev = cur;
+    if (i + 1 >= kMinWarmupFrames && stable >= kStableFrames) {
+      i++;
+      break;
+    }
+  }
+  fprintf(stderr, "Warm-up done after %d frames%s\n", i, stable >= kStableFrames ? "" : " (not stable yet)");
+}
+
+// The depth previews are encoded with the same backend, at --depth_preview_quality.
+std::unique_ptr<JpegEncoder> create_color_encoder(int quality) {
+  std::string err;
+  std::unique_ptr<JpegEncoder> enc = create_jpeg_encoder(flags.color_encoder, quality, flags.v4l2_device, &err);
+  if (!enc) {
+    fprintf(stderr, "--color_encoder=%s: %s\n", flags.color_encoder.c_str(), err.c_str());
+    fail("Failed to create the color encoder");
+  }
+  return enc;
+}
+
+// Region of the frame a request wants, in the color image coordinates, and its downscale factor.
+struct Crop {
+  int x = 0;
+  int y = 0;
+  // 0 means the whole frame.
+  int width = 0;
+  int height = 0;
+  int scale = 1;
+};
 
-    // Save the depth frame as a 16-bit grayscale PNG image.
-    cv::Mat depth_mat(kDepthHeight, kDepthWidth, CV_16UC1, depth_buf.data());
-    std::vector<int> depth_params = { CV_IMWRITE_PNG_COMPRESSION, 1 };
-    std::string depth_fname = out_prefix + "depth.png";
-    if (!cv::imwrite(depth_fname, depth_mat, depth_params)) {
-      fail("Failed to save depth frame");
+// An image in memory: a frame, a region of it, or a downscaled copy.
+struct ImageView {
+  const uint8_t* data = nullptr;
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+};
+
+// Returns the region of an image. div is how many times the image is smaller than the color one.
+// The region shares the pixels with the image.
+ImageView crop_view(const uint8_t* data, int width, int height, int stride, int bytes_per_pixel, const Crop& crop,
+                    int div) {
+  ImageView res;
+  if (crop.width == 0) {
+    res.data = data;
+    res.width = width;
+    res.height = height;
+  } else {
+    res.data = data + (crop.y / div) * stride + (crop.x / div) * bytes_per_pixel;
+    res.width = crop.width / div;
+    res.height = crop.height / div;
+  }
+  res.stride = stride;
+  return res;
+}
+
+// Returns the cropped and downscaled color image of the slot. scaled is the buffer for the downscaled pixels.
+ImageView color_view(const FrameSlot& slot, const Crop& crop, cv::Mat* scaled) {
+  ImageView res = crop_view(slot.color_data, flags.color.width, flags.color.height, slot.color_stride, 3, crop, 1);
+  if (crop.scale == 1) {
+    return res;
+  }
+  cv::Mat view(res.height, res.width, CV_8UC3, const_cast<uint8_t*>(res.data), res.stride);
+  cv::resize(view, *scaled, cv::Size(res.width / crop.scale, res.height / crop.scale), 0, 0, cv::INTER_AREA);
+  res.data = scaled->data;
+  res.width = scaled->cols;
+  res.height = scaled->rows;
+  res.stride = scaled->step;
+  return res;
+}
+
+// Same as color_view for the depth. The depth is downscaled the same way as by --decimation.
+ImageView depth_view(const FrameSlot& slot, const Crop& crop, std::vector<uint16_t>* scaled) {
+  int div = flags.color.width / slot.depth_width;
+  ImageView res = crop_view(slot.depth_data, slot.depth_width, slot.depth_height, slot.depth_stride, 2, crop, div);
+  if (crop.scale == 1) {
+    return res;
+  }
+  int width = res.width / crop.scale;
+  int height = res.height / crop.scale;
+  scaled->resize(width * height);
+  decimate_depth(reinterpret_cast<const uint16_t*>(res.data), res.stride, res.width, res.height, crop.scale,
+                 scaled->data());
+  res.data = reinterpret_cast<const uint8_t*>(scaled->data());
+  res.width = width;
+  res.height = height;
+  res.stride = width * 2;
+  return res;
+}
+
+// Encodes the color image as a JPEG image into buf. Returns the size of the image.
+size_t encode_color(const ImageView& color, JpegEncoder* enc, std::vector<uint8_t>* buf) {
+  size_t size = enc->encode(color.data, color.width, color.height, color.stride, buf);
+  if (size == 0) {
+    fail("Failed to encode color frame");
+  }
+  return size;
+}
+
+// Encodes the depth image of the slot into buf, in the format chosen by --depth_format.
+// Returns the size of the image.
+size_t encode_depth(const FrameSlot& slot, const ImageView& depth, float depth_scale, Z16Writer* z16,
+                    std::vector<uint8_t>* buf) {
+  if (flags.depth_format == "z16") {
+    size_t size = z16->encode(reinterpret_cast<const uint16_t*>(depth.data), depth.width, depth.height, depth.stride,
+                              depth_scale, slot.timestamp, slot.frame_number, buf);
+    if (size == 0) {
+      fail("Failed to encode depth frame");
+    }
+    return size;
+  }
+  cv::Mat depth_mat(depth.height, depth.width, CV_16UC1, const_cast<uint8_t*>(depth.data), depth.stride);
+  static const std::vector<int> depth_params = {CV_IMWRITE_PNG_COMPRESSION, 1};
+  if (!cv::imencode(".png", depth_mat, *buf, depth_params)) {
+    fail("Failed to encode depth frame");
+  }
+  return buf->size();
+}
+
+// Colorizes the depth image, subsampled to at most --depth_preview_width, into bgr, and encodes it
+// as a JPEG image into buf. Returns the size of the image.
+size_t encode_depth_preview(const ImageView& depth, float depth_scale, DepthColorizer* colorizer, cv::Mat* bgr,
+                            JpegEncoder* enc, std::vector<uint8_t>* buf) {
+  int step = (depth.width + flags.depth_preview.width - 1) / flags.depth_preview.width;
+  // Reallocates only if the size changes.
+  bgr->create((depth.height + step - 1) / step, (depth.width + step - 1) / step, CV_8UC3);
+  colorizer->colorize(reinterpret_cast<const uint16_t*>(depth.data), depth.stride, depth.width, depth.height, step,
+                      depth_scale, bgr->data, bgr->step);
+  size_t size = enc->encode(bgr->data, bgr->cols, bgr->rows, bgr->step, buf);
+  if (size == 0) {
+    fail("Failed to encode depth preview");
+  }
+  return size;
+}
+
+// Deprojects the depth image of the slot into a point cloud in buf. Returns the size of the point cloud.
+size_t encode_points(const FrameSlot& slot, const Crop& crop, const rs2_intrinsics& intrinsics, float depth_scale,
+                     PointCloudEncoder* enc, std::vector<uint16_t>* scaled, std::vector<uint8_t>* buf) {
+  ImageView depth = depth_view(slot, crop, scaled);
+  int div = flags.color.width / slot.depth_width;
+  PointCloudGeometry g;
+  // Same rounding as in crop_view.
+  g.x = crop.width ? crop.x / div * div : 0;
+  g.y = crop.width ? crop.y / div * div : 0;
+  g.step = div * crop.scale;
+  g.width = depth.width;
+  g.height = depth.height;
+  const uint8_t* bgr = flags.point_cloud == "xyzrgb" ? slot.color_data : nullptr;
+  return enc->encode(intrinsics, g, reinterpret_cast<const uint16_t*>(depth.data), depth.stride, depth_scale, bgr,
+                     slot.color_stride, slot.timestamp, slot.frame_number, buf);
+}
+
+// File name of the depth image after the prefix.
+const char* depth_suffix() {
+  return flags.depth_format == "z16" ? "depth.z16" : "depth.png";
+}
+
+std::string depth_fname(const std::string& out_prefix) {
+  return out_prefix + depth_suffix();
+}
+
+// Uncompressed z16 files are written straight from the frame, without encoding them into a buffer first.
+// The writer thread and the per-frame syncs need the encoded buffer.
+bool write_depth_directly() {
+  return flags.depth_format == "z16" && flags.depth_compression == kZ16None && !flags.write_thread &&
+         flags.durability != kDurabilityFrame;
+}
+
+// Writes the depth image of the slot in the uncompressed .z16 format.
+void write_depth_z16(const FrameSlot& slot, const ImageView& depth, const std::string& fname, float depth_scale,
+                     Z16Writer* z16) {
+  if (!z16->write(fname, reinterpret_cast<const uint16_t*>(depth.data), depth.width, depth.height, depth.stride,
+                  depth_scale, slot.timestamp, slot.frame_number)) {
+    fail("Failed to save depth frame");
+  }
+}
+
+// Rolling per-stage latency histograms of all requests, dumped by the !stats command.
+StageStats stage_stats;
+
+// Batch tracks the frames of a single request, which are still being encoded.
+// With several cameras, a frame index is done when the frames of all cameras are.
+class Batch {
+ public:
+  // Sets the batch up for a new request. The buffers are reused. The FRAME lines go to the client,
+  // with id after FRAME.
+  void reset(bool report_frames, int num_frames, int num_cameras, Client* client, const std::string& id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    report_frames_ = report_frames;
+    client_ = client;
+    id_ = id;
+    pending_ = 0;
+    sealed_ = false;
+    on_done_ = nullptr;
+    timings_ = Timings();
+    cameras_left_.assign(num_frames, num_cameras);
+    frame_timings_.assign(num_frames, Timings());
+    frame_info_.resize(num_frames);
+    for (std::string& info : frame_info_) {
+      info.clear();
+    }
+  }
+
+  void add() {
+    std::lock_guard<std::mutex> lock(mu_);
+    pending_++;
+  }
+
+  void frame_done(int index, const Timings& t) {
+    std::unique_lock<std::mutex> lock(mu_);
+    timings_.add(t);
+    frame_timings_[index].add(t);
+    if (--cameras_left_[index] == 0 && report_frames_) {
+      Timings frame_timings = frame_timings_[index];
+      lock.unlock();
+      reply(client_, "FRAME%s %d OK%s%s", id_.c_str(), index, frame_timings.format().c_str(),
+            frame_info_[index].c_str());
+      lock.lock();
+    }
+    if (--pending_ == 0) {
+      done_.notify_all();
+      if (sealed_) {
+        // Once on_done runs, the request may be done and the batch reset for the next one.
+        std::function<void()> on_done = on_done_;
+        lock.unlock();
+        on_done();
+      }
+    }
+  }
+
+  // Called once all frames are submitted. on_done runs once they are all done: on the encoder thread,
+  // which finishes the last one, or right here, if they already are.
+  void seal(std::function<void()> on_done) {
+    std::unique_lock<std::mutex> lock(mu_);
+    sealed_ = true;
+    on_done_ = on_done;
+    if (pending_ == 0) {
+      lock.unlock();
+      on_done();
+    }
+  }
+
+  // Extra key=value pairs for the FRAME line of the frame. Must be set before its frames are submitted.
+  void set_frame_info(int index, const std::string& info) { frame_info_[index] = info; }
+
+  // Returns the sum of the timings of all frames.
+  Timings wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    return timings_;
+  }
+
+ private:
+  bool report_frames_ = false;
+  Client* client_ = nullptr;
+  std::string id_;
+  std::mutex mu_;
+  std::condition_variable done_;
+  int pending_ = 0;
+  bool sealed_ = false;
+  std::function<void()> on_done_;
+  Timings timings_;
+  std::vector<int> cameras_left_;
+  std::vector<Timings> frame_timings_;
+  std::vector<std::string> frame_info_;
+};
+
+enum Output {
+  kOutputColor,
+  kOutputDepth,
+  // Only with --point_cloud.
+  kOutputPoints,
+  // Only for the depth_preview=1 requests.
+  kOutputDepthPreview,
+  kNumOutputs,
+};
+
+// Stage, which does the output, in the timings and the CPU metrics.
+const Stage kOutputStages[kNumOutputs] = {kStageColor, kStageDepth, kStagePoints, kStagePreview};
+
+// Returns the bit of the output in a mask of the outputs.
+unsigned output_bit(Output output) {
+  return 1u << output;
+}
+
+// Encoded outputs of a frame, which are kept in memory instead of being written to separate files.
+struct EncodedFrame {
+  std::vector<uint8_t> data[kNumOutputs];
+  size_t size[kNumOutputs] = {};
+  // Of the color frame. The ring slot may be reused by the time the encoded frame is written out.
+  unsigned long long frame_number = 0;
+  double timestamp = 0;
+};
+
+// FrameJob is a frame handed to the encoder. It's done when all of its outputs are written.
+struct FrameJob {
+  FrameRing* ring = nullptr;
+  FrameSlot* slot = nullptr;
+  float depth_scale = 0;
+  std::string out_prefix;
+  Crop crop;
+  // Of the color stream, for the point cloud.
+  rs2_intrinsics intrinsics;
+  // If not null, the outputs are encoded into it, and nothing is written to disk.
+  EncodedFrame* encoded = nullptr;
+  // May be null, if nobody waits for this particular frame.
+  Batch* batch = nullptr;
+  int index = 0;
+  // Mask of the outputs the frame has, see output_bit.
+  unsigned outputs = 0;
+  // The slot goes back to the ring, once all outputs are encoded. The frame is done, once they are written.
+  std::atomic<int> encodes_left{0};
+  std::atomic<int> outputs_left{0};
+  // With --write_thread, the encoded outputs wait here for the writer. The job is reused for other frames,
+  // so the buffers grow to the largest outputs once.
+  std::vector<uint8_t> bufs[kNumOutputs];
+  size_t sizes[kNumOutputs] = {};
+  std::string fnames[kNumOutputs];
+  // The outputs are processed by different threads, so each one has its own write time.
+  // They are summed into t_write, once the frame is done.
+  Timings timings;
+  uint64_t write_us[kNumOutputs] = {};
+};
+
+struct EncodeTask {
+  FrameJob* job = nullptr;
+  Output output = kOutputColor;
+};
+
+// Max number of files the writer thread writes and syncs together.
+const size_t kMaxWriteBatch = 16;
+
+// EncodeStage encodes and writes pinned frames on a pool of worker threads, and releases
+// them back to the ring once they are encoded. Every output of a frame is a separate task,
+// so the color JPEG and the depth PNG are encoded in parallel.
+//
+// The workers write the files themselves, or, with --write_thread, queue them for the writer thread.
+// It takes whatever is queued, up to kMaxWriteBatch files, writes them all, and only then syncs them,
+// so that a single slow flush holds up a batch of files, not every one of them in turn.
+//
+// Once every worker has seen the largest frame, nothing here touches the heap: the jobs come from
+// a free list, and the workers keep their buffers and file name strings between the frames.
+class EncodeStage {
+ public:
+  EncodeStage(size_t queue_size, int num_threads)
+      : queue_(queue_size * kNumOutputs), writes_(flags.write_thread ? flags.write_queue : 1) {
+    // A queued frame holds a job, and so does every frame being encoded or written.
+    size_t num_jobs = queue_size + num_threads;
+    if (flags.write_thread) {
+      num_jobs += flags.write_queue + kMaxWriteBatch;
+    }
+    for (size_t i = 0; i < num_jobs; i++) {
+      free_jobs_.push_back(new FrameJob);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      std::thread(&EncodeStage::run, this).detach();
+    }
+    if (flags.write_thread) {
+      std::thread(&EncodeStage::write_loop, this).detach();
+    }
+  }
+
+  // Takes ownership of the slot pinned in the ring. Blocks if the queue is full.
+  // ring is null for the slots, which don't come from a ring, e.g. the burst ones.
+  // If encoded is not null, it must stay valid until the frame is done.
+  // wait_us is how long the request waited for this frame. outputs is the mask of the outputs to encode.
+  // The outputs of an interactive frame go ahead of everything queued.
+  void submit(FrameRing* ring, FrameSlot* slot, float depth_scale, const rs2_intrinsics& intrinsics,
+              const std::string& out_prefix, const Crop& crop, EncodedFrame* encoded, Batch* batch, int index,
+              uint64_t wait_us, unsigned outputs, bool interactive) {
+    FrameJob* job = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      pending_++;
+      if (!free_jobs_.empty()) {
+        job = free_jobs_.back();
+        free_jobs_.pop_back();
+      }
+    }
+    if (batch) {
+      batch->add();
+    }
+    if (!job) {
+      // More frames in flight than the queue holds, e.g. a burst. The job stays in the free list afterwards.
+      job = new FrameJob;
+    }
+    job->ring = ring;
+    job->slot = slot;
+    job->depth_scale = depth_scale;
+    // Reuses the string buffer of the job.
+    job->out_prefix = out_prefix;
+    job->crop = crop;
+    job->intrinsics = intrinsics;
+    job->encoded = encoded;
+    if (encoded) {
+      encoded->frame_number = slot->frame_number;
+      encoded->timestamp = slot->timestamp;
+    }
+    job->batch = batch;
+    job->index = index;
+    job->outputs = outputs;
+    job->encodes_left = __builtin_popcount(outputs);
+    job->outputs_left = __builtin_popcount(outputs);
+    job->timings = slot->timings;
+    job->timings.us[kStageWait] = wait_us;
+    std::fill(job->write_us, job->write_us + kNumOutputs, 0);
+    for (int i = 0; i < kNumOutputs; i++) {
+      if (!(outputs & output_bit(static_cast<Output>(i)))) {
+        continue;
+      }
+      EncodeTask task;
+      task.job = job;
+      task.output = static_cast<Output>(i);
+      if (interactive) {
+        queue_.push_front(task);
+      } else {
+        queue_.push(task);
+      }
+    }
+  }
+
+  // Returns true, if there are outputs waiting for a free worker.
+  bool busy() { return queue_.size() > 0; }
+
+  // Number of the outputs waiting for a free worker, and of the encoded files waiting for the writer thread.
+  size_t queued() { return queue_.size(); }
+  size_t queued_writes() { return flags.write_thread ? writes_.size() : 0; }
+
+  // Waits until all submitted frames are written, and synced as --durability says.
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mu_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+ private:
+  void run() {
+    // Encoders are not thread-safe, so every worker has its own one.
+    std::unique_ptr<JpegEncoder> jpeg = create_color_encoder(flags.jpeg_quality);
+    // Created with the first depth preview.
+    std::unique_ptr<JpegEncoder> preview_jpeg;
+    DepthColorizer colorizer(flags.depth_preview.min_depth, flags.depth_preview.max_depth);
+    cv::Mat preview_bgr;
+    std::vector<uint8_t> out_buf[kNumOutputs];
+    Z16Writer z16(flags.depth_compression);
+    // Downscaled images of the requests with scale=N.
+    cv::Mat scaled_color;
+    std::vector<uint16_t> scaled_depth;
+    PointCloudEncoder points;
+    // Grows to the longest file name once, and is reused for all of them.
+    std::string out_fname;
+    while (1) {
+      EncodeTask task = queue_.pop();
+      FrameJob* job = task.job;
+      EncodedFrame* enc = job->encoded;
+      // With the writer thread, the file outlives the task, so it's encoded into the job.
+      std::vector<uint8_t>* buf = enc                  ? &enc->data[task.output]
+                                  : flags.write_thread ? &job->bufs[task.output]
+                                                       : &out_buf[task.output];
+      std::string& fname = flags.write_thread ? job->fnames[task.output] : out_fname;
+      uint64_t start = now_us();
+      uint64_t cpu_start = thread_cpu_us();
+      size_t size = 0;
+      bool written = false;
+      switch (task.output) {
+        case kOutputColor:
+          size = encode_color(color_view(*job->slot, job->crop, &scaled_color), jpeg.get(), buf);
+          job->timings.us[kStageColor] = now_us() - start;
+          fname.assign(job->out_prefix).append("color.jpg");
+          break;
+        case kOutputDepth:
+          fname.assign(job->out_prefix).append(depth_suffix());
+          if (!enc && write_depth_directly()) {
+            ImageView depth = depth_view(*job->slot, job->crop, &scaled_depth);
+            write_depth_z16(*job->slot, depth, fname, job->depth_scale, &z16);
+            job->write_us[kOutputDepth] = now_us() - start;
+            process_metrics.bytes_written.fetch_add(depth.width * depth.height * 2, std::memory_order_relaxed);
+            written = true;
+            break;
+          }
+          size = encode_depth(*job->slot, depth_view(*job->slot, job->crop, &scaled_depth), job->depth_scale, &z16,
+                              buf);
+          job->timings.us[kStageDepth] = now_us() - start;
+          break;
+        case kOutputPoints:
+          size = encode_points(*job->slot, job->crop, job->intrinsics, job->depth_scale, &points, &scaled_depth, buf);
+          job->timings.us[kStagePoints] = now_us() - start;
+          fname.assign(job->out_prefix).append("points.pc16");
+          break;
+        case kOutputDepthPreview:
+          if (!preview_jpeg) {
+            preview_jpeg = create_color_encoder(flags.depth_preview.quality);
+          }
+          size = encode_depth_preview(depth_view(*job->slot, job->crop, &scaled_depth), job->depth_scale, &colorizer,
+                                      &preview_bgr, preview_jpeg.get(), buf);
+          job->timings.us[kStagePreview] = now_us() - start;
+          fname.assign(job->out_prefix).append("depth-preview.jpg");
+          break;
+        default:
+          fail("Unexpected encoder output");
+      }
+      process_metrics.add_cpu(kOutputStages[task.output], thread_cpu_us() - cpu_start);
+      // The pixels are not needed anymore, once the last output is encoded.
+      if (--job->encodes_left == 0 && job->ring) {
+        job->ring->release(job->slot);
+      }
+      if (enc) {
+        enc->size[task.output] = size;
+      } else if (!written && flags.write_thread) {
+        job->sizes[task.output] = size;
+        WriteTask write;
+        write.job = job;
+        write.output = task.output;
+        writes_.push(write);
+        continue;
+      } else if (!written) {
+        start = now_us();
+        cpu_start = thread_cpu_us();
+        if (!write_file(fname, buf->data(), size, flags.durability == kDurabilityFrame)) {
+          fail("Failed to save frame");
+        }
+        job->write_us[task.output] = now_us() - start;
+        process_metrics.add_cpu(kStageWrite, thread_cpu_us() - cpu_start);
+        process_metrics.bytes_written.fetch_add(size, std::memory_order_relaxed);
+      }
+      output_done(job);
+    }
+  }
+
+  // The writer thread.
+  void write_loop() {
+    std::vector<WriteTask> batch;
+    batch.reserve(kMaxWriteBatch);
+    int fds[kMaxWriteBatch];
+    bool sync = flags.durability == kDurabilityFrame;
+    while (1) {
+      batch.clear();
+      batch.push_back(writes_.pop());
+      WriteTask write;
+      while (batch.size() < kMaxWriteBatch && writes_.try_pop(&write)) {
+        batch.push_back(write);
+      }
+      uint64_t start = now_us();
+      uint64_t cpu_start = thread_cpu_us();
+      for (size_t i = 0; i < batch.size(); i++) {
+        FrameJob* job = batch[i].job;
+        Output o = batch[i].output;
+        fds[i] = create_file(job->fnames[o], job->bufs[o].data(), job->sizes[o]);
+        if (fds[i] < 0) {
+          fail("Failed to save frame");
+        }
+        process_metrics.bytes_written.fetch_add(job->sizes[o], std::memory_order_relaxed);
+        if (sync) {
+          // Start the writeback of every file right away, then wait for all of them below.
+          sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+      }
+      for (size_t i = 0; i < batch.size(); i++) {
+        const std::string& fname = batch[i].job->fnames[batch[i].output];
+        if (sync && fdatasync(fds[i]) != 0) {
+          perror(fname.c_str());
+          fail("Failed to sync frame");
+        }
+        if (close(fds[i]) != 0) {
+          perror(fname.c_str());
+          fail("Failed to save frame");
+        }
+      }
+      // Every directory once per batch, usually there is only one.
+      for (size_t i = 0; i < batch.size() && sync; i++) {
+        const std::string& fname = batch[i].job->fnames[batch[i].output];
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++) {
+          seen = same_parent_dir(fname, batch[j].job->fnames[batch[j].output]);
+        }
+        if (!seen && !sync_parent_dir(fname)) {
+          fail("Failed to sync frame");
+        }
+      }
+      // Every file of the batch was on disk only once all of them were.
+      uint64_t write_us = now_us() - start;
+      process_metrics.add_cpu(kStageWrite, thread_cpu_us() - cpu_start);
+      for (const WriteTask& w : batch) {
+        w.job->write_us[w.output] = write_us;
+        output_done(w.job);
+      }
+    }
+  }
+
+  // Called once for every output of the job, once it's written or kept in memory.
+  void output_done(FrameJob* job) {
+    if (--job->outputs_left > 0) {
+      return;
+    }
+    for (int i = 0; i < kNumOutputs; i++) {
+      job->timings.us[kStageWrite] += job->write_us[i];
+    }
+    stage_stats.record(job->timings);
+    if (job->batch) {
+      job->batch->frame_done(job->index, job->timings);
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    free_jobs_.push_back(job);
+    if (--pending_ == 0) {
+      idle_.notify_all();
+    }
+  }
+
+  struct WriteTask {
+    FrameJob* job = nullptr;
+    Output output = kOutputColor;
+  };
+
+  BoundedQueue<EncodeTask> queue_;
+  // Only used with --write_thread.
+  BoundedQueue<WriteTask> writes_;
+  std::mutex mu_;
+  std::condition_variable idle_;
+  int pending_ = 0;
+  // Jobs of the frames done, for reuse. Never freed.
+  std::vector<FrameJob*> free_jobs_;
+};
+
+// Camera is a RealSense device with its own pipeline, capture threads and frame ring.
+struct Camera {
+  // Used in the file names. Empty, if the process drives a single camera, as chosen by librealsense.
+  std::string name;
+  // Empty means any device.
+  std::string serial;
+  rs2::pipeline pipe;
+  float depth_scale = 0;
+  // The depth is aligned to color, so these are the intrinsics of the aligned depth too.
+  rs2_intrinsics color_intrinsics;
+  rs2_stream align_to = RS2_STREAM_ANY;
+  std::unique_ptr<DepthAligner> tables;
+  // Used by the warm-up, and then by the thread, which aligns the frames.
+  std::unique_ptr<DepthFilterChain> filters;
+  // Null without --preview_socket.
+  std::unique_ptr<PreviewSource> preview;
+  std::unique_ptr<FrameRing> ring;
+  std::unique_ptr<BurstCapture> burst;
+  // Only used by the request thread with --lazy_align.
+  std::unique_ptr<AlignEngine> lazy_aligner;
+  // Publication number of the last frame handed to a request: the same frame is never served twice.
+  uint64_t last_seq = 0;
+  // Only used by the request thread. Its reference is the last frame of an if_changed=1 request,
+  // which was not UNCHANGED.
+  std::unique_ptr<ChangeDetector> change;
+  // Updated by the capture thread.
+  CameraMetrics metrics;
+  // Between the capture and the align threads with --pipelined, null otherwise.
+  BoundedQueue<CapturedFrames>* aligner = nullptr;
+};
+
+// Longest camera name: the pack record names, like "<name>-00-points.pc16", must fit into the pack index.
+const size_t kMaxCameraName = kPackMaxName - (sizeof("-00-points.pc16") - 1);
+
+// The names also go whole into the preview frames, and with the frame index into the shm slots.
+static_assert(kMaxCameraName < sizeof(PreviewFrameHeader::camera), "camera names must fit into the preview");
+static_assert(kMaxCameraName + sizeof("-00-") - 1 < sizeof(ShmSlotHeader::tag), "frame tags must fit into the shm");
+
+bool valid_camera_name(const std::string& name) {
+  if (name.empty() || name.size() > kMaxCameraName) {
+    return false;
+  }
+  for (char c : name) {
+    if (!isalnum(c) && c != '-' && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses --cameras into the cameras to open.
+std::vector<std::unique_ptr<Camera>> list_cameras() {
+  std::vector<std::unique_ptr<Camera>> res;
+  if (flags.cameras.empty()) {
+    res.emplace_back(new Camera);
+    return res;
+  }
+  std::vector<std::pair<std::string, std::string>> specs;
+  if (flags.cameras == "all") {
+    rs2::context ctx;
+    rs2::device_list devices = ctx.query_devices();
+    for (uint32_t i = 0; i < devices.size(); i++) {
+      std::string serial = devices[i].get_info(RS2_CAMERA_INFO_SERIAL_NUMBER);
+      specs.emplace_back(serial, serial);
+    }
+    if (specs.empty()) {
+      fail("--cameras=all: no RealSense devices found");
+    }
+  } else {
+    std::istringstream in(flags.cameras);
+    std::string spec;
+    while (std::getline(in, spec, ',')) {
+      size_t eq = spec.find('=');
+      if (eq == std::string::npos) {
+        specs.emplace_back(spec, spec);
+      } else {
+        specs.emplace_back(spec.substr(0, eq), spec.substr(eq + 1));
+      }
+    }
+  }
+  for (const auto& spec : specs) {
+    if (!valid_camera_name(spec.first) || spec.second.empty()) {
+      fprintf(stderr, "--cameras: invalid camera %s=%s, want a name of up to %zu letters, digits, '-' and '_'\n",
+              spec.first.c_str(), spec.second.c_str(), kMaxCameraName);
+      fail("Failed to parse flags");
+    }
+    for (const auto& cam : res) {
+      if (cam->name == spec.first) {
+        fprintf(stderr, "--cameras: duplicate camera name %s\n", spec.first.c_str());
+        fail("Failed to parse flags");
+      }
+    }
+    res.emplace_back(new Camera);
+    res.back()->name = spec.first;
+    res.back()->serial = spec.second;
+  }
+  return res;
+}
+
+// Sets the inter-camera sync mode of the depth sensor: 0 is free running, 1 master, 2 slave.
+// The frames of all cameras are then triggered by the master, and their timestamps line up.
+void set_sync_mode(const rs2::device& dev, int mode) {
+  for (rs2::sensor& sensor : dev.query_sensors()) {
+    if (rs2::depth_sensor dpt = sensor.as<rs2::depth_sensor>()) {
+      if (!dpt.supports(RS2_OPTION_INTER_CAM_SYNC_MODE)) {
+        fprintf(stderr, "The depth sensor does not support the inter-camera sync mode\n");
+        return;
+      }
+      dpt.set_option(RS2_OPTION_INTER_CAM_SYNC_MODE, mode);
+      return;
+    }
+  }
+}
+
+StreamProfile stream_profile(const rs2::pipeline_profile& profile, rs2_stream stream) {
+  rs2::video_stream_profile s = profile.get_stream(stream).as<rs2::video_stream_profile>();
+  return StreamProfile{s.width(), s.height(), s.fps()};
+}
+
+// Starts the pipeline of the camera and prepares everything needed to capture from it.
+// index is the position of the camera in --cameras; the first one is the sync master.
+void open_camera(Camera* cam, int index) {
+  rs2::config cfg;
+  if (!cam->serial.empty()) {
+    cfg.enable_device(cam->serial);
+  }
+  if (!flags.playback.empty()) {
+    // A recording only has the profiles it was recorded with.
+    cfg.enable_device_from_file(flags.playback, true);
+    cfg.enable_stream(rs2_stream::RS2_STREAM_COLOR, 0, 0, 0, rs2_format::RS2_FORMAT_BGR8, 0);
+    cfg.enable_stream(rs2_stream::RS2_STREAM_DEPTH, 0, 0, 0, rs2_format::RS2_FORMAT_Z16, 0);
+  } else {
+    cfg.enable_stream(rs2_stream::RS2_STREAM_COLOR, 0, flags.color.width, flags.color.height,
+                      rs2_format::RS2_FORMAT_BGR8, flags.color.fps);
+    cfg.enable_stream(rs2_stream::RS2_STREAM_DEPTH, 0, flags.depth.width, flags.depth.height,
+                      rs2_format::RS2_FORMAT_Z16, flags.depth.fps);
+  }
+
+  rs2::pipeline_profile profile = cam->pipe.start(cfg);
+  if (!flags.playback.empty()) {
+    profile.get_device().as<rs2::playback>().set_real_time(flags.playback_real_time);
+    // Everything else is sized by the stream profiles, so they become the recorded ones.
+    flags.color = stream_profile(profile, RS2_STREAM_COLOR);
+    flags.depth = stream_profile(profile, RS2_STREAM_DEPTH);
+    fprintf(stderr, "Playback of %s: color %dx%d@%d, depth %dx%d@%d\n", flags.playback.c_str(), flags.color.width,
+            flags.color.height, flags.color.fps, flags.depth.width, flags.depth.height, flags.depth.fps);
+  }
+
+  //rs::device * dev = ctx.get_device(0);
+  //fprintf(stderr, "RealSense device opened: %s, SN %s, firmware version %s\n",
+  //        dev->get_name(), dev->get_serial(), dev->get_firmware_version());
+  if (flags.inter_cam_sync && !cam->serial.empty()) {
+    set_sync_mode(profile.get_device(), index == 0 ? 1 : 2);
+  }
+  cam->depth_scale = get_depth_scale(profile.get_device());
+  fprintf(stderr, "Camera %s: depth scale: %f\n", cam->name.c_str(), cam->depth_scale);
+
+  cam->align_to = find_stream_to_align(profile.get_streams());
+  cam->color_intrinsics = profile.get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>().get_intrinsics();
+
+  if (flags.align_engine == "table") {
+    rs2::video_stream_profile depth_profile = profile.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+    rs2::video_stream_profile color_profile = profile.get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>();
+    std::string err;
+    cam->tables = DepthAligner::create(depth_profile.get_intrinsics(), color_profile.get_intrinsics(),
+                                       depth_profile.get_extrinsics_to(color_profile), cam->depth_scale, &err);
+    if (!cam->tables) {
+      fprintf(stderr, "--align_engine=table: %s; falling back to rs2::align\n", err.c_str());
+    }
+  }
+
+  size_t color_buf_size = flags.color.width * flags.color.height * 3;
+  // Aligned depth has the color resolution.
+  size_t depth_buf_size = flags.color.width * flags.color.height * 2;
+  // Every frame waiting in the encode queue holds a slot.
+  int num_slots = kRingSlots + flags.encode_queue;
+  // The preallocated buffers are only needed, if we copy the pixels.
+  // The table aligner and the decimation always write the depth into the slot.
+  if (flags.zero_copy) {
+    color_buf_size = 0;
+    if (!cam->tables && flags.decimation == 1) {
+      depth_buf_size = 0;
+    }
+  }
+  cam->filters.reset(new DepthFilterChain(flags.depth_filters));
+  cam->ring.reset(new FrameRing(num_slots, color_buf_size, depth_buf_size));
+  cam->burst.reset(new BurstCapture(color_buf_size, depth_buf_size));
+  cam->lazy_aligner.reset(new AlignEngine(cam->align_to, cam->tables.get()));
+  cam->change.reset(new ChangeDetector(flags.change));
+}
+
+// Starts the capture threads of an open and warmed up camera.
+void start_capture(Camera* cam) {
+  if (flags.pipelined) {
+    cam->aligner = new BoundedQueue<CapturedFrames>(2);
+    std::thread(pipelined_capture_loop, &cam->pipe, cam->aligner, &cam->metrics).detach();
+    std::thread(align_loop, cam->aligner, cam->align_to, cam->tables.get(), cam->filters.get(), cam->preview.get(),
+                cam->ring.get(), cam->burst.get(), &cam->metrics)
+        .detach();
+  } else {
+    std::thread(capture_loop, &cam->pipe, cam->align_to, cam->tables.get(), cam->filters.get(), cam->preview.get(),
+                cam->ring.get(), cam->burst.get(), &cam->metrics)
+        .detach();
+  }
+}
+
+// Priority classes of the requests, see Request.
+enum Priority {
+  kPriorityBulk = 0,
+  kPriorityInteractive = 1,
+  kNumPriorities,
+};
+
+// A capture request read from stdin. The format is:
+//
+//   <prefix> [frames=N] [stride=S] [roi=X,Y,W,H] [scale=N] [burst=1] [pack=1] [shm=T] [if_changed=1]
+//            [priority=P] [depth_preview=1] [meta=<text>]
+//
+// Without options, a single frame is captured into <prefix>color.jpg and <prefix>depth.png,
+// and the reply is a single OK line. With frames=N, N frames are captured into
+// <prefix>00-color.jpg, <prefix>01-color.jpg, etc. Every S-th captured frame is taken (S=1 by default).
+// One "FRAME <index> OK" line is written per frame once it's on disk, and the final OK follows.
+// Frames are encoded in parallel, so FRAME lines may come out of order.
+//
+// With --point_cloud, every frame also gets <prefix>points.pc16, see point-cloud.h.
+//
+// With depth_preview=1, every frame also gets <prefix>depth-preview.jpg: a small 8-bit preview of the depth,
+// colorized over --depth_preview_range and subsampled to at most --depth_preview_width (see depth-colorize.h),
+// which a browser can show. With shm=1, the preview is published in place of the depth image, which is not
+// encoded then. The previews are not for the packs, so it can't be combined with pack=1.
+//
+// With roi=X,Y,W,H, only that rectangle of the color image and the same part of the depth are encoded.
+// The region is cut out of the frames in place, without copying them. With scale=N, the images are
+// also downscaled N times in both directions, the depth the same way as by --decimation.
+// The frames are still aligned as a whole.
+//
+// With pack=1, nothing but <prefix>pack.rspack is written (see pack-file.h): it holds the same files
+// as records, plus meta.json with the text of the meta option, if any. FRAME lines are written once
+// a frame is encoded, and the final OK once the pack is on disk. meta must be the last option:
+// it takes the rest of the line, spaces included. With a client of --upload_socket, the pack is also
+// streamed to it from memory (see upload-stream.h), and the OK line carries its pack id there: "OK upload=12 ...".
+// It's queued, not delivered, by then; if the client isn't connected, or drops out, there's no upload key.
+//
+// With burst=1, the N frames are N consecutive framesets from the sensor, collected into memory first
+// and encoded afterwards; stride is ignored. The FRAME lines carry the frame number, the color timestamp
+// and the color-depth timestamp skew of every frame: "fn=1234 ts=56789.012 skew=0.033", in ms.
+// With several cameras, the keys start with the camera name (front.fn=...), and sync_skew is the spread
+// of the color timestamps across the cameras.
+//
+// With shm=T, T > 0, nothing is written to disk either: the encoded frames are published into the
+// shared-memory ring (--shm, see shm-ring.h), tagged with the request token T, and the OK line carries their
+// publication ids as shm=<first>:<count>, e.g. "OK shm=17:2 t_wait=0.51". The frames of every camera come
+// camera by camera, in the same order as the pack records. shm=1 is fine, unless the reader picks out
+// the frames of several requests in flight by their tokens.
+//
+// With --cameras, every frame is captured from all cameras, and the file names and the pack records
+// start with the camera name: <prefix><name>-00-color.jpg. A FRAME line is written once the frame is
+// done for all cameras.
+//
+// With priority=1, the request is interactive; the default, 0, is bulk. An interactive request overtakes
+// the bulk ones, which wait for the serving thread, and it's served between the frames of a bulk request
+// in progress. It's served from the latest frame in the ring, even if a bulk request has it too, and its
+// frames go ahead of the bulk ones queued for the encoders. If there are such, the interactive frames are
+// downscaled by --busy_scale, and the OK line says so: "OK scale=2 ...". The bulk requests keep their
+// resolution, and are served in the background.
+//
+// With if_changed=1, a single-frame request is only served, if the frame differs from the last one served
+// for an if_changed=1 request (see change-detect.h): otherwise, nothing is encoded or written, and the reply
+// is "UNCHANGED" with the timings. With several cameras, the frame has changed, if it did on any camera.
+// Both replies carry the change scores, the largest over the cameras: "OK sad=0.52 depth_moved=0.004 ...".
+// The region compared is the roi, if any. The first frame, or the first one with another roi, has changed.
+//
+// OK and FRAME lines carry the stage timings in ms after the status, e.g. "OK t_wait=1.20 t_align=4.51".
+// The keys are listed in stats.h. Stages, which took no measurable time, are omitted.
+//
+// A request is served to completion before the next line is read. A tagged request, "#<id> <request>",
+// with id made of up to 32 letters, digits, '-' and '_', is not waited for: up to kMaxRequestsInFlight
+// of them are in flight at once, and every reply line carries the id after the first word:
+// "FRAME #7 0 OK ...", "OK #7 ...", "ERR #7 <reason>". The frames of the requests are captured in order,
+// but a request is replied to as soon as it's done, so the replies may come out of order.
+// "!cancel <id>" stops capturing the frames of a tagged request, and it replies "ERR #<id> cancelled"
+// once the frames already captured are done with. Their files may still be written.
+//
+// With --listen, every client is served like stdin, on a reader thread of its own. The untagged requests
+// of a client are served one at a time, but along with the requests of the other clients; the ids are
+// per client. kMaxRequestsInFlight is shared by all clients, and so is !sync, which waits for the frames
+// of everyone. A client, which disconnects, cancels its tagged requests.
+struct Request {
+  std::string prefix;
+  // 0 means a single frame request in the original format.
+  int frames = 0;
+  int stride = 1;
+  bool burst = false;
+  bool pack = false;
+  bool shm = false;
+  // T of shm=T.
+  uint32_t shm_token = 0;
+  bool if_changed = false;
+  bool depth_preview = false;
+  int priority = kPriorityBulk;
+  Crop crop;
+  std::string meta;
+};
+
+// Returns the mask of the outputs every frame of the request has.
+unsigned request_outputs(const Request& req) {
+  unsigned outputs = output_bit(kOutputColor);
+  if (!req.shm || !req.depth_preview) {
+    outputs |= output_bit(kOutputDepth);
+  }
+  if (flags.point_cloud != "none") {
+    outputs |= output_bit(kOutputPoints);
+  }
+  if (req.depth_preview) {
+    outputs |= output_bit(kOutputDepthPreview);
+  }
+  return outputs;
+}
+
+// Returns true, if the encoded frames of the request are kept in memory instead of being written to files.
+bool in_memory(const Request& req) {
+  return req.pack || req.shm;
+}
+
+bool parse_request(const std::string& line, Request* req, std::string* err) {
+  std::string opts = line;
+  size_t meta_pos = line.find(" meta=");
+  if (meta_pos != std::string::npos) {
+    req->meta = line.substr(meta_pos + strlen(" meta="));
+    opts = line.substr(0, meta_pos);
+  }
+  std::istringstream in(opts);
+  if (!(in >> req->prefix)) {
+    *err = "empty request";
+    return false;
+  }
+  std::string opt;
+  while (in >> opt) {
+    size_t eq = opt.find('=');
+    if (eq == std::string::npos) {
+      *err = "option " + opt + " is not in the key=value format";
+      return false;
+    }
+    std::string key = opt.substr(0, eq);
+    std::string value = opt.substr(eq + 1);
+    if (key == "roi") {
+      Crop& c = req->crop;
+      char tail;
+      if (sscanf(value.c_str(), "%d,%d,%d,%d%c", &c.x, &c.y, &c.width, &c.height, &tail) != 4 || c.x < 0 ||
+          c.y < 0 || c.width <= 0 || c.height <= 0 || c.x + c.width > flags.color.width ||
+          c.y + c.height > flags.color.height) {
+        *err = "roi must be X,Y,W,H within the color frame";
+        return false;
+      }
+      continue;
+    }
+    char* end = nullptr;
+    long num = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') {
+      *err = "option " + key + " is not an integer";
+      return false;
+    }
+    if (key == "frames") {
+      if (num < 1 || num > kMaxBatchFrames) {
+        *err = "frames is out of range";
+        return false;
+      }
+      req->frames = num;
+    } else if (key == "stride") {
+      if (num < 1) {
+        *err = "stride must be positive";
+        return false;
+      }
+      req->stride = num;
+    } else if (key == "burst") {
+      req->burst = num != 0;
+    } else if (key == "pack") {
+      req->pack = num != 0;
+    } else if (key == "shm") {
+      if (num < 0 || num > UINT32_MAX) {
+        *err = "shm must be 0 or a 32-bit request token";
+        return false;
+      }
+      req->shm = num != 0;
+      req->shm_token = num;
+    } else if (key == "if_changed") {
+      req->if_changed = num != 0;
+    } else if (key == "depth_preview") {
+      req->depth_preview = num != 0;
+    } else if (key == "priority") {
+      if (num < 0 || num >= kNumPriorities) {
+        *err = "priority must be 0 (bulk) or 1 (interactive)";
+        return false;
+      }
+      req->priority = num;
+    } else if (key == "scale") {
+      if (num < 1 || num > kMaxDecimation) {
+        *err = "scale is out of range";
+        return false;
+      }
+      req->crop.scale = num;
+    } else {
+      *err = "unknown option " + key;
+      return false;
+    }
+  }
+  if (!req->meta.empty() && !req->pack) {
+    *err = "meta requires pack=1";
+    return false;
+  }
+  int div = req->crop.scale * flags.decimation;
+  if ((req->crop.width ? req->crop.width : flags.color.width) < div ||
+      (req->crop.height ? req->crop.height : flags.color.height) < div) {
+    *err = "roi is too small for the scale";
+    return false;
+  }
+  if (req->shm && (flags.shm.empty() || req->pack)) {
+    *err = "shm requires --shm, and it can't be combined with pack=1";
+    return false;
+  }
+  if (req->burst && (req->frames == 0 || req->frames > flags.max_burst_frames)) {
+    *err = "burst requires frames in [1, --max_burst_frames]";
+    return false;
+  }
+  if (req->depth_preview && req->pack) {
+    *err = "depth_preview can't be combined with pack=1";
+    return false;
+  }
+  if (req->if_changed && req->frames != 0) {
+    *err = "if_changed is only for single frame requests";
+    return false;
+  }
+  return true;
+}
+
+// Returns the part of the file names, which is specific to the camera and the frame:
+// "front-03-", "03-" or nothing.
+std::string frame_tag(const Request& req, const Camera& cam, int index) {
+  std::string tag;
+  if (!cam.name.empty()) {
+    tag = cam.name + "-";
+  }
+  if (req.frames == 0) {
+    return tag;
+  }
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%02d-", index);
+  return tag + buf;
+}
+
+// Only called by the request thread. The result is valid until the next call: the buffer is reused,
+// so that the frames don't allocate a string each.
+const std::string& frame_prefix(const Request& req, const Camera& cam, int index) {
+  static std::string prefix;
+  prefix.assign(req.prefix).append(frame_tag(req, cam, index));
+  return prefix;
+}
+
+// Holds the records of the last pack written, until the next one. Only used by the finisher thread.
+PackWriter pack_writer;
+
+// The camera names are checked against kMaxCameraName, so the record names always fit.
+void add_pack_record(PackRecordType type, int frame, const std::string& name, const uint8_t* data, size_t size) {
+  if (!pack_writer.add(type, frame, name, data, size)) {
+    fprintf(stderr, "Pack record name %s is longer than %zu\n", name.c_str(), kPackMaxName);
+    fail("Failed to save pack");
+  }
+}
+
+// Writes the encoded frames and the metadata of a pack request to <prefix>pack.rspack.
+// frames holds num_frames frames of every camera, camera by camera. Returns the time spent writing.
+uint64_t write_pack(const Request& req, const std::vector<std::unique_ptr<Camera>>& cameras,
+                    const EncodedFrame* frames, int num_frames) {
+  uint64_t start = now_us();
+  pack_writer.clear();
+  size_t bytes = req.meta.size();
+  if (!req.meta.empty()) {
+    add_pack_record(kPackMeta, 0, "meta.json", reinterpret_cast<const uint8_t*>(req.meta.data()), req.meta.size());
+  }
+  for (size_t c = 0; c < cameras.size(); c++) {
+    for (int i = 0; i < num_frames; i++) {
+      std::string tag = frame_tag(req, *cameras[c], i);
+      const EncodedFrame& f = frames[c * num_frames + i];
+      add_pack_record(kPackColor, i, tag + "color.jpg", f.data[kOutputColor].data(), f.size[kOutputColor]);
+      add_pack_record(kPackDepth, i, depth_fname(tag), f.data[kOutputDepth].data(), f.size[kOutputDepth]);
+      if (flags.point_cloud != "none") {
+        add_pack_record(kPackPoints, i, tag + "points.pc16", f.data[kOutputPoints].data(), f.size[kOutputPoints]);
+      }
+      bytes += f.size[kOutputColor] + f.size[kOutputDepth] + f.size[kOutputPoints];
+    }
+  }
+  uint64_t cpu_start = thread_cpu_us();
+  if (!pack_writer.write(req.prefix + "pack.rspack", flags.durability != kDurabilityNone)) {
+    fail("Failed to save pack");
+  }
+  process_metrics.add_cpu(kStageWrite, thread_cpu_us() - cpu_start);
+  process_metrics.bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+  return now_us() - start;
+}
+
+// Upload stream of the packs, if --upload_socket is set.
+std::unique_ptr<UploadStream> upload_stream;
+
+// Tees the pack write_pack has just written into the upload stream. The frames must not have been reused yet.
+// Returns the upload key of the OK line, or an empty string, if the stream has no client.
+std::string upload_pack(const Request& req, Timings* t) {
+  uint64_t start = now_us();
+  uint64_t cpu_start = thread_cpu_us();
+  static std::vector<iovec> iov;
+  uint64_t size = pack_writer.layout(&iov);
+  uint64_t id = upload_stream->submit(req.prefix + "pack.rspack", iov, size);
+  process_metrics.add_cpu(kStageUpload, thread_cpu_us() - cpu_start);
+  t->us[kStageUpload] += now_us() - start;
+  if (id == 0) {
+    return "";
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), " upload=%llu", static_cast<unsigned long long>(id));
+  return buf;
+}
+
+// Shared-memory ring for the shm=1 requests, if --shm is set.
+std::unique_ptr<ShmFrameRing> shm_ring;
+
+// Publishes the encoded frames of a shm request. frames are laid out as in write_pack.
+// With depth_preview=1, the depth previews go in place of the depth images.
+// Returns the shm key of the OK line, or an empty string, if a frame doesn't fit into a slot.
+std::string publish_shm(const Request& req, const std::vector<std::unique_ptr<Camera>>& cameras,
+                        const EncodedFrame* frames, int num_frames) {
+  uint32_t first = 0;
+  uint32_t count = cameras.size() * num_frames;
+  Output depth = req.depth_preview ? kOutputDepthPreview : kOutputDepth;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    for (int i = 0; i < num_frames; i++) {
+      uint32_t index = c * num_frames + i;
+      const EncodedFrame& f = frames[index];
+      uint32_t id = shm_ring->publish(req.shm_token, index, count, frame_tag(req, *cameras[c], i), f.frame_number,
+                                      f.timestamp, f.data[kOutputColor].data(), f.size[kOutputColor],
+                                      f.data[depth].data(), f.size[depth]);
+      if (id == 0) {
+        return "";
+      }
+      process_metrics.bytes_published.fetch_add(f.size[kOutputColor] + f.size[depth], std::memory_order_relaxed);
+      if (first == 0) {
+        first = id;
+      }
+    }
+  }
+  char buf[48];
+  snprintf(buf, sizeof(buf), " shm=%u:%u", first, count);
+  return buf;
+}
+
+// A request on its way from the reader through the serving thread and the encoders to the finisher thread.
+struct PendingRequest {
+  Request req;
+  // Kept open, until the request is replied to.
+  std::shared_ptr<Client> client;
+  // Empty for an untagged request, " #<id>" for a tagged one: the id as it goes on the reply lines.
+  std::string id;
+  Batch batch;
+  // Encoder outputs of a pack or shm request: the frames of every camera, camera by camera.
+  // The buffers are reused by the next requests, which get this PendingRequest.
+  std::vector<EncodedFrame> frames;
+  std::atomic<bool> cancelled{false};
+  // When the request was read.
+  uint64_t start_us = 0;
+  // Timings of the frames, which nobody waits for: only the capture side is known by the reply.
+  Timings unwaited;
+  // Only for the untagged requests, which the reader waits for.
+  bool done = false;
+  // The frames and the scores of an if_changed=1 request.
+  std::vector<FrameSlot*> slots;
+  std::vector<uint64_t> wait_us;
+  bool unchanged = false;
+  ChangeScore change;
+  // Of the frames of an interactive request, if it's reduced by --busy_scale. 0 otherwise.
+  int busy_scale = 0;
+};
+
+// Max number of requests in flight. Reading a request blocks, while that many are.
+const int kMaxRequestsInFlight = 16;
+
+// RequestTable owns a fixed pool of PendingRequests and knows the tagged ones in flight by their ids.
+// Thread-safe.
+class RequestTable {
+ public:
+  RequestTable() {
+    for (int i = 0; i < kMaxRequestsInFlight; i++) {
+      all_.emplace_back(new PendingRequest);
+      free_.push_back(all_.back().get());
+    }
+    in_flight_.reserve(kMaxRequestsInFlight);
+  }
+
+  // Returns a request for the next line. Blocks, while all requests are in flight.
+  PendingRequest* get() {
+    std::unique_lock<std::mutex> lock(mu_);
+    free_cv_.wait(lock, [this] { return !free_.empty(); });
+    PendingRequest* r = free_.back();
+    free_.pop_back();
+    r->req = Request();
+    r->id.clear();
+    r->cancelled = false;
+    r->unwaited = Timings();
+    r->done = false;
+    r->unchanged = false;
+    r->change = ChangeScore();
+    r->busy_scale = 0;
+    return r;
+  }
+
+  // Registers a tagged request. Returns false, if a request of the same client with the same id is in flight.
+  bool add(PendingRequest* r) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (PendingRequest* other : in_flight_) {
+      if (other->client == r->client && other->id == r->id) {
+        return false;
+      }
+    }
+    in_flight_.push_back(r);
+    return true;
+  }
+
+  // Marks the tagged request of the client with the id, as on the reply lines, cancelled.
+  // Does nothing, if it's not in flight. An empty id cancels all tagged requests of the client.
+  void cancel(const Client* client, const std::string& id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (PendingRequest* r : in_flight_) {
+      if (r->client.get() == client && (id.empty() || r->id == id)) {
+        r->cancelled = true;
+      }
+    }
+  }
+
+  // Called once the reply to r is out. A tagged request goes back to the pool right away,
+  // an untagged one once the reader is done waiting for it.
+  void done(PendingRequest* r) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (r->id.empty()) {
+      r->done = true;
+      done_cv_.notify_all();
+      return;
+    }
+    in_flight_.erase(std::find(in_flight_.begin(), in_flight_.end(), r));
+    put_back(r);
+  }
+
+  // Waits until the untagged request is done, and puts it back into the pool.
+  void wait(PendingRequest* r) {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_cv_.wait(lock, [r] { return r->done; });
+    put_back(r);
+  }
+
+  // The request could not even be served: puts it back into the pool.
+  void release(PendingRequest* r) {
+    std::lock_guard<std::mutex> lock(mu_);
+    put_back(r);
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable free_cv_;
+  std::condition_variable done_cv_;
+  std::vector<std::unique_ptr<PendingRequest>> all_;
+  std::vector<PendingRequest*> free_;
+  // Tagged requests, which are not done yet.
+  std::vector<PendingRequest*> in_flight_;
+
+  // mu_ must be held.
+  void put_back(PendingRequest* r) {
+    // The last request of a client, which is gone, closes its connection.
+    r->client.reset();
+    free_.push_back(r);
+    free_cv_.notify_one();
+  }
+};
+
+RequestTable requests;
+
+// ServeQueue holds the requests waiting for the serving thread. The interactive ones overtake the bulk ones.
+// Thread-safe. It never holds more than kMaxRequestsInFlight requests, so it never allocates after construction.
+class ServeQueue {
+ public:
+  ServeQueue() {
+    for (auto& waiting : waiting_) {
+      waiting.reserve(kMaxRequestsInFlight);
+    }
+  }
+
+  void push(PendingRequest* r) {
+    std::lock_guard<std::mutex> lock(mu_);
+    waiting_[r->req.priority].push_back(r);
+    cv_.notify_one();
+  }
+
+  // Returns the first request of the highest priority.
+  PendingRequest* pop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (1) {
+      for (int p = kNumPriorities - 1; p >= 0; p--) {
+        if (!waiting_[p].empty()) {
+          return take(p);
+        }
+      }
+      cv_.wait(lock);
+    }
+  }
+
+  // Number of the requests waiting for the serving thread.
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return waiting_[kPriorityBulk].size() + waiting_[kPriorityInteractive].size();
+  }
+
+  // Returns the first interactive request, or nullptr, if there are none.
+  PendingRequest* try_pop_interactive() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return waiting_[kPriorityInteractive].empty() ? nullptr : take(kPriorityInteractive);
+  }
+
+ private:
+  // mu_ must be held.
+  PendingRequest* take(int priority) {
+    std::vector<PendingRequest*>& waiting = waiting_[priority];
+    PendingRequest* r = waiting.front();
+    waiting.erase(waiting.begin());
+    return r;
+  }
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<PendingRequest*> waiting_[kNumPriorities];
+};
+
+// Formats the burst keys of a FRAME line for the frames of the same index from all cameras.
+std::string burst_frame_info(const std::vector<std::unique_ptr<Camera>>& cameras, int index) {
+  std::string res;
+  double min_ts = 0, max_ts = 0;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    const Camera& cam = *cameras[c];
+    const FrameSlot* slot = cam.burst->slot(index);
+    std::string key_prefix = cam.name.empty() ? "" : cam.name + ".";
+    char buf[160];
+    snprintf(buf, sizeof(buf), " %sfn=%llu %sts=%.3f %sskew=%.3f", key_prefix.c_str(), slot->frame_number,
+             key_prefix.c_str(), slot->timestamp, key_prefix.c_str(), slot->timestamp - slot->depth_timestamp);
+    res += buf;
+    if (c == 0 || slot->timestamp < min_ts) {
+      min_ts = slot->timestamp;
+    }
+    if (c == 0 || slot->timestamp > max_ts) {
+      max_ts = slot->timestamp;
+    }
+  }
+  if (cameras.size() > 1) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), " sync_skew=%.3f", max_ts - min_ts);
+    res += buf;
+  }
+  return res;
+}
+
+// Collects req.frames consecutive framesets from every camera, and then hands them to the encoder.
+// The bursts of all cameras are armed at once, so they cover the same stretch of time.
+void serve_burst(const Request& req, const std::vector<std::unique_ptr<Camera>>& cameras, EncodeStage* encoder,
+                 const Crop& crop, EncodedFrame* pack_frames, Batch* batch) {
+  uint64_t start = now_us();
+  for (auto& cam : cameras) {
+    cam->burst->arm(req.frames);
+  }
+  for (auto& cam : cameras) {
+    cam->burst->wait();
+  }
+  uint64_t wait_us = now_us() - start;
+  for (int i = 0; i < req.frames; i++) {
+    batch->set_frame_info(i, burst_frame_info(cameras, i));
+  }
+  for (size_t c = 0; c < cameras.size(); c++) {
+    Camera* cam = cameras[c].get();
+    for (int i = 0; i < req.frames; i++) {
+      FrameSlot* slot = cam->burst->slot(i);
+      if (i > 0 && slot->frame_number != cam->burst->slot(i - 1)->frame_number + 1) {
+        fprintf(stderr, "Camera %s: burst frames %llu and %llu are not consecutive\n", cam->name.c_str(),
+                cam->burst->slot(i - 1)->frame_number, slot->frame_number);
+      }
+      align_slot(cam->lazy_aligner.get(), slot);
+      EncodedFrame* encoded = pack_frames ? &pack_frames[c * req.frames + i] : nullptr;
+      // The whole wait for the burst is accounted to its first frame.
+      encoder->submit(nullptr, slot, cam->depth_scale, cam->color_intrinsics, frame_prefix(req, *cam, i), crop,
+                      encoded, batch, i, i == 0 ? wait_us : 0, request_outputs(req),
+                      req.priority == kPriorityInteractive);
+    }
+  }
+}
+
+// Compares the frames of an if_changed=1 request with the references of their cameras, and makes them
+// the new references, if any of them has changed.
+bool frames_changed(PendingRequest* r, const std::vector<std::unique_ptr<Camera>>& cameras) {
+  const Crop& crop = r->req.crop;
+  ChangeRegion region;
+  region.x = crop.x;
+  region.y = crop.y;
+  region.width = crop.width ? crop.width : flags.color.width;
+  region.height = crop.height ? crop.height : flags.color.height;
+  bool changed = false;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    const FrameSlot* slot = r->slots[c];
+    ChangeScore score;
+    changed |= cameras[c]->change->compare(slot->color_data, slot->color_stride, flags.color.width,
+                                           reinterpret_cast<const uint16_t*>(slot->depth_data), slot->depth_stride,
+                                           slot->depth_width, cameras[c]->depth_scale, region, &score);
+    r->change.color_sad = std::max(r->change.color_sad, score.color_sad);
+    r->change.depth_moved = std::max(r->change.depth_moved, score.depth_moved);
+  }
+  if (changed) {
+    for (auto& cam : cameras) {
+      cam->change->keep();
+    }
+  }
+  return changed;
+}
+
+// Captures all frames of the request and hands them to the encoders. The frames are encoded in parallel,
+// while the next ones are being captured. Once they are all done, the request goes to the finisher thread.
+// The reply carries the timings of the request, summed over its frames (see stats.h).
+//
+// The cameras run freely, so the frames of the same index are taken from all cameras back to back:
+// each one is the latest frame of its camera at that moment, and they are at most a frame period apart.
+//
+// Runs on the serving thread, one request at a time: the frames of the next request are captured,
+// while this one is being encoded. The interactive requests, which come meanwhile, are served between
+// the frames of a bulk request.
+void serve_request(PendingRequest* r, const std::vector<std::unique_ptr<Camera>>& cameras, EncodeStage* encoder,
+                   ServeQueue* queue, BoundedQueue<PendingRequest*>* finished) {
+  const Request& req = r->req;
+  int num_frames = std::max(req.frames, 1);
+  int num_cameras = cameras.size();
+  bool interactive = req.priority == kPriorityInteractive;
+  Crop crop = req.crop;
+  if (interactive && encoder->busy() && flags.busy_scale > crop.scale) {
+    int div = flags.busy_scale * flags.decimation;
+    int width = crop.width ? crop.width : flags.color.width;
+    int height = crop.height ? crop.height : flags.color.height;
+    if (width >= div && height >= div) {
+      crop.scale = flags.busy_scale;
+      r->busy_scale = flags.busy_scale;
+    }
+  }
+  // In the pipelined mode, a single-frame request is acknowledged as soon as
+  // its frame is pinned and queued, so there's nothing to wait for.
+  // Packs and shm frames are written out only when all of the frames are encoded.
+  bool wait = req.frames > 0 || in_memory(req) || !flags.pipelined;
+  r->batch.reset(req.frames > 0, num_frames, num_cameras, r->client.get(), r->id);
+  EncodedFrame* pack_frames = nullptr;
+  if (in_memory(req)) {
+    if (r->frames.size() < static_cast<size_t>(num_frames * num_cameras)) {
+      r->frames.resize(num_frames * num_cameras);
+    }
+    pack_frames = r->frames.data();
+  }
+  if (req.burst && !r->cancelled) {
+    serve_burst(req, cameras, encoder, crop, pack_frames, &r->batch);
+  }
+  r->slots.resize(num_cameras);
+  r->wait_us.resize(num_cameras);
+  for (int i = 0; i < num_frames && !req.burst && !r->cancelled; i++) {
+    if (i > 0 && !interactive) {
+      while (PendingRequest* next = queue->try_pop_interactive()) {
+        serve_request(next, cameras, encoder, queue, finished);
+      }
+    }
+    for (int c = 0; c < num_cameras; c++) {
+      Camera* cam = cameras[c].get();
+      uint64_t after_seq = cam->last_seq;
+      if (i > 0) {
+        after_seq += req.stride - 1;
+      } else if (interactive) {
+        // The latest frame, whether it's been served or not.
+        after_seq = 0;
+      } else if (flags.fresh_frames) {
+        after_seq = std::max(after_seq, cam->ring->latest_seq());
+      }
+      uint64_t acquire_start = now_us();
+      FrameSlot* slot = cam->ring->acquire(after_seq);
+      r->wait_us[c] = now_us() - acquire_start;
+      r->slots[c] = slot;
+      cam->last_seq = std::max(cam->last_seq, slot->seq);
+      align_slot(cam->lazy_aligner.get(), slot);
+    }
+    // The encoders never see the frames of an unchanged request, so the reply only has their capture side.
+    r->unchanged = req.if_changed && !frames_changed(r, cameras);
+    for (int c = 0; c < num_cameras; c++) {
+      Camera* cam = cameras[c].get();
+      FrameSlot* slot = r->slots[c];
+      if (!wait || r->unchanged) {
+        r->unwaited.add(slot->timings);
+        r->unwaited.us[kStageWait] += r->wait_us[c];
+      }
+      if (r->unchanged) {
+        cam->ring->release(slot);
+        continue;
+      }
+      EncodedFrame* encoded = pack_frames ? &pack_frames[c * num_frames + i] : nullptr;
+      encoder->submit(cam->ring.get(), slot, cam->depth_scale, cam->color_intrinsics, frame_prefix(req, *cam, i),
+                      crop, encoded, wait ? &r->batch : nullptr, i, r->wait_us[c], request_outputs(req), interactive);
+    }
+  }
+  r->batch.seal([r, finished] { finished->push(r); });
+  if (req.burst) {
+    // The next burst reuses the buffers.
+    r->batch.wait();
+  }
+}
+
+// Writes out the pack or the shm frames of a request, whose frames are all done, and replies to it.
+// Runs on the finisher thread, in the order the requests get done.
+void finish_request(PendingRequest* r, const std::vector<std::unique_ptr<Camera>>& cameras) {
+  const Request& req = r->req;
+  int num_frames = std::max(req.frames, 1);
+  if (r->cancelled) {
+    reply(r->client.get(), "ERR%s cancelled", r->id.c_str());
+    requests.done(r);
+    return;
+  }
+  Timings t = r->batch.wait();
+  t.add(r->unwaited);
+  std::string upload_key;
+  if (req.pack && !r->unchanged) {
+    t.us[kStageWrite] += write_pack(req, cameras, r->frames.data(), num_frames);
+    if (upload_stream) {
+      upload_key = upload_pack(req, &t);
+    }
+  }
+  std::string shm_key;
+  if (req.shm && !r->unchanged) {
+    uint64_t publish_start = now_us();
+    shm_key = publish_shm(req, cameras, r->frames.data(), num_frames);
+    t.us[kStageWrite] += now_us() - publish_start;
+    if (shm_key.empty()) {
+      reply(r->client.get(), "ERR%s encoded frame does not fit into a shared memory slot", r->id.c_str());
+      requests.done(r);
+      return;
+    }
+  }
+  Timings total;
+  total.us[kStageTotal] = now_us() - r->start_us;
+  stage_stats.record(total);
+  t.add(total);
+  char info[64] = "";
+  int n = 0;
+  if (r->busy_scale) {
+    n = snprintf(info, sizeof(info), " scale=%d", r->busy_scale);
+  }
+  if (req.if_changed) {
+    snprintf(info + n, sizeof(info) - n, " sad=%.2f depth_moved=%.3f", r->change.color_sad, r->change.depth_moved);
+  }
+  reply(r->client.get(), "%s%s%s%s%s%s", r->unchanged ? "UNCHANGED" : "OK", r->id.c_str(), shm_key.c_str(),
+        upload_key.c_str(), info, t.format().c_str());
+  requests.done(r);
+}
+
+void serve_loop(ServeQueue* queue, const std::vector<std::unique_ptr<Camera>>* cameras, EncodeStage* encoder,
+                BoundedQueue<PendingRequest*>* finished) {
+  while (1) {
+    serve_request(queue->pop(), *cameras, encoder, queue, finished);
+  }
+}
+
+void finish_loop(BoundedQueue<PendingRequest*>* finished, const std::vector<std::unique_ptr<Camera>>* cameras) {
+  while (1) {
+    finish_request(finished->pop(), *cameras);
+  }
+}
+
+// How often the metrics are written to --metrics_file.
+const int kMetricsIntervalMs = 1000;
+
+// MetricsCollector gathers the counters of the cameras and of the process, and the depths of the queues between
+// the stages, for the !metrics command and --metrics_file. The rates, like fps, are over the time since the
+// previous collect, whoever called it. Thread-safe. It allocates, so every collect shows up in the allocs of !stats.
+class MetricsCollector {
+ public:
+  MetricsCollector(const std::vector<std::unique_ptr<Camera>>* cameras, EncodeStage* encoder, ServeQueue* to_serve)
+      : cameras_(cameras),
+        encoder_(encoder),
+        to_serve_(to_serve),
+        start_us_(now_us()),
+        prev_us_(start_us_),
+        prev_received_(cameras->size()),
+        prev_bytes_(cameras->size()) {}
+
+  MetricsText collect() {
+    std::lock_guard<std::mutex> lock(mu_);
+    uint64_t now = now_us();
+    double interval = std::max<uint64_t>(now - prev_us_, 1) / 1e6;
+    prev_us_ = now;
+    const std::vector<std::unique_ptr<Camera>>& cameras = *cameras_;
+    MetricsText m;
+    m.add("uptime_seconds", "gauge", "Time since the capture started.", nullptr, "", (now - start_us_) / 1e6);
+    for (auto& cam : cameras) {
+      m.add("frames_received_total", "counter", "Framesets received from the camera.", "camera", cam->name,
+            cam->metrics.received.load(std::memory_order_relaxed));
+    }
+    for (auto& cam : cameras) {
+      m.add("frames_expected_total", "counter", "Framesets expected from the color frame numbers.", "camera",
+            cam->name, cam->metrics.expected.load(std::memory_order_relaxed));
+    }
+    for (auto& cam : cameras) {
+      // The capture thread may count another frameset in between the loads.
+      uint64_t expected = cam->metrics.expected.load(std::memory_order_relaxed);
+      uint64_t received = cam->metrics.received.load(std::memory_order_relaxed);
+      m.add("frames_missed_total", "counter", "Framesets lost by the camera, USB or librealsense.", "camera",
+            cam->name, expected > received ? expected - received : 0);
+    }
+    for (auto& cam : cameras) {
+      m.add("frames_dropped_total", "counter", "Framesets dropped, because the align stage or the ring was busy.",
+            "camera", cam->name, cam->metrics.dropped.load(std::memory_order_relaxed));
+    }
+    for (size_t c = 0; c < cameras.size(); c++) {
+      uint64_t received = cameras[c]->metrics.received.load(std::memory_order_relaxed);
+      m.add("fps", "gauge", "Framesets received per second.", "camera", cameras[c]->name,
+            (received - prev_received_[c]) / interval);
+      prev_received_[c] = received;
+    }
+    for (auto& cam : cameras) {
+      m.add("usb_bytes_total", "counter", "Bytes of the color and raw depth frames received.", "camera", cam->name,
+            cam->metrics.bytes.load(std::memory_order_relaxed));
+    }
+    for (size_t c = 0; c < cameras.size(); c++) {
+      uint64_t bytes = cameras[c]->metrics.bytes.load(std::memory_order_relaxed);
+      m.add("usb_bytes_per_second", "gauge", "Bytes of the frames received per second.", "camera", cameras[c]->name,
+            (bytes - prev_bytes_[c]) / interval);
+      prev_bytes_[c] = bytes;
+    }
+    for (auto& cam : cameras) {
+      int64_t exposure = cam->metrics.exposure_us.load(std::memory_order_relaxed);
+      if (exposure >= 0) {
+        m.add("exposure_seconds", "gauge", "Actual exposure of the latest color frame.", "camera", cam->name,
+              exposure / 1e6);
+      }
+    }
+    for (auto& cam : cameras) {
+      m.add("clock_drift_seconds", "gauge", "Camera timestamps ahead of the host clock since the first frameset.",
+            "camera", cam->name, cam->metrics.drift_us.load(std::memory_order_relaxed) / 1e6);
+    }
+    for (auto& cam : cameras) {
+      if (cam->aligner) {
+        m.add("align_queue_depth", "gauge", "Framesets waiting for the align thread.", "camera", cam->name,
+              cam->aligner->size());
+      }
+    }
+    m.add("serve_queue_depth", "gauge", "Requests waiting for the serving thread.", nullptr, "", to_serve_->size());
+    m.add("encode_queue_depth", "gauge", "Outputs waiting for an encoder thread.", nullptr, "", encoder_->queued());
+    m.add("write_queue_depth", "gauge", "Files waiting for the writer thread.", nullptr, "",
+          encoder_->queued_writes());
+    uint64_t written = process_metrics.bytes_written.load(std::memory_order_relaxed);
+    m.add("written_bytes_total", "counter", "Bytes of the files and packs written.", nullptr, "", written);
+    m.add("written_bytes_per_second", "gauge", "Bytes written per second.", nullptr, "",
+          (written - prev_written_) / interval);
+    prev_written_ = written;
+    m.add("shm_bytes_total", "counter", "Bytes of the frames published into the shared-memory ring.", nullptr, "",
+          process_metrics.bytes_published.load(std::memory_order_relaxed));
+    if (upload_stream) {
+      m.add("upload_queue_depth", "gauge", "Pack chunks waiting for the upload client.", nullptr, "",
+            upload_stream->queued());
+      m.add("upload_bytes_total", "counter", "Bytes of the compressed packs sent to the upload client.", nullptr, "",
+            upload_stream->bytes_sent());
+    }
+    for (int s = 0; s < kNumStages; s++) {
+      uint64_t us = process_metrics.stage_cpu_us[s].load(std::memory_order_relaxed);
+      if (us > 0) {
+        // Without the t_ of the timings.
+        m.add("stage_cpu_seconds_total", "counter", "CPU time of the threads spent in the stage.", "stage",
+              stage_name(static_cast<Stage>(s)) + 2, us / 1e6);
+      }
+    }
+    m.add("heap_allocations_total", "counter", "Heap allocations, see heap-stats.h.", nullptr, "",
+          heap_allocations());
+    return m;
+  }
+
+  // Writes the metrics to --metrics_file every kMetricsIntervalMs.
+  void write_loop() {
+    std::string tmp_fname = flags.metrics_file + ".tmp";
+    while (1) {
+      usleep(kMetricsIntervalMs * 1000);
+      std::string text = collect().prometheus();
+      if (!write_file(tmp_fname, reinterpret_cast<const uint8_t*>(text.data()), text.size(), false) ||
+          rename(tmp_fname.c_str(), flags.metrics_file.c_str()) != 0) {
+        perror(flags.metrics_file.c_str());
+      }
+    }
+  }
+
+ private:
+  const std::vector<std::unique_ptr<Camera>>* cameras_;
+  EncodeStage* encoder_;
+  ServeQueue* to_serve_;
+  uint64_t start_us_;
+  std::mutex mu_;
+  // The counters and the time of the previous collect.
+  uint64_t prev_us_;
+  std::vector<uint64_t> prev_received_;
+  std::vector<uint64_t> prev_bytes_;
+  uint64_t prev_written_ = 0;
+};
+
+// Splits the id off a tagged request line, "#<id> <request>", and sets r->id. Returns false, if the id is invalid.
+bool parse_id(std::string* line, PendingRequest* r) {
+  size_t end = line->find(' ');
+  std::string id = line->substr(1, end == std::string::npos ? std::string::npos : end - 1);
+  r->id = " #" + id;
+  line->erase(0, end == std::string::npos ? line->size() : end + 1);
+  if (id.empty() || id.size() > 32) {
+    return false;
+  }
+  for (char c : id) {
+    if (!isalnum(c) && c != '-' && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses a request line into r, and registers it, if it's tagged. Returns false and sets err, if the request
+// can't be served.
+bool accept_request(std::string* line, size_t num_cameras, PendingRequest* r, std::string* err) {
+  if (!line->empty() && (*line)[0] == '#' && !parse_id(line, r)) {
+    *err = "invalid request id";
+    return false;
+  }
+  if (!parse_request(*line, &r->req, err)) {
+    return false;
+  }
+  if (r->req.shm && std::max(r->req.frames, 1) * num_cameras > shm_ring->num_slots()) {
+    *err = "shm request does not fit into --shm_slots";
+    return false;
+  }
+  if (!r->id.empty() && !requests.add(r)) {
+    *err = "duplicate request id";
+    return false;
+  }
+  return true;
+}
+
+// Serves the requests of the client until it disconnects.
+void read_requests(std::shared_ptr<Client> client, size_t num_cameras, EncodeStage* encoder,
+                   ServeQueue* to_serve, MetricsCollector* metrics) {
+  LineReader reader(client->in_fd);
+  std::string line;
+  while (reader.next(&line)) {
+    if (line == "!sync") {
+      encoder->wait_idle();
+      reply(client.get(), "OK");
+      continue;
+    }
+    if (line == "!stats") {
+      // Rolling p50/p99 of every stage in ms, and the number of samples: t_wait=0.12/3.45/1024 ...
+      // allocs is the number of heap allocations of the process so far, see heap-stats.h.
+      reply(client.get(), "OK%s allocs=%llu", stage_stats.format().c_str(),
+            static_cast<unsigned long long>(heap_allocations()));
+      continue;
+    }
+    if (line == "!metrics") {
+      // The counters, gauges and rates of MetricsCollector, the camera name in front of the per-camera ones:
+      // uptime_seconds=12.5 front.fps=29.97 ... color.stage_cpu_seconds_total=1.25 ...
+      reply(client.get(), "OK%s", metrics->collect().line().c_str());
+      continue;
+    }
+    if (line.compare(0, 8, "!cancel ") == 0) {
+      // No reply of its own: the request replies "ERR #<id> cancelled", unless it's done already.
+      requests.cancel(client.get(), " #" + line.substr(8));
+      continue;
+    }
+    if (!line.empty() && line[0] == '!') {
+      reply(client.get(), "ERR unknown command %s", line.c_str());
+      continue;
+    }
+    PendingRequest* r = requests.get();
+    r->client = client;
+    r->start_us = now_us();
+    std::string err;
+    if (!accept_request(&line, num_cameras, r, &err)) {
+      reply(client.get(), "ERR%s %s", r->id.c_str(), err.c_str());
+      requests.release(r);
+      continue;
+    }
+    to_serve->push(r);
+    // Untagged requests are served one at a time, as they always were.
+    if (r->id.empty()) {
+      requests.wait(r);
+    }
+  }
+  // Nobody is going to read the replies.
+  requests.cancel(client.get(), "");
+}
+
+int main(int argc, char** argv) {
+  parse_flags(argc, argv);
+  // Make sure the encoder is available before opening the camera.
+  create_color_encoder(flags.jpeg_quality);
+  // Bound before the cameras are opened, so that a second daemon fails right away, and the clients can connect
+  // at once: their requests wait in the socket buffers, until the cameras are warm.
+  int listen_fd = -1;
+  if (!flags.listen.empty()) {
+    std::string err;
+    listen_fd = listen_unix_socket(flags.listen, 16, &err);
+    if (listen_fd < 0) {
+      fprintf(stderr, "--listen=%s: %s\n", flags.listen.c_str(), err.c_str());
+      fail("Failed to create the request socket");
+    }
+  }
+
+  // Also before the cameras: the ring of a previous run, if it's still there, is replaced early.
+  if (!flags.shm.empty()) {
+    // Room for the raw color and depth, which an encoded image practically never exceeds, and the headers.
+    size_t pixels = flags.color.width * flags.color.height;
+    uint32_t slot_size = sizeof(ShmSlotHeader) + pixels * 5 + 64 * 1024;
+    std::string err;
+    shm_ring = ShmFrameRing::create(flags.shm, flags.shm_slots, slot_size, &err);
+    if (!shm_ring) {
+      fprintf(stderr, "--shm=%s: %s\n", flags.shm.c_str(), err.c_str());
+      fail("Failed to create the shared memory ring");
+    }
+  }
+
+  std::vector<std::unique_ptr<Camera>> cameras = list_cameras();
+  for (size_t i = 0; i < cameras.size(); i++) {
+    open_camera(cameras[i].get(), i);
+  }
+  // Skip first few frames to make sure we have a stable image. The cameras warm up in parallel.
+  std::vector<std::thread> warmups;
+  for (auto& cam : cameras) {
+    warmups.emplace_back(warm_up, &cam->pipe, cam->filters.get());
+  }
+  for (std::thread& t : warmups) {
+    t.join();
+  }
+  int encode_threads = flags.encode_threads;
+  if (encode_threads == 0) {
+    encode_threads = std::max(1, std::min(4, static_cast<int>(std::thread::hardware_concurrency())));
+  }
+  EncodeStage encoder(flags.encode_queue * cameras.size(), encode_threads);
+  std::unique_ptr<PreviewStream> preview;
+  if (!flags.preview.socket_path.empty()) {
+    std::string err;
+    preview = PreviewStream::create(flags.preview, cameras.size(), &err);
+    if (!preview) {
+      fprintf(stderr, "--preview_socket=%s: %s\n", flags.preview.socket_path.c_str(), err.c_str());
+      fail("Failed to create the preview socket");
+    }
+    for (auto& cam : cameras) {
+      cam->preview.reset(new PreviewSource(preview.get(), cam->name, cam->depth_scale));
+    }
+    preview->start();
+  }
+  if (!flags.upload.socket_path.empty()) {
+    std::string err;
+    upload_stream = UploadStream::create(flags.upload, &err);
+    if (!upload_stream) {
+      fprintf(stderr, "--upload_socket=%s: %s\n", flags.upload.socket_path.c_str(), err.c_str());
+      fail("Failed to create the upload socket");
+    }
+    upload_stream->start();
+  }
+  for (auto& cam : cameras) {
+    start_capture(cam.get());
+  }
+  ServeQueue to_serve;
+  BoundedQueue<PendingRequest*> finished(kMaxRequestsInFlight);
+  std::thread(serve_loop, &to_serve, &cameras, &encoder, &finished).detach();
+  std::thread(finish_loop, &finished, &cameras).detach();
+  MetricsCollector metrics(&cameras, &encoder, &to_serve);
+  if (!flags.metrics_file.empty()) {
+    std::thread(&MetricsCollector::write_loop, &metrics).detach();
+  }
+
+  if (listen_fd < 0) {
+    read_requests(std::make_shared<Client>(0, 1), cameras.size(), &encoder, &to_serve, &metrics);
+    if (shm_ring) {
+      shm_ring->unlink();
+    }
+    fail("Failed to read from stdin");
+  }
+  fprintf(stderr, "Serving requests on %s\n", flags.listen.c_str());
+  while (1) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      perror("accept");
+      sleep(1);
+      continue;
     }
-    printf("OK\n");
-    fflush(stdout);
-    out_prefix = "";
+    std::thread(read_requests, std::make_shared<Client>(fd, fd), cameras.size(), &encoder, &to_serve, &metrics)
+        .detach();
   }
   return 0;
 }
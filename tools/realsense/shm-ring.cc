@@ -0,0 +1,95 @@
+#include "shm-ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::unique_ptr<ShmFrameRing> ShmFrameRing::create(const std::string& name, uint32_t num_slots, uint32_t slot_size,
+                                                   std::string* err) {
+  std::string shm_name = name[0] == '/' ? name : "/" + name;
+  if (slot_size <= sizeof(ShmSlotHeader) || num_slots == 0) {
+    *err = "invalid ring size";
+    return nullptr;
+  }
+  // Slots start at a cache line, so that the headers of different slots never share one.
+  slot_size = (slot_size + 63) & ~63u;
+  size_t size = sizeof(ShmRingHeader) + static_cast<size_t>(num_slots) * slot_size;
+  // Start from scratch: a reader of the old ring must not see the slots of the new one as valid.
+  shm_unlink(shm_name.c_str());
+  int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    *err = std::string("shm_open: ") + strerror(errno);
+    return nullptr;
+  }
+  if (ftruncate(fd, size) != 0) {
+    *err = std::string("ftruncate: ") + strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    *err = std::string("mmap: ") + strerror(errno);
+    return nullptr;
+  }
+  // ftruncate zero-fills the object, so all slots start empty, with even seqs.
+  ShmRingHeader* header = static_cast<ShmRingHeader*>(base);
+  header->version = kShmRingVersion;
+  header->num_slots = num_slots;
+  header->slot_size = slot_size;
+  header->published = 0;
+  header->pid = getpid();
+  // The magic goes last: a reader, which sees it, sees the rest of the header too.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, "RSSHM\0\0\0", sizeof(header->magic));
+  return std::unique_ptr<ShmFrameRing>(new ShmFrameRing(shm_name, static_cast<uint8_t*>(base), size));
+}
+
+ShmFrameRing::ShmFrameRing(const std::string& shm_name, uint8_t* base, size_t size)
+    : shm_name_(shm_name), base_(base), size_(size), header_(reinterpret_cast<ShmRingHeader*>(base)) {}
+
+ShmFrameRing::~ShmFrameRing() {
+  munmap(base_, size_);
+}
+
+void ShmFrameRing::unlink() {
+  shm_unlink(shm_name_.c_str());
+}
+
+uint32_t ShmFrameRing::publish(uint32_t request, uint32_t index, uint32_t count, const std::string& tag,
+                               uint64_t frame_number, double timestamp, const uint8_t* color, size_t color_size,
+                               const uint8_t* depth, size_t depth_size) {
+  if (sizeof(ShmSlotHeader) + color_size + depth_size > header_->slot_size) {
+    return 0;
+  }
+  uint32_t id = next_id_++;
+  uint8_t* slot = base_ + sizeof(ShmRingHeader) + static_cast<size_t>((id - 1) % header_->num_slots) *
+                                                      header_->slot_size;
+  ShmSlotHeader* h = reinterpret_cast<ShmSlotHeader*>(slot);
+  uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+  // No write below may become visible before the odd seq.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&h->id, id, __ATOMIC_RELAXED);
+  h->frame_number = frame_number;
+  h->timestamp = timestamp;
+  h->color_size = color_size;
+  h->depth_size = depth_size;
+  memset(h->tag, 0, sizeof(h->tag));
+  strncpy(h->tag, tag.c_str(), sizeof(h->tag) - 1);
+  h->request = request;
+  h->index = index;
+  h->count = count;
+  memcpy(slot + sizeof(ShmSlotHeader), color, color_size);
+  memcpy(slot + sizeof(ShmSlotHeader) + color_size, depth, depth_size);
+  __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&header_->published, id, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &header_->published, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  return id;
+}
@@ -0,0 +1,97 @@
+#ifndef REALSENSE_SHM_RING_H_
+#define REALSENSE_SHM_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+// Shared-memory ring of encoded frames, /dev/shm/<name>. Lets a reader on the same machine take the
+// JPEG and PNG/z16 bytes of a snapshot straight from memory, without going through the file system.
+// All fields are little-endian.
+//
+//   ShmRingHeader (64 bytes)
+//   num_slots slots, slot_size bytes each: ShmSlotHeader (128 bytes), the color image, the depth image.
+//
+// Frames are published one at a time by a single writer, with increasing publication ids starting at 1.
+// The frame with the id N is in the slot (N - 1) % num_slots, until it's overwritten by the frame N + num_slots.
+//
+// Every slot is guarded by a seqlock: seq is odd while the writer fills the slot. A reader reads seq,
+// copies the slot out and reads seq again. The copy is good, if both values are the same and even,
+// and the id in the slot is the one the reader wants. After a frame is published, ShmRingHeader::published
+// is set to its id, and the readers waiting on it with FUTEX_WAIT are woken up.
+//
+// The frames of a request are published one after another, with the token of the request in every slot:
+// a reader, which reads published before it sends the request, picks out its frames as they come,
+// without waiting for the reply.
+//
+// The ring of a process, which is gone, stays valid, if it didn't get to unlink it: a reader tells it
+// from the ring of a live writer by the pid in the header.
+struct ShmRingHeader {
+  char magic[8];  // "RSSHM\0\0\0"
+  uint32_t version;  // kShmRingVersion
+  uint32_t num_slots;
+  uint32_t slot_size;
+  // Id of the latest published frame, 0 if there's none yet. Futex word.
+  uint32_t published;
+  // Of the writer.
+  uint32_t pid;
+  uint32_t reserved[9];
+};
+
+static_assert(sizeof(ShmRingHeader) == 64, "ShmRingHeader must be 64 bytes");
+
+struct ShmSlotHeader {
+  uint32_t seq;
+  // Publication id of the frame in the slot, 0 if the slot has never been written.
+  uint32_t id;
+  uint64_t frame_number;
+  double timestamp;  // librealsense color frame timestamp, ms.
+  uint32_t color_size;
+  uint32_t depth_size;
+  // The part of the file names specific to the frame, see frame_tag in realsense-snapshot.cc:
+  // "front-03-", "03-" or nothing. NUL-terminated.
+  char tag[32];
+  // Token of the request, shm=<token>, the frame's index among the frames of the request, and their number.
+  uint32_t request;
+  uint32_t index;
+  uint32_t count;
+  uint32_t reserved[13];
+};
+
+static_assert(sizeof(ShmSlotHeader) == 128, "ShmSlotHeader must be 128 bytes");
+
+const uint32_t kShmRingVersion = 3;
+
+class ShmFrameRing {
+ public:
+  // Creates /dev/shm/<name>, replacing it, if it exists. Returns nullptr and sets err on failure.
+  static std::unique_ptr<ShmFrameRing> create(const std::string& name, uint32_t num_slots, uint32_t slot_size,
+                                              std::string* err);
+  // Leaves /dev/shm/<name> to the readers, which still have it mapped. See unlink.
+  ~ShmFrameRing();
+
+  // Removes /dev/shm/<name>, so that no reader maps it anymore. The ring stays usable by the writer.
+  void unlink();
+
+  // Copies the frame into the next slot and wakes up the readers. It's frame index out of count of the
+  // request with the token. Returns the publication id, or 0, if the images don't fit into a slot.
+  // tag is truncated to fit into ShmSlotHeader.
+  uint32_t publish(uint32_t request, uint32_t index, uint32_t count, const std::string& tag, uint64_t frame_number,
+                   double timestamp, const uint8_t* color, size_t color_size, const uint8_t* depth,
+                   size_t depth_size);
+
+  uint32_t num_slots() const { return header_->num_slots; }
+
+ private:
+  ShmFrameRing(const std::string& shm_name, uint8_t* base, size_t size);
+
+  std::string shm_name_;
+  uint8_t* base_;
+  size_t size_;
+  ShmRingHeader* header_;
+  uint32_t next_id_ = 1;
+};
+
+#endif  // REALSENSE_SHM_RING_H_
@@ -0,0 +1,91 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+namespace {
+
+const char* kStageNames[kNumStages] = {
+    "t_capture", "t_filter", "t_align", "t_copy", "t_wait", "t_color",
+    "t_depth", "t_points", "t_preview", "t_write", "t_upload", "t_total",
+};
+
+void append_ms(std::string* out, const char* name, uint64_t us) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %s=%.2f", name, us / 1000.0);
+  *out += buf;
+}
+
+}  // namespace
+
+const char* stage_name(Stage stage) {
+  return kStageNames[stage];
+}
+
+uint64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Timings::add(const Timings& other) {
+  for (int i = 0; i < kNumStages; i++) {
+    us[i] += other.us[i];
+  }
+}
+
+std::string Timings::format() const {
+  std::string res;
+  for (int i = 0; i < kNumStages; i++) {
+    if (us[i] > 0) {
+      append_ms(&res, kStageNames[i], us[i]);
+    }
+  }
+  return res;
+}
+
+void LatencyHistogram::record(uint64_t us) {
+  std::lock_guard<std::mutex> lock(mu_);
+  samples_[count_ % kWindow] = us;
+  count_++;
+}
+
+size_t LatencyHistogram::percentiles(uint64_t* p50, uint64_t* p99) const {
+  std::vector<uint64_t> sorted;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    sorted.assign(samples_.begin(), samples_.begin() + std::min(count_, kWindow));
+  }
+  size_t n = sorted.size();
+  if (n == 0) {
+    *p50 = 0;
+    *p99 = 0;
+    return 0;
+  }
+  std::sort(sorted.begin(), sorted.end());
+  *p50 = sorted[(n - 1) / 2];
+  *p99 = sorted[(n - 1) * 99 / 100];
+  return n;
+}
+
+void StageStats::record(const Timings& t) {
+  for (int i = 0; i < kNumStages; i++) {
+    if (t.us[i] > 0) {
+      hist_[i].record(t.us[i]);
+    }
+  }
+}
+
+std::string StageStats::format() const {
+  std::string res;
+  for (int i = 0; i < kNumStages; i++) {
+    uint64_t p50, p99;
+    size_t n = hist_[i].percentiles(&p50, &p99);
+    char buf[96];
+    snprintf(buf, sizeof(buf), " %s=%.2f/%.2f/%zu", kStageNames[i], p50 / 1000.0, p99 / 1000.0, n);
+    res += buf;
+  }
+  return res;
+}
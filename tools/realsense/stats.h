@@ -0,0 +1,72 @@
+#ifndef REALSENSE_STATS_H_
+#define REALSENSE_STATS_H_
+
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Stages of serving a snapshot. The names are the keys of the timings on the reply lines.
+enum Stage {
+  kStageCapture,  // t_capture: wait_for_frames in the capture thread.
+  kStageFilter,   // t_filter: the depth post-processing filters and the decimation.
+  kStageAlign,    // t_align: align.process.
+  kStageCopy,     // t_copy: copying the aligned frames into the ring.
+  kStageWait,     // t_wait: the request waiting for a frame from the ring.
+  kStageColor,    // t_color: JPEG encoding.
+  kStageDepth,    // t_depth: PNG or z16 encoding.
+  kStagePoints,   // t_points: point cloud deprojection.
+  kStagePreview,  // t_preview: colorizing and encoding the depth preview.
+  kStageWrite,    // t_write: writing the files to disk.
+  kStageUpload,   // t_upload: compressing a pack into the upload stream, and waiting for room in it.
+  kStageTotal,    // t_total: from reading the request to the reply.
+  kNumStages,
+};
+
+const char* stage_name(Stage stage);
+
+// Monotonic clock, microseconds.
+uint64_t now_us();
+
+// Stage durations, in microseconds.
+struct Timings {
+  uint64_t us[kNumStages] = {};
+
+  void add(const Timings& other);
+  // Formats the non-zero timings as " t_wait=1.23 t_align=4.56 ...", in milliseconds.
+  std::string format() const;
+};
+
+// LatencyHistogram keeps the last kWindow samples, so the percentiles follow the recent behavior
+// instead of averaging over the whole life of the process. Thread-safe.
+class LatencyHistogram {
+ public:
+  static const size_t kWindow = 1024;
+
+  LatencyHistogram() : samples_(kWindow) {}
+
+  void record(uint64_t us);
+  // Returns the number of samples in the window, and sets p50 and p99 in microseconds.
+  size_t percentiles(uint64_t* p50, uint64_t* p99) const;
+
+ private:
+  mutable std::mutex mu_;
+  std::vector<uint64_t> samples_;
+  // Total number of recorded samples, the window holds min(count_, kWindow) of them.
+  size_t count_ = 0;
+};
+
+// StageStats has a rolling histogram per stage.
+class StageStats {
+ public:
+  // Records the non-zero timings.
+  void record(const Timings& t);
+  // Formats all stages as " t_wait=p50/p99/n ...", with p50 and p99 in milliseconds.
+  std::string format() const;
+
+ private:
+  LatencyHistogram hist_[kNumStages];
+};
+
+#endif  // REALSENSE_STATS_H_
@@ -0,0 +1,95 @@
+#include "unix-socket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+int listen_unix_socket(const std::string& path, int backlog, std::string* err) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    *err = "socket path is too long";
+    return -1;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    *err = std::string("socket: ") + strerror(errno);
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+    *err = "another process is listening on the socket";
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    *err = std::string("socket: ") + strerror(errno);
+    return -1;
+  }
+  // Nobody listens on a socket left behind by a previous run.
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+    *err = std::string("bind: ") + strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    // MSG_NOSIGNAL only works for sockets. A pipe is written to as usual.
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) {
+      n = write(fd, data, size);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool LineReader::next(std::string* line) {
+  while (1) {
+    char* newline = static_cast<char*>(memchr(buf_.data() + begin_, '\n', end_ - begin_));
+    if (newline) {
+      line->assign(buf_.data() + begin_, newline);
+      begin_ = newline + 1 - buf_.data();
+      return true;
+    }
+    if (begin_ > 0) {
+      std::copy(buf_.begin() + begin_, buf_.begin() + end_, buf_.begin());
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    if (end_ == buf_.size()) {
+      buf_.resize(buf_.size() * 2);
+    }
+    ssize_t n = read(fd_, buf_.data() + end_, buf_.size() - end_);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0 && end_ > begin_) {
+      // The last line, without a newline, as std::getline has it.
+      line->assign(buf_.data() + begin_, buf_.data() + end_);
+      begin_ = end_ = 0;
+      return true;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    end_ += n;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef REALSENSE_UNIX_SOCKET_H_
+#define REALSENSE_UNIX_SOCKET_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Binds path and listens on it. A socket left behind by a previous run is replaced, but one that
+// another process still accepts connections on is not. Returns the listening fd, or -1 and sets err.
+int listen_unix_socket(const std::string& path, int backlog, std::string* err);
+
+// Writes all of data to a socket or a pipe. A closed socket peer is an error, not a SIGPIPE.
+// Returns false, if the peer is gone.
+bool write_all(int fd, const char* data, size_t size);
+
+// LineReader reads newline-terminated lines from a socket or a pipe. Not thread-safe.
+class LineReader {
+ public:
+  explicit LineReader(int fd) : fd_(fd), buf_(4096) {}
+
+  // Reads the next line without the newline. The last one may have none. Returns false at EOF or on error.
+  bool next(std::string* line);
+
+ private:
+  int fd_;
+  std::vector<char> buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+#endif  // REALSENSE_UNIX_SOCKET_H_
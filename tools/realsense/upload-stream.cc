@@ -0,0 +1,238 @@
+#include "upload-stream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "unix-socket.h"
+
+namespace {
+
+// zstd level 1 already takes most of what the depth records give, at a fraction of the CPU of the higher levels.
+const int kZstdLevel = 1;
+
+// Copies size bytes of iov, starting at iovec *pos and offset *pos_offset in it, into dst, and moves past them.
+void gather(const std::vector<iovec>& iov, size_t* pos, size_t* pos_offset, uint8_t* dst, size_t size) {
+  while (size > 0) {
+    const iovec& v = iov[*pos];
+    size_t n = std::min(size, v.iov_len - *pos_offset);
+    memcpy(dst, static_cast<const uint8_t*>(v.iov_base) + *pos_offset, n);
+    dst += n;
+    size -= n;
+    *pos_offset += n;
+    if (*pos_offset == v.iov_len) {
+      (*pos)++;
+      *pos_offset = 0;
+    }
+  }
+}
+
+}  // namespace
+
+struct UploadCompressor {
+  explicit UploadCompressor(Z16Compression compression) : compression(compression) {
+#ifdef HAVE_ZSTD
+    if (compression == kZ16Zstd) {
+      zstd = ZSTD_createCCtx();
+    }
+#endif
+  }
+
+  ~UploadCompressor() {
+#ifdef HAVE_ZSTD
+    if (zstd) {
+      ZSTD_freeCCtx(zstd);
+    }
+#endif
+  }
+
+  size_t bound(size_t size) const {
+    switch (compression) {
+#ifdef HAVE_LZ4
+      case kZ16Lz4:
+        return LZ4_compressBound(size);
+#endif
+#ifdef HAVE_ZSTD
+      case kZ16Zstd:
+        return ZSTD_compressBound(size);
+#endif
+      default:
+        return size;
+    }
+  }
+
+  // Compresses src into dst, which has room for bound(size) bytes. Returns 0 on failure.
+  size_t compress(const uint8_t* src, size_t size, uint8_t* dst) {
+    switch (compression) {
+#ifdef HAVE_LZ4
+      case kZ16Lz4: {
+        int n = LZ4_compress_default(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst), size,
+                                     bound(size));
+        return n > 0 ? n : 0;
+      }
+#endif
+#ifdef HAVE_ZSTD
+      case kZ16Zstd: {
+        size_t n = ZSTD_compressCCtx(zstd, dst, bound(size), src, size, kZstdLevel);
+        return ZSTD_isError(n) ? 0 : n;
+      }
+#endif
+      default:
+        // Without liblz4 and libzstd, nothing else uses them.
+        (void)src;
+        (void)size;
+        (void)dst;
+        return 0;
+    }
+  }
+
+  Z16Compression compression;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* zstd = nullptr;
+#endif
+};
+
+std::unique_ptr<UploadStream> UploadStream::create(const UploadOptions& opts, std::string* err) {
+  int fd = listen_unix_socket(opts.socket_path, 1, err);
+  if (fd < 0) {
+    return nullptr;
+  }
+  return std::unique_ptr<UploadStream>(new UploadStream(opts, fd));
+}
+
+UploadStream::UploadStream(const UploadOptions& opts, int listen_fd)
+    : opts_(opts),
+      listen_fd_(listen_fd),
+      free_(opts.chunks),
+      full_(opts.chunks),
+      compressor_(new UploadCompressor(opts.compression)) {
+  size_t capacity = sizeof(UploadChunkHeader) + std::max(opts_.chunk_size, compressor_->bound(opts_.chunk_size));
+  for (int i = 0; i < opts_.chunks; i++) {
+    chunks_.emplace_back(new Chunk);
+    chunks_.back()->data.resize(capacity);
+    free_.push(chunks_.back().get());
+  }
+  if (opts_.compression != kZ16None) {
+    raw_.resize(opts_.chunk_size);
+  }
+}
+
+UploadStream::~UploadStream() {
+  close(listen_fd_);
+  delete compressor_;
+}
+
+void UploadStream::start() {
+  std::thread(&UploadStream::run, this).detach();
+}
+
+uint64_t UploadStream::submit(const std::string& name, const std::vector<iovec>& iov, uint64_t size) {
+  if (!connected_.load()) {
+    return 0;
+  }
+  uint64_t client = client_.load();
+  uint64_t pack_id = next_pack_id_++;
+  // The end of the name, with the pack and the grasp directories, is what tells the packs apart.
+  const size_t max_name = sizeof(UploadChunkHeader::name) - 1;
+  const char* short_name = name.c_str() + (name.size() > max_name ? name.size() - max_name : 0);
+  size_t pos = 0;
+  size_t pos_offset = 0;
+  for (uint64_t offset = 0; offset < size;) {
+    // The backpressure: waits for the client to take a chunk, if all of them are queued. Once it's gone,
+    // the chunks of this pack, which are still queued, stay there until the next client connects.
+    Chunk* chunk = nullptr;
+    while (!free_.pop_for(&chunk, std::chrono::milliseconds(kUploadClientCheckMs))) {
+      if (!connected_.load() || client_.load() != client) {
+        return 0;
+      }
+    }
+    if (!connected_.load() || client_.load() != client) {
+      free_.push(chunk);
+      return 0;
+    }
+    UploadChunkHeader h = {};
+    memcpy(h.magic, "RSUP", sizeof(h.magic));
+    h.raw_size = std::min<uint64_t>(opts_.chunk_size, size - offset);
+    h.flags = (offset == 0 ? kUploadFirstChunk : 0) | (offset + h.raw_size == size ? kUploadLastChunk : 0);
+    h.pack_id = pack_id;
+    h.offset = offset;
+    h.pack_size = size;
+    strncpy(h.name, short_name, max_name);
+    fill(&h, iov, &pos, &pos_offset, chunk);
+    memcpy(chunk->data.data(), &h, sizeof(h));
+    chunk->size = sizeof(h) + h.size;
+    chunk->client = client;
+    full_.push(chunk);
+    offset += h.raw_size;
+  }
+  return pack_id;
+}
+
+void UploadStream::fill(UploadChunkHeader* h, const std::vector<iovec>& iov, size_t* pos, size_t* pos_offset,
+                        Chunk* chunk) {
+  uint8_t* payload = chunk->data.data() + sizeof(UploadChunkHeader);
+  h->compression = kZ16None;
+  h->size = h->raw_size;
+  if (opts_.compression == kZ16None) {
+    gather(iov, pos, pos_offset, payload, h->raw_size);
+    return;
+  }
+  // Both compressors want a contiguous input.
+  gather(iov, pos, pos_offset, raw_.data(), h->raw_size);
+  size_t n = compressor_->compress(raw_.data(), h->raw_size, payload);
+  if (n > 0 && n < h->raw_size) {
+    h->compression = opts_.compression;
+    h->size = n;
+  } else {
+    memcpy(payload, raw_.data(), h->raw_size);
+  }
+}
+
+void UploadStream::run() {
+  while (1) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      perror("upload: accept");
+      sleep(1);
+      continue;
+    }
+    struct timeval timeout = {kUploadSendTimeoutSec, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    fprintf(stderr, "Upload client connected\n");
+    uint64_t client = client_.fetch_add(1) + 1;
+    connected_.store(true);
+    while (1) {
+      Chunk* chunk = full_.pop();
+      // What was queued for a previous client is the tail of a pack it won't get to see the start of.
+      bool ok = true;
+      if (chunk->client == client) {
+        ok = write_all(fd, reinterpret_cast<const char*>(chunk->data.data()), chunk->size);
+        if (ok) {
+          bytes_sent_.fetch_add(chunk->size, std::memory_order_relaxed);
+        }
+      }
+      if (!ok) {
+        // Before the chunk is free: a submit, which gets it, must see the client is gone.
+        connected_.store(false);
+        free_.push(chunk);
+        break;
+      }
+      free_.push(chunk);
+    }
+    close(fd);
+    fprintf(stderr, "Upload client disconnected\n");
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef REALSENSE_UPLOAD_STREAM_H_
+#define REALSENSE_UPLOAD_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bounded-queue.h"
+#include "depth-raw.h"
+
+struct UploadOptions {
+  // Unix socket the uploader connects to.
+  std::string socket_path;
+  // Compression of the chunks: none, lz4 or zstd, as in --depth_compression. A chunk, which doesn't get
+  // smaller, e.g. one of JPEGs, goes as is.
+  Z16Compression compression = kZ16None;
+  // Bytes of a pack per chunk, before the compression.
+  size_t chunk_size = 1 << 20;
+  // Chunks buffered between the packs and the socket. All of their memory is allocated at startup.
+  int chunks = 16;
+};
+
+// Upload stream on the socket: the packs are sent one after another, each as a sequence of chunks.
+// A chunk is an UploadChunkHeader followed by size bytes. All fields are little-endian.
+//
+// The chunks of a pack are consecutive raw_size byte pieces of exactly the pack file, which is written to
+// disk (see pack-file.h), starting at offset 0. The first one has kUploadFirstChunk set, and the last
+// one kUploadLastChunk. If the uploader can't keep up, or reconnects, a pack may end without its last chunk:
+// the first chunk of the next pack comes instead, and the pack is only on disk.
+struct UploadChunkHeader {
+  char magic[4];        // "RSUP"
+  uint8_t flags;        // UploadChunkFlags
+  uint8_t compression;  // Z16Compression of this chunk: a single LZ4 block or a single zstd frame.
+  uint16_t reserved;
+  uint32_t size;
+  uint32_t raw_size;
+  // Starts with 1, and goes up with every pack of the process.
+  uint64_t pack_id;
+  // Of the raw chunk in the pack file, and the size of the whole file.
+  uint64_t offset;
+  uint64_t pack_size;
+  // Name of the pack file on disk, as in the request. NUL-terminated, and cut at the front, if too long.
+  char name[88];
+};
+
+static_assert(sizeof(UploadChunkHeader) == 128, "UploadChunkHeader must be 128 bytes");
+
+enum UploadChunkFlags {
+  kUploadFirstChunk = 1,
+  kUploadLastChunk = 2,
+};
+
+// A client, which can't take a chunk for that long, is disconnected.
+const int kUploadSendTimeoutSec = 10;
+// How often submit, while it waits for a chunk, checks, if the client is still there.
+const int kUploadClientCheckMs = 100;
+
+struct UploadCompressor;
+
+// UploadStream tees the packs, while they are still in memory, into an upload stream for a single client of
+// a Unix socket, e.g. the agent, which forwards them to the server. Then nobody reads them back from the disk.
+//
+// The chunks are compressed by the thread, which submits the pack, into a fixed pool of buffers, and sent by
+// the upload thread. Once they are all queued, submit blocks, until the client takes some: a slow uplink holds up
+// the pack requests, rather than grows the memory. A client, which takes nothing for kUploadSendTimeoutSec,
+// is disconnected, so it can't stall them for longer. Without a client, the packs are only written to disk.
+class UploadStream {
+ public:
+  // Binds the socket and allocates the chunks. Returns nullptr and sets err on failure.
+  static std::unique_ptr<UploadStream> create(const UploadOptions& opts, std::string* err);
+  ~UploadStream();
+
+  // Starts the upload thread.
+  void start();
+
+  // Queues the pack laid out in iov (see PackWriter::layout), of size bytes, as the file name. The data is
+  // copied into the chunks, so it may be reused once submit returns. Returns the pack id, or 0, if there is
+  // no client, or it's gone before the last chunk is queued. Only called by a single thread.
+  uint64_t submit(const std::string& name, const std::vector<iovec>& iov, uint64_t size);
+
+  // Chunks waiting for the client.
+  size_t queued() { return full_.size(); }
+  // Bytes sent to the clients, after the compression.
+  uint64_t bytes_sent() const { return bytes_sent_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Chunk {
+    // Of the client the chunk is for: a chunk of a previous client is dropped.
+    uint64_t client = 0;
+    // UploadChunkHeader, then the payload.
+    std::vector<uint8_t> data;
+    size_t size = 0;
+  };
+
+  UploadStream(const UploadOptions& opts, int listen_fd);
+
+  void run();
+  // Puts the next h->raw_size bytes of iov into the payload of the chunk, compressed, if it pays off,
+  // and sets the compression and the size in h. *pos and *pos_offset are where the bytes start: an iovec
+  // and an offset in it. They are moved past the bytes.
+  void fill(UploadChunkHeader* h, const std::vector<iovec>& iov, size_t* pos, size_t* pos_offset, Chunk* chunk);
+
+  UploadOptions opts_;
+  int listen_fd_;
+  // Counts the clients. Set before connected_.
+  std::atomic<uint64_t> client_{0};
+  std::atomic<bool> connected_{false};
+  std::atomic<uint64_t> bytes_sent_{0};
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+  // Every chunk is in one of them, or held by the thread filling or sending it.
+  BoundedQueue<Chunk*> free_;
+  BoundedQueue<Chunk*> full_;
+  // Only used by the thread calling submit.
+  uint64_t next_pack_id_ = 1;
+  std::vector<uint8_t> raw_;
+  UploadCompressor* compressor_ = nullptr;
+};
+
+#endif  // REALSENSE_UPLOAD_STREAM_H_